@@ -0,0 +1,567 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "stb_image.h"
+
+#include "util.h"
+
+#include "assets.h"
+#include "gr_mesh.h"
+
+typedef struct Job {
+	void (*fn)(Asset* asset);
+	Asset* asset;
+	struct Job* next;
+} Job;
+
+#define MAX_WORKERS 16
+
+static SDL_Thread* workers[MAX_WORKERS];
+static int numWorkers = 0;
+
+// Job queue, protected by queueLock
+static SDL_mutex* queueLock;
+static SDL_cond* queueCond;
+static Job* queueHead = NULL;
+static Job* queueTail = NULL;
+static bool quitting = false;
+
+// Texture cache, also protected by queueLock
+#define MAX_TEXTURES 256
+static Asset* textures[MAX_TEXTURES];
+static int numTextures = 0;
+static SDL_atomic_t compressTextures;
+
+// Texture streaming, see Assets_UpdateTextures
+typedef enum {
+	STREAM_IDLE,
+	STREAM_BUSY,
+	STREAM_DONE,
+	STREAM_FAILED,
+} StreamState;
+
+// Levels no bigger than this are never evicted, so there's always something to sample
+#define STREAM_TAIL_SIZE 64
+// Stream requests queued at once, so a sudden change of view doesn't fill the job queue
+#define MAX_STREAMS_IN_FLIGHT 4
+
+static size_t textureBudget = 0;
+static size_t textureMemory = 0;
+static int frameIndex = 0;
+
+// Mip cache file, written next to the image: MipCacheHeader then every level's data,
+// in the texture's format and layout, largest level first
+#define MIP_CACHE_MAGIC "GRTEX1"
+#define MIP_CACHE_MAX_LEVELS 32
+
+typedef struct {
+	char magic[8];
+	int format;
+	int layout;
+	int width;
+	int height;
+	int numLevels;
+	// The image the cache was built from, so it's rebuilt if the image changes
+	long long sourceSize;
+	long long sourceTime;
+	long long dataSize;
+	long long levelOffsets[MIP_CACHE_MAX_LEVELS]; // From the end of the header
+} MipCacheHeader;
+
+static void submit(void (*fn)(Asset* asset), Asset* asset) {
+	Job* job = xmalloc(sizeof(Job));
+	job->fn = fn;
+	job->asset = asset;
+	job->next = NULL;
+
+	SDL_LockMutex(queueLock);
+	if (queueTail) {
+		queueTail->next = job;
+	}
+	else {
+		queueHead = job;
+	}
+	queueTail = job;
+	SDL_CondSignal(queueCond);
+	SDL_UnlockMutex(queueLock);
+}
+
+static int workerMain(void* data) {
+	while (true) {
+		SDL_LockMutex(queueLock);
+		while (queueHead == NULL && !quitting) {
+			SDL_CondWait(queueCond, queueLock);
+		}
+		if (queueHead == NULL) {
+			SDL_UnlockMutex(queueLock);
+			return 0;
+		}
+
+		Job* job = queueHead;
+		queueHead = job->next;
+		if (queueHead == NULL) {
+			queueTail = NULL;
+		}
+		SDL_UnlockMutex(queueLock);
+
+		job->fn(job->asset);
+		free(job);
+	}
+}
+
+void Assets_Init(int numThreads) {
+	if (numThreads <= 0) {
+		numThreads = SDL_GetCPUCount() - 1;
+	}
+	numThreads = max(min(numThreads, MAX_WORKERS), 1);
+
+	queueLock = SDL_CreateMutex();
+	queueCond = SDL_CreateCond();
+	quitting = false;
+
+	for (int i = 0; i < numThreads; i++) {
+		workers[numWorkers++] = SDL_CreateThread(workerMain, "asset loader", NULL);
+	}
+}
+
+void Assets_Shutdown(void) {
+	// Workers finish whatever is still queued before exiting
+	SDL_LockMutex(queueLock);
+	quitting = true;
+	SDL_CondBroadcast(queueCond);
+	SDL_UnlockMutex(queueLock);
+
+	for (int i = 0; i < numWorkers; i++) {
+		SDL_WaitThread(workers[i], NULL);
+	}
+	numWorkers = 0;
+
+	SDL_DestroyCond(queueCond);
+	SDL_DestroyMutex(queueLock);
+}
+
+static Asset* newAsset(const char* path) {
+	Asset* asset = xmalloc(sizeof(Asset));
+	memset(asset, 0, sizeof(Asset));
+	SDL_AtomicSet(&asset->state, ASSET_LOADING);
+	snprintf(asset->path, sizeof(asset->path), "%s", path);
+	return asset;
+}
+
+static grTextureFormat textureFormatFor(int components) {
+	if (SDL_AtomicGet(&compressTextures)) {
+		return components == 4 ? GR_BC3 : GR_BC1;
+	}
+
+	switch (components) {
+	case 1:
+	case 2:
+		return GR_R8;
+	case 4:
+		return GR_RGBA8;
+	default:
+		return GR_RGB8;
+	}
+}
+
+static void mipCachePath(const Asset* asset, char* out, size_t size) {
+	snprintf(out, size, "%s.grt", asset->path);
+}
+
+// First level no bigger than STREAM_TAIL_SIZE
+static int tailLevelFor(int width, int height) {
+	int level = 0;
+	while (max(width, height) >> level > STREAM_TAIL_SIZE) {
+		level++;
+	}
+	return level;
+}
+
+// Writes the mip cache a level at a time as grTexture_BuildLevels makes them. The header goes
+// in last, so a cache that wasn't finished never looks valid.
+typedef struct {
+	FILE* f;
+	MipCacheHeader header;
+	long long offset;
+} MipCacheWriter;
+
+static bool writeMipCacheLevel(void* user, const grTexture* tex, int level) {
+	MipCacheWriter* w = user;
+	if (level >= MIP_CACHE_MAX_LEVELS) {
+		return false;
+	}
+	size_t size = tex->mipmaps[level].layerSize;
+	w->header.levelOffsets[level] = w->offset;
+	w->offset += size;
+	return fwrite(tex->mipmaps[level].data, 1, size, w->f) == size;
+}
+
+// Build the texture's mip chain from the image, writing it all to the cache but only keeping
+// residentLevel and coarser levels
+static bool buildMipCache(const Asset* asset, grTexture* tex, const void* image, int width, int height,
+	int residentLevel, const struct stat* source) {
+	char path[1100];
+	mipCachePath(asset, path, sizeof(path));
+	MipCacheWriter w;
+	memset(&w, 0, sizeof(w));
+	w.f = fopen(path, "wb");
+	if (!w.f) {
+		return false;
+	}
+
+	bool ok = fwrite(&w.header, sizeof(w.header), 1, w.f) == 1 &&
+		grTexture_BuildLevels(tex, image, width, height, residentLevel, writeMipCacheLevel, &w);
+
+	MipCacheHeader* header = &w.header;
+	memcpy(header->magic, MIP_CACHE_MAGIC, sizeof(MIP_CACHE_MAGIC));
+	header->format = tex->format;
+	header->layout = tex->layout;
+	header->width = width;
+	header->height = height;
+	header->numLevels = tex->numMipmaps;
+	header->sourceSize = source->st_size;
+	header->sourceTime = source->st_mtime;
+	header->dataSize = w.offset;
+	ok = ok && fseek64(w.f, 0, SEEK_SET) == 0 && fwrite(header, sizeof(*header), 1, w.f) == 1;
+	ok = fclose(w.f) == 0 && ok;
+	if (!ok) {
+		remove(path);
+	}
+	return ok;
+}
+
+// Load just the tail of the mip chain from the cache, if it's there and up to date
+static grTexture* readMipCache(const Asset* asset, grTextureFormat format, const struct stat* source) {
+	char path[1100];
+	mipCachePath(asset, path, sizeof(path));
+	FILE* f = fopen(path, "rb");
+	if (!f) {
+		return NULL;
+	}
+
+	MipCacheHeader header;
+	if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, MIP_CACHE_MAGIC, sizeof(MIP_CACHE_MAGIC)) != 0 ||
+		header.format != (int)format || header.layout != GR_LAYOUT_LINEAR ||
+		header.sourceSize != source->st_size || header.sourceTime != source->st_mtime ||
+		header.numLevels <= 0 || header.numLevels > MIP_CACHE_MAX_LEVELS) {
+		fclose(f);
+		return NULL;
+	}
+
+	// Everything below comes from the file, so it has to make sense before anything is allocated
+	long long fileSize = fseek64(f, 0, SEEK_END) == 0 ? ftell64(f) : -1;
+	bool valid = header.width > 0 && header.height > 0 && header.levelOffsets[0] == 0 &&
+		header.dataSize >= 0 && (long long)sizeof(header) + header.dataSize <= fileSize;
+	for (int i = 1; i < header.numLevels && valid; i++) {
+		valid = header.levelOffsets[i] >= header.levelOffsets[i - 1];
+	}
+	if (!valid || header.levelOffsets[header.numLevels - 1] > header.dataSize) {
+		fclose(f);
+		return NULL;
+	}
+
+	int tail = min(tailLevelFor(header.width, header.height), header.numLevels - 1);
+	size_t size = (size_t)(header.dataSize - header.levelOffsets[tail]);
+	void* data = xmalloc(size);
+	bool ok = fseek64(f, sizeof(header) + header.levelOffsets[tail], SEEK_SET) == 0 && fread(data, 1, size, f) == size;
+	fclose(f);
+	if (!ok) {
+		free(data);
+		return NULL;
+	}
+
+	grTexture* tex = grTexture_Create(header.width, header.height);
+	tex->format = format;
+	grTexture_SetResidentData(tex, data, tail, header.width, header.height);
+	if (tex->numMipmaps != header.numLevels || grTexture_TailBytes(tex, 0) != (size_t)header.dataSize) {
+		grTexture_Destroy(tex);
+		return NULL;
+	}
+	return tex;
+}
+
+// Read levels streamLevel and coarser back in from the mip cache
+static void streamTextureJob(Asset* asset) {
+	char path[1100];
+	mipCachePath(asset, path, sizeof(path));
+	FILE* f = fopen(path, "rb");
+	if (!f) {
+		SDL_AtomicSet(&asset->streamState, STREAM_FAILED);
+		return;
+	}
+
+	// The levels are stored largest first, so the tail is at the end of the file
+	grTexture* tex = asset->tex;
+	long long offset = sizeof(MipCacheHeader) + grTexture_TailBytes(tex, 0) - asset->streamBytes;
+	asset->streamData = xmalloc(asset->streamBytes);
+	bool ok = fseek64(f, offset, SEEK_SET) == 0 && fread(asset->streamData, 1, asset->streamBytes, f) == asset->streamBytes;
+	fclose(f);
+
+	if (!ok) {
+		free(asset->streamData);
+		asset->streamData = NULL;
+	}
+	SDL_AtomicSet(&asset->streamState, ok ? STREAM_DONE : STREAM_FAILED);
+}
+
+static void loadTextureJob(Asset* asset) {
+	int tw;
+	int th;
+	int comp;
+	if (!stbi_info(asset->path, &tw, &th, &comp)) {
+		printf("Unable to load texture %s\n", asset->path);
+		SDL_AtomicSet(&asset->state, ASSET_FAILED);
+		return;
+	}
+
+	// Keep as few channels as the file has. Grey + alpha is loaded as plain grey,
+	// RG8 would sample the alpha as green.
+	grTextureFormat format = textureFormatFor(comp);
+
+	struct stat source;
+	bool stream = textureBudget > 0 && stat(asset->path, &source) == 0;
+	if (stream) {
+		grTexture* tex = readMipCache(asset, format, &source);
+		if (tex) {
+			printf("Loaded %s (%dx%d) from its mip cache, %zu KB resident\n", asset->path, tw, th, tex->dataSize >> 10);
+			asset->tex = tex;
+			asset->streamable = true;
+			asset->tailLevel = tex->residentLevel;
+			asset->wantedLevel = tex->residentLevel;
+			SDL_AtomicSet(&asset->state, ASSET_READY);
+			return;
+		}
+	}
+
+	void* texData = stbi_load(asset->path, &tw, &th, &comp, grTextureFormat_Components(format));
+	if (!texData) {
+		printf("Unable to load texture %s\n", asset->path);
+		SDL_AtomicSet(&asset->state, ASSET_FAILED);
+		return;
+	}
+
+	grTexture* tex = grTexture_Create(tw, th);
+	tex->format = format;
+
+	// With a budget the finer levels go straight to the cache, so the whole chain is never
+	// in memory at once. Without a cache to stream from every level has to stay resident.
+	int tail = tailLevelFor(tw, th);
+	if (stream && buildMipCache(asset, tex, texData, tw, th, tail, &source)) {
+		asset->streamable = true;
+		asset->tailLevel = tex->residentLevel;
+		asset->wantedLevel = asset->tailLevel;
+	}
+	else {
+		grTexture_SetData(tex, texData, tw, th);
+	}
+	stbi_image_free(texData);
+
+	printf("Loaded %s (%dx%d, %zu KB resident), mip chain built in %.2f ms\n",
+		asset->path, tw, th, tex->dataSize >> 10, tex->mipGenTime);
+
+	asset->tex = tex;
+	SDL_AtomicSet(&asset->state, ASSET_READY);
+}
+
+void Assets_SetTextureCompression(bool enabled) {
+	SDL_AtomicSet(&compressTextures, enabled);
+}
+
+void Assets_SetTextureBudget(size_t bytes) {
+	textureBudget = bytes;
+}
+
+size_t Assets_TextureMemory(void) {
+	return textureMemory;
+}
+
+// Hand a finished stream over to the texture
+static void finishStream(Asset* asset) {
+	switch (SDL_AtomicGet(&asset->streamState)) {
+	case STREAM_DONE:
+		grTexture_SetResidentData(asset->tex, asset->streamData, asset->streamLevel, asset->tex->width, asset->tex->height);
+		asset->streamData = NULL;
+		SDL_AtomicSet(&asset->streamState, STREAM_IDLE);
+		break;
+	case STREAM_FAILED:
+		// Keep what's resident and stop streaming this one
+		printf("Unable to stream %s from its mip cache\n", asset->path);
+		asset->streamable = false;
+		SDL_AtomicSet(&asset->streamState, STREAM_IDLE);
+		break;
+	default:
+		break;
+	}
+}
+
+// Whether asset has levels that weren't needed by the last frame it was drawn in, or
+// wasn't drawn by the last frame at all
+static bool canEvict(Asset* asset) {
+	if (!asset->streamable || SDL_AtomicGet(&asset->streamState) != STREAM_IDLE) {
+		return false;
+	}
+	int level = asset->tex->residentLevel;
+	return level < asset->tailLevel && (level < asset->wantedLevel || asset->lastUsedFrame < frameIndex);
+}
+
+// Evict levels from other textures, least recently used first, until bytes are free.
+// Returns whether that was enough.
+static bool evict(Asset* except, size_t bytes, int count, size_t* used) {
+	size_t freed = 0;
+	while (freed < bytes) {
+		Asset* victim = NULL;
+		for (int i = 0; i < count; i++) {
+			Asset* a = textures[i];
+			if (a == except || !Asset_IsReady(a) || !canEvict(a)) {
+				continue;
+			}
+			// Oldest first, then whichever has the finest level resident
+			if (!victim || a->lastUsedFrame < victim->lastUsedFrame ||
+				(a->lastUsedFrame == victim->lastUsedFrame && a->tex->residentLevel < victim->tex->residentLevel)) {
+				victim = a;
+			}
+		}
+		if (!victim) {
+			return false;
+		}
+
+		// One level at a time, the texture may still be wanted at a coarser one
+		grTexture* tex = victim->tex;
+		size_t before = tex->dataSize;
+		grTexture_Evict(tex, tex->residentLevel + 1);
+		freed += before - tex->dataSize;
+		*used -= before - tex->dataSize;
+	}
+	return true;
+}
+
+void Assets_UpdateTextures(void) {
+	if (textureBudget == 0) {
+		return;
+	}
+	frameIndex++;
+
+	// Assets are only ever added to the cache, so the first count stay put after unlocking
+	SDL_LockMutex(queueLock);
+	int count = numTextures;
+	SDL_UnlockMutex(queueLock);
+
+	// Find out what the last frame sampled
+	size_t used = 0;
+	int inFlight = 0;
+	for (int i = 0; i < count; i++) {
+		Asset* a = textures[i];
+		if (!Asset_IsReady(a)) {
+			continue;
+		}
+
+		grTexture* tex = a->tex;
+		if (a->streamable) {
+			finishStream(a);
+			if (tex->sampledLevel < tex->numMipmaps) {
+				a->wantedLevel = tex->sampledLevel;
+				a->lastUsedFrame = frameIndex;
+			}
+			if (SDL_AtomicGet(&a->streamState) == STREAM_BUSY) {
+				used += a->streamBytes;
+				inFlight++;
+			}
+		}
+		tex->sampledLevel = tex->numMipmaps;
+		used += tex->dataSize;
+	}
+
+	// Stream in the levels that were wanted by textures drawn in the last frame. If there
+	// isn't room even after evicting everything that isn't needed, settle for a coarser level.
+	for (int i = 0; i < count && inFlight < MAX_STREAMS_IN_FLIGHT; i++) {
+		Asset* a = textures[i];
+		if (!Asset_IsReady(a) || !a->streamable || a->lastUsedFrame != frameIndex ||
+			SDL_AtomicGet(&a->streamState) != STREAM_IDLE) {
+			continue;
+		}
+
+		grTexture* tex = a->tex;
+		for (int level = a->wantedLevel; level < tex->residentLevel; level++) {
+			// The old levels stay around until the new ones are installed
+			size_t bytes = grTexture_TailBytes(tex, level);
+			if (used + bytes <= textureBudget || evict(a, used + bytes - textureBudget, count, &used)) {
+				a->streamLevel = level;
+				a->streamBytes = bytes;
+				SDL_AtomicSet(&a->streamState, STREAM_BUSY);
+				submit(streamTextureJob, a);
+				used += bytes;
+				inFlight++;
+				break;
+			}
+		}
+	}
+
+	textureMemory = used;
+}
+
+Asset* Assets_LoadTexture(const char* path) {
+	SDL_LockMutex(queueLock);
+	for (int i = 0; i < numTextures; i++) {
+		if (strcmp(textures[i]->path, path) == 0) {
+			SDL_UnlockMutex(queueLock);
+			return textures[i];
+		}
+	}
+
+	Asset* asset = newAsset(path);
+	if (numTextures < MAX_TEXTURES) {
+		textures[numTextures++] = asset;
+	}
+	SDL_UnlockMutex(queueLock);
+
+	submit(loadTextureJob, asset);
+	return asset;
+}
+
+static void optimizeMesh(grMesh* m) {
+	float before = grMesh_ACMR(m, 16);
+
+	grMesh_Weld(m);
+	grMesh_OptimizeVertexCache(m);
+	grMesh_OptimizeOverdraw(m);
+	grMesh_OptimizeVertexFetch(m);
+
+	printf("ACMR before optimisation: %.3f, after: %.3f (%d vertices, %d triangles)\n",
+		before, grMesh_ACMR(m, 16), m->numVerts, m->count);
+}
+
+static void loadMeshJob(Asset* asset) {
+	size_t len = strlen(asset->path);
+	bool binary = len > 4 && strcmp(asset->path + len - 4, ".grm") == 0;
+	if (!(binary ? objLoadBinary(&asset->model, asset->path) : objLoad(&asset->model, asset->path))) {
+		SDL_AtomicSet(&asset->state, ASSET_FAILED);
+		return;
+	}
+
+	optimizeMesh(&asset->model.mesh);
+
+	// Textures load in parallel on the other workers
+	objModel* model = &asset->model;
+	asset->textures = xmalloc(max(model->numMaterials, 1) * sizeof(Asset*));
+	for (int i = 0; i < model->numMaterials; i++) {
+		asset->textures[i] = model->materials[i].diffuseMap[0] ? Assets_LoadTexture(model->materials[i].diffuseMap) : NULL;
+	}
+
+	SDL_AtomicSet(&asset->state, ASSET_READY);
+}
+
+Asset* Assets_LoadMesh(const char* path) {
+	Asset* asset = newAsset(path);
+	submit(loadMeshJob, asset);
+	return asset;
+}
+
+AssetState Asset_GetState(Asset* asset) {
+	return SDL_AtomicGet(&asset->state);
+}
+
+bool Asset_IsReady(Asset* asset) {
+	return asset && SDL_AtomicGet(&asset->state) == ASSET_READY;
+}
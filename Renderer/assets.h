@@ -0,0 +1,81 @@
+#ifndef ASSETS_H
+#define ASSETS_H
+
+#include <stdbool.h>
+
+#include <SDL.h>
+
+#include "gr.h"
+#include "obj.h"
+
+// Asynchronous asset loading.
+// Meshes and textures are decoded (and mip chains built) on worker threads. Loads
+// return a handle straight away and the render thread polls Asset_IsReady, drawing
+// placeholders until then. Only the worker that loads an asset writes to it, and it
+// doesn't touch it again after publishing the state, so the render thread can read
+// a ready asset without locking.
+
+typedef enum {
+	ASSET_LOADING,
+	ASSET_READY,
+	ASSET_FAILED,
+} AssetState;
+
+typedef struct Asset Asset;
+
+struct Asset {
+	SDL_atomic_t state;
+	char path[1024];
+
+	// Textures
+	grTexture* tex;
+
+	// Texture streaming, see Assets_SetTextureBudget. Only touched by the render thread,
+	// apart from streamData which the worker streaming levels in hands over with streamState.
+	bool streamable; // Has a mip cache to stream levels back in from
+	int tailLevel; // This level and coarser ones are always resident
+	int wantedLevel; // Finest level sampled the last time the texture was drawn
+	int lastUsedFrame;
+	int streamLevel; // Level being streamed in, along with all the coarser ones
+	size_t streamBytes;
+	void* streamData;
+	SDL_atomic_t streamState;
+
+	// Meshes. The material textures are requested once the mesh has been parsed,
+	// one per material (NULL if the material has no texture).
+	objModel model;
+	Asset** textures;
+};
+
+// Start the worker threads. numThreads <= 0 picks one per CPU, less one for the render thread.
+void Assets_Init(int numThreads);
+void Assets_Shutdown(void);
+
+// Load an OBJ (or .grm) mesh plus its material textures
+Asset* Assets_LoadMesh(const char* path);
+
+// Block compress textures loaded from now on, BC1 or BC3 if the image has alpha
+void Assets_SetTextureCompression(bool enabled);
+
+// Textures are cached by path, so loading the same file twice returns the same asset
+Asset* Assets_LoadTexture(const char* path);
+
+// Keep textures under a memory budget (0, the default, keeps every level of every texture
+// resident). Set it before loading anything.
+// With a budget each texture's mip chain is written to a cache file next to the image
+// (or read back from it if it's up to date) and only the small levels are kept. The chain is
+// written a level at a time as it's built, so loading the image the first time only needs the
+// decoded image and about a third of it again on top of the small levels. Finer levels
+// are streamed back in from the cache on the worker threads when the sampler wants them,
+// and the least recently used ones are evicted to make room.
+void Assets_SetTextureBudget(size_t bytes);
+// Call once per frame on the render thread, after drawing. Installs the levels that have
+// finished streaming in, then evicts and requests levels based on what the frame sampled.
+void Assets_UpdateTextures(void);
+// Bytes of texture data resident or being streamed in
+size_t Assets_TextureMemory(void);
+
+AssetState Asset_GetState(Asset* asset);
+bool Asset_IsReady(Asset* asset);
+
+#endif
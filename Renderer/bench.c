@@ -0,0 +1,1339 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include <SDL.h>
+
+#include "util.h"
+
+#include "bench.h"
+#include "gr.h"
+#include "gr_atlas.h"
+#include "gr_shader.h"
+#include "gr_command.h"
+
+static double seconds(void) {
+	return (double)SDL_GetPerformanceCounter() / SDL_GetPerformanceFrequency();
+}
+
+static uint32_t rngState = 12345;
+static uint32_t rng(void) {
+	// xorshift32
+	rngState ^= rngState << 13;
+	rngState ^= rngState >> 17;
+	rngState ^= rngState << 5;
+	return rngState;
+}
+
+static grTexture* makeNoiseTexture(int size, grTextureLayout layout) {
+	rgb* data = xmalloc(size * size * sizeof(rgb));
+	rngState = 12345;
+	for (int i = 0; i < size * size; i++) {
+		uint32_t r = rng();
+		data[i] = (rgb){ r & 255, (r >> 8) & 255, (r >> 16) & 255 };
+	}
+
+	grTexture* tex = grTexture_Create(size, size);
+	tex->layout = layout;
+	grTexture_SetData(tex, data, size, size);
+	free(data);
+	return tex;
+}
+
+// Quad in the xy plane facing the camera
+static grVertex QUAD_VERTS[4] = {
+	{{-1, -1, 0}, {0, 1}},
+	{{1, -1, 0}, {1, 1}},
+	{{1, 1, 0}, {1, 0}},
+	{{-1, 1, 0}, {0, 0}},
+};
+
+static int QUAD_INDICES[6] = {
+	0, 1, 2,
+	0, 2, 3,
+};
+
+// The math library as it was before it was made inline and SIMD, as the baseline
+#ifdef _MSC_VER
+#define BENCH_NOINLINE __declspec(noinline)
+#else
+#define BENCH_NOINLINE __attribute__((noinline))
+#endif
+
+static BENCH_NOINLINE vec4 refMat4MulVec4(const mat4* m, vec4 v) {
+	const float* M = m->m;
+	return (vec4) {
+		v.x * M[0] + v.y * M[1] + v.z * M[2] + v.w * M[3],
+		v.x * M[4] + v.y * M[5] + v.z * M[6] + v.w * M[7],
+		v.x * M[8] + v.y * M[9] + v.z * M[10] + v.w * M[11],
+		v.x * M[12] + v.y * M[13] + v.z * M[14] + v.w * M[15],
+	};
+}
+
+static BENCH_NOINLINE vec3 refVec3Normalize(vec3 v) {
+	float l = sqrtf(v.x * v.x + v.y * v.y + v.z * v.z);
+	return (vec3) { v.x / l, v.y / l, v.z / l };
+}
+
+static float randomFloat(void) {
+	return (float)(rng() % 20000) / 1000 - 10;
+}
+
+static float maxDifference(const float* a, const float* b, int count) {
+	float d = 0;
+	for (int i = 0; i < count; i++) {
+		d = max(d, fabsf(a[i] - b[i]));
+	}
+	return d;
+}
+
+#define MATH_COUNT 4096
+#define MATH_REPEATS 500
+
+static void printMathRow(const char* name, double refSeconds, double newSeconds, float difference) {
+	double ops = (double)MATH_COUNT * MATH_REPEATS;
+	printf("  %-18s %10.2f %10.2f %10.2fx %10g\n", name, refSeconds * 1e9 / ops, newSeconds * 1e9 / ops,
+		refSeconds / newSeconds, difference);
+}
+
+static void benchMath(void) {
+	printf("Math: %d items x %d repeats\n", MATH_COUNT, MATH_REPEATS);
+	printf("  %-18s %10s %10s %11s %10s\n", "op", "old ns/op", "new ns/op", "speedup", "max diff");
+
+	grVertex* verts = xmalloc(MATH_COUNT * sizeof(grVertex));
+	vec4* refOut = xmalloc(MATH_COUNT * sizeof(vec4));
+	vec4* newOut = xmalloc(MATH_COUNT * sizeof(vec4));
+	vec3* normals = xmalloc(MATH_COUNT * sizeof(vec3));
+	vec3* refNormals = xmalloc(MATH_COUNT * sizeof(vec3));
+	vec3* newNormals = xmalloc(MATH_COUNT * sizeof(vec3));
+
+	mat4 mvp;
+	for (int j = 0; j < 16; j++) {
+		mvp.m[j] = randomFloat();
+	}
+	for (int i = 0; i < MATH_COUNT; i++) {
+		memset(&verts[i], 0, sizeof(grVertex));
+		verts[i].pos = (vec3) { randomFloat(), randomFloat(), randomFloat() };
+		normals[i] = (vec3) { randomFloat(), randomFloat(), randomFloat() + 20 };
+	}
+
+	// Vertex positions, one call each against a batch
+	double start = seconds();
+	for (int r = 0; r < MATH_REPEATS; r++) {
+		for (int i = 0; i < MATH_COUNT; i++) {
+			vec3 p = verts[i].pos;
+			refOut[i] = refMat4MulVec4(&mvp, (vec4) { p.x, p.y, p.z, 1 });
+		}
+	}
+	double refTime = seconds() - start;
+	start = seconds();
+	for (int r = 0; r < MATH_REPEATS; r++) {
+		mat4_mul_points(&mvp, &verts[0].pos, sizeof(grVertex), newOut, MATH_COUNT);
+	}
+	printMathRow("mat4_mul_points", refTime, seconds() - start, maxDifference(&refOut[0].x, &newOut[0].x, MATH_COUNT * 4));
+
+	start = seconds();
+	for (int r = 0; r < MATH_REPEATS; r++) {
+		for (int i = 0; i < MATH_COUNT; i++) {
+			refNormals[i] = refVec3Normalize(normals[i]);
+		}
+	}
+	refTime = seconds() - start;
+	start = seconds();
+	for (int r = 0; r < MATH_REPEATS; r++) {
+		vec3_normalize_batch(normals, newNormals, MATH_COUNT);
+	}
+	printMathRow("vec3_normalize", refTime, seconds() - start, maxDifference(&refNormals[0].x, &newNormals[0].x, MATH_COUNT * 3));
+
+	free(verts);
+	free(refOut);
+	free(newOut);
+	free(normals);
+	free(refNormals);
+	free(newNormals);
+}
+
+typedef struct {
+	const char* name;
+	float distance; // Camera distance. At 640x480 the quad is 480/distance pixels across.
+	float spin; // Rotation about the view axis per frame
+	float tilt; // Rotation about the y axis per frame, like the spinning cactus
+} SceneCase;
+
+static SceneCase LAYOUT_CASES[] = {
+	{ "magnified 2x, rotating", 0.25f, 0.05f, 0 },
+	{ "1:1, rotating", 0.47f, 0.05f, 0 },
+	{ "minified 4x, rotating", 1.9f, 0.05f, 0 },
+	{ "spinning about y", 1.5f, 0, 0.04f },
+};
+
+// Simulated direct mapped 32KB L1 with 64 byte lines
+#define SIM_CACHE_LINES 512
+#define SIM_LINE_SIZE 64
+
+typedef struct {
+	uintptr_t tags[SIM_CACHE_LINES];
+	long long accesses;
+	long long misses;
+} SimCache;
+
+static void simCache_Access(SimCache* c, uintptr_t address) {
+	uintptr_t line = address / SIM_LINE_SIZE;
+	int slot = line % SIM_CACHE_LINES;
+	c->accesses++;
+	if (c->tags[slot] != line) {
+		c->tags[slot] = line;
+		c->misses++;
+	}
+}
+
+// Walk a rotated and scaled grid of uvs the way the rasteriser would (2x2 quads in
+// scanline order) and feed the bilinear footprints' addresses through the cache model.
+// Returns misses per bilinear sample.
+static float simulateSampling(grTexture* tex, float scale, float angle) {
+	static SimCache cache;
+	memset(&cache, 0, sizeof(cache));
+
+	int level = (int)fmaxf(log2f(scale), 0);
+	level = min(level, tex->numMipmaps - 1);
+	grMipmapLevel* mip = &tex->mipmaps[level];
+
+	float c = cosf(angle);
+	float s = sinf(angle);
+	long long samples = 0;
+
+	for (int y = 0; y < 256; y += 2) {
+		for (int x = 0; x < 256; x += 2) {
+			for (int q = 0; q < 4; q++) {
+				float px = (float)(x + (q & 1)) - 128;
+				float py = (float)(y + (q >> 1)) - 128;
+
+				// Texel space position in this level
+				float u = (px * c - py * s) * scale / (1 << level) + mip->width / 2.f;
+				float v = (px * s + py * c) * scale / (1 << level) + mip->height / 2.f;
+
+				int x0 = (int)floorf(u - 0.5f) & (mip->width - 1);
+				int y0 = (int)floorf(v - 0.5f) & (mip->height - 1);
+				int x1 = (x0 + 1) & (mip->width - 1);
+				int y1 = (y0 + 1) & (mip->height - 1);
+
+				int taps[4][2] = { {x0, y0}, {x1, y0}, {x0, y1}, {x1, y1} };
+				for (int t = 0; t < 4; t++) {
+					int index = grTexture_TexelIndex(tex, level, taps[t][0], taps[t][1]);
+					simCache_Access(&cache, (uintptr_t)((uint8_t*)mip->data + index * sizeof(rgb)));
+				}
+				samples++;
+			}
+		}
+	}
+
+	return (float)cache.misses / samples;
+}
+
+static void benchTextureLayout(void) {
+	printf("Texture layout: 1024x1024 noise texture, 640x480, 4x MSAA\n");
+
+	const char* layoutNames[2] = { "linear", "tiled" };
+	grTexture* textures[2] = {
+		makeNoiseTexture(1024, GR_LAYOUT_LINEAR),
+		makeNoiseTexture(1024, GR_LAYOUT_TILED),
+	};
+
+	grDevice* dev = grDevice_Create();
+	dev->fb = grFramebuffer_Create(640, 480);
+	dev->proj = mat4_perspective(deg2rad(90), 640.f / 480, 0.1f, 100);
+
+	grMesh quad = { 0 };
+	quad.verts = QUAD_VERTS;
+	quad.numVerts = 4;
+	quad.indices = QUAD_INDICES;
+	quad.count = 2;
+
+	#define FRAMES 30
+	printf("  %-22s %10s %10s %9s\n", "case", "layout", "ms/frame", "speedup");
+	for (int c = 0; c < sizeof(LAYOUT_CASES) / sizeof(LAYOUT_CASES[0]); c++) {
+		SceneCase* sc = &LAYOUT_CASES[c];
+		dev->view = mat4_lookat((vec3) { 0, 0, sc->distance }, (vec3) { 0, 0, 0 }, (vec3) { 0, 1, 0 });
+
+		double times[2];
+		for (int l = 0; l < 2; l++) {
+			dev->tex = textures[l];
+
+			double start = seconds();
+			for (int f = 0; f < FRAMES; f++) {
+				quad.modelMat = mat4_rotate_zyx(f * sc->spin, f * sc->tilt, 0);
+				grClear(dev, (rgb) { 0, 0, 0 });
+				grDraw(dev, &quad);
+			}
+			times[l] = (seconds() - start) * 1000 / FRAMES;
+
+			printf("  %-22s %10s %10.2f %8.2fx\n", sc->name, layoutNames[l], times[l], times[0] / times[l]);
+		}
+	}
+
+	printf("  Simulated L1 misses per bilinear sample (32KB direct mapped, 64 byte lines)\n");
+	printf("  %-22s %10s %10s\n", "uv scale, angle", "linear", "tiled");
+	float scales[] = { 0.5f, 1, 2, 3 };
+	float angles[] = { 0, 0.5f, 1.5708f };
+	for (int i = 0; i < sizeof(scales) / sizeof(scales[0]); i++) {
+		for (int j = 0; j < sizeof(angles) / sizeof(angles[0]); j++) {
+			char name[64];
+			snprintf(name, sizeof(name), "%.1f, %.2f rad", scales[i], angles[j]);
+			printf("  %-22s %10.3f %10.3f\n", name,
+				simulateSampling(textures[0], scales[i], angles[j]),
+				simulateSampling(textures[1], scales[i], angles[j]));
+		}
+	}
+
+	grTexture_Destroy(textures[0]);
+	grTexture_Destroy(textures[1]);
+	grFramebuffer_Destroy(dev->fb);
+	grDevice_Destroy(dev);
+}
+
+// Smooth gradients and rings, so compression error means something (noise is all error)
+static uint8_t* makePatternData(int size) {
+	uint8_t* data = xmalloc(size * size * 4);
+	for (int y = 0; y < size; y++) {
+		for (int x = 0; x < size; x++) {
+			float dx = x - size / 2.f;
+			float dy = y - size / 2.f;
+			float ring = 0.5f + 0.5f * sinf(sqrtf(dx * dx + dy * dy) * 0.1f);
+			uint8_t* t = &data[(y * size + x) * 4];
+			t[0] = (uint8_t)(255.f * x / size);
+			t[1] = (uint8_t)(255 * ring);
+			t[2] = (uint8_t)(255.f * y / size);
+			t[3] = 255;
+		}
+	}
+	return data;
+}
+
+// Drop the alpha for formats that take 3 components
+static void packComponents(const uint8_t* rgba, uint8_t* out, int texels, int components) {
+	for (int i = 0; i < texels; i++) {
+		memcpy(&out[i * components], &rgba[i * 4], components);
+	}
+}
+
+static double psnr(grFramebuffer* a, grFramebuffer* b) {
+	double sum = 0;
+	int n = a->width * a->height * MSAA_SAMPLES;
+	for (int i = 0; i < a->width * a->height; i++) {
+		for (int s = 0; s < MSAA_SAMPLES; s++) {
+			rgb ca = a->colour[i][s];
+			rgb cb = b->colour[i][s];
+			sum += squaref(ca.r - cb.r) + squaref(ca.g - cb.g) + squaref(ca.b - cb.b);
+		}
+	}
+	double mse = sum / (n * 3.0);
+	return mse == 0 ? INFINITY : 10 * log10(255 * 255 / mse);
+}
+
+static void benchTextureFormats(void) {
+	printf("Texture formats: 1024x1024 pattern texture, 640x480, 4x MSAA\n");
+
+	struct {
+		const char* name;
+		grTextureFormat format;
+	} formats[] = {
+		{ "RGB8", GR_RGB8 },
+		{ "RGBA8", GR_RGBA8 },
+		{ "RGB565", GR_RGB565 },
+		{ "BC1", GR_BC1 },
+		{ "BC3", GR_BC3 },
+	};
+
+	int size = 1024;
+	uint8_t* rgba = makePatternData(size);
+	uint8_t* packed = xmalloc(size * size * 4);
+
+	grDevice* dev = grDevice_Create();
+	dev->proj = mat4_perspective(deg2rad(90), 640.f / 480, 0.1f, 100);
+	// Keep the spinning quad inside the screen, the rasteriser still writes past the right and bottom edges
+	dev->view = mat4_lookat((vec3) { 0, 0, 1.5f }, (vec3) { 0, 0, 0 }, (vec3) { 0, 1, 0 });
+	grFramebuffer* reference = grFramebuffer_Create(640, 480);
+
+	grMesh quad = { 0 };
+	quad.verts = QUAD_VERTS;
+	quad.numVerts = 4;
+	quad.indices = QUAD_INDICES;
+	quad.count = 2;
+
+	printf("  %-8s %10s %10s %10s %10s %10s\n", "format", "KB", "encode ms", "ms/frame", "PSNR dB", "block hit");
+	for (int f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+		grTexture* tex = grTexture_Create(size, size);
+		tex->format = formats[f].format;
+		packComponents(rgba, packed, size * size, grTextureFormat_Components(tex->format));
+		grTexture_SetData(tex, packed, size, size);
+		dev->tex = tex;
+
+		// The first format is RGB8, the other frames are compared against it
+		dev->fb = f == 0 ? reference : grFramebuffer_Create(640, 480);
+
+		memset(&dev->stats, 0, sizeof(dev->stats));
+		double start = seconds();
+		for (int i = 0; i < FRAMES; i++) {
+			quad.modelMat = mat4_rotate_zyx(i * 0.05f, 0, 0);
+			grClear(dev, (rgb) { 0, 0, 0 });
+			grDraw(dev, &quad);
+		}
+		double ms = (seconds() - start) * 1000 / FRAMES;
+
+		long long lookups = dev->stats.blockHits + dev->stats.blockMisses;
+		printf("  %-8s %10zu %10.2f %10.2f %10.2f", formats[f].name, tex->dataSize >> 10, tex->mipGenTime, ms, psnr(reference, dev->fb));
+		if (lookups > 0) {
+			printf(" %9.1f%%", 100.0 * dev->stats.blockHits / lookups);
+		}
+		printf("\n");
+
+		if (dev->fb != reference) {
+			grFramebuffer_Destroy(dev->fb);
+		}
+		grTexture_Destroy(tex);
+	}
+
+	free(rgba);
+	free(packed);
+	grFramebuffer_Destroy(reference);
+	grDevice_Destroy(dev);
+}
+
+// Taps of one output texel along an axis of size texels halved, for the reference
+// reduction: 1 for a size of 1, 2 for even sizes and 3 for odd ones. An odd size 2n + 1 goes
+// down to n texels, each covering 2 + 1/n input texels.
+static int refReduceTaps(int j, int size, double weights[3]) {
+	if (size == 1) {
+		weights[0] = 1;
+		return 1;
+	}
+	if (size % 2 == 0) {
+		weights[0] = weights[1] = 0.5;
+		return 2;
+	}
+	int n = size / 2;
+	weights[0] = (double)(n - j) / size;
+	weights[1] = (double)n / size;
+	weights[2] = (double)(j + 1) / size;
+	return 3;
+}
+
+// Odd sizes are reduced with 3 tap filters whose weights have to add up to 1, or the
+// levels get darker. A constant texture has to stay constant all the way down.
+static void benchTextureNpot(void) {
+	printf("Non power of two textures: mip generation of constant and random textures\n");
+
+	struct {
+		int width;
+		int height;
+	} sizes[] = {
+		{ 3, 3 },
+		{ 7, 1 },
+		{ 1, 5 },
+		{ 1025, 600 },
+		{ 1023, 1023 },
+		{ 1024, 1024 },
+	};
+	const rgb colour = { 200, 100, 37 };
+
+	bool failed = false;
+	printf("  %-10s %8s %10s %10s\n", "size", "levels", "ms", "max error");
+	for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		int w = sizes[s].width;
+		int h = sizes[s].height;
+		rgb* data = xmalloc(w * h * sizeof(rgb));
+		for (int i = 0; i < w * h; i++) {
+			data[i] = colour;
+		}
+
+		grTexture* tex = grTexture_Create(w, h);
+		grTexture_SetData(tex, data, w, h);
+
+		int maxError = 0;
+		for (int level = 0; level < tex->numMipmaps; level++) {
+			const grMipmapLevel* mip = &tex->mipmaps[level];
+			for (int y = 0; y < mip->height; y++) {
+				for (int x = 0; x < mip->width; x++) {
+					rgb c = Texture_ReadTexel(tex, level, 0, x, y);
+					maxError = max(maxError, abs(c.r - colour.r));
+					maxError = max(maxError, abs(c.g - colour.g));
+					maxError = max(maxError, abs(c.b - colour.b));
+				}
+			}
+		}
+		failed |= maxError > 0;
+
+		char name[32];
+		snprintf(name, sizeof(name), "%dx%d", w, h);
+		printf("  %-10s %8d %10.2f %10d\n", name, tex->numMipmaps, tex->mipGenTime, maxError);
+
+		grTexture_Destroy(tex);
+		free(data);
+	}
+
+	if (failed) {
+		printf("  FAILED: a constant texture changed colour through its mip chain\n");
+	}
+
+	// Random images against the polyphase box in double precision. Each level is checked
+	// against the reference reduction of the level above it, as built, so rounding doesn't
+	// add up down the chain.
+	struct {
+		int width;
+		int height;
+	} randomSizes[] = {
+		{ 3, 9 },
+		{ 9, 3 },
+		{ 1025, 600 },
+		{ 1023, 1023 },
+	};
+
+	failed = false;
+	printf("  %-10s %8s %10s %10s\n", "random", "levels", "ms", "max error");
+	for (int s = 0; s < sizeof(randomSizes) / sizeof(randomSizes[0]); s++) {
+		int w = randomSizes[s].width;
+		int h = randomSizes[s].height;
+		uint8_t* data = xmalloc(w * h * 3);
+		for (int i = 0; i < w * h * 3; i++) {
+			data[i] = (uint8_t)rng();
+		}
+
+		grTexture* tex = grTexture_Create(w, h);
+		grTexture_SetData(tex, data, w, h);
+
+		int maxError = 0;
+		for (int level = 1; level < tex->numMipmaps; level++) {
+			const grMipmapLevel* prev = &tex->mipmaps[level - 1];
+			const grMipmapLevel* mip = &tex->mipmaps[level];
+			for (int y = 0; y < mip->height; y++) {
+				double wy[3];
+				int ny = refReduceTaps(y, prev->height, wy);
+				for (int x = 0; x < mip->width; x++) {
+					double wx[3];
+					int nx = refReduceTaps(x, prev->width, wx);
+					double sum[3] = { 0, 0, 0 };
+					for (int a = 0; a < ny; a++) {
+						for (int b = 0; b < nx; b++) {
+							rgb c = Texture_ReadTexel(tex, level - 1, 0, min(x * 2, prev->width - 1) + b, min(y * 2, prev->height - 1) + a);
+							sum[0] += wy[a] * wx[b] * c.r;
+							sum[1] += wy[a] * wx[b] * c.g;
+							sum[2] += wy[a] * wx[b] * c.b;
+						}
+					}
+					rgb c = Texture_ReadTexel(tex, level, 0, x, y);
+					maxError = max(maxError, abs(c.r - (int)floor(sum[0] + 0.5)));
+					maxError = max(maxError, abs(c.g - (int)floor(sum[1] + 0.5)));
+					maxError = max(maxError, abs(c.b - (int)floor(sum[2] + 0.5)));
+				}
+			}
+		}
+		// Rounding the weights can be a unit out, anything more is a wrong filter
+		failed |= maxError > 1;
+
+		char name[32];
+		snprintf(name, sizeof(name), "%dx%d", w, h);
+		printf("  %-10s %8d %10.2f %10d\n", name, tex->numMipmaps, tex->mipGenTime, maxError);
+
+		grTexture_Destroy(tex);
+		free(data);
+	}
+
+	if (failed) {
+		printf("  FAILED: odd size reductions don't match the polyphase box filter\n");
+	}
+}
+
+// grTexture_BuildLevels has to hand over the same levels grTexture_SetData builds.
+// Texels are compared rather than bytes, tiled levels leave the padding uninitialised.
+typedef struct {
+	const grTexture* reference;
+	bool same;
+} BuildLevelsCheck;
+
+static bool sameLevel(const grTexture* a, const grTexture* b, int level) {
+	const grMipmapLevel* mip = &b->mipmaps[level];
+	if (a->mipmaps[level].layerSize != mip->layerSize) {
+		return false;
+	}
+	for (int y = 0; y < mip->height; y++) {
+		for (int x = 0; x < mip->width; x++) {
+			rgb ca = Texture_ReadTexel(a, level, 0, x, y);
+			rgb cb = Texture_ReadTexel(b, level, 0, x, y);
+			if (ca.r != cb.r || ca.g != cb.g || ca.b != cb.b) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static bool checkBuiltLevel(void* user, const grTexture* tex, int level) {
+	BuildLevelsCheck* check = user;
+	check->same &= sameLevel(tex, check->reference, level);
+	return true;
+}
+
+static void benchTextureStreaming(void) {
+	printf("Texture streaming: 1000x700 pattern texture built whole, and a level at a time keeping 64x64 and smaller\n");
+
+	struct {
+		const char* name;
+		grTextureFormat format;
+		grTextureLayout layout;
+	} formats[] = {
+		{ "RGB8", GR_RGB8, GR_LAYOUT_LINEAR },
+		{ "RGB8 tiled", GR_RGB8, GR_LAYOUT_TILED },
+		{ "RGBA8", GR_RGBA8, GR_LAYOUT_LINEAR },
+		{ "RGB565", GR_RGB565, GR_LAYOUT_LINEAR },
+		{ "BC1", GR_BC1, GR_LAYOUT_LINEAR },
+		{ "BC3", GR_BC3, GR_LAYOUT_LINEAR },
+	};
+
+	int w = 1000;
+	int h = 700;
+	// The pattern is square, use the top left of it
+	uint8_t* rgba = makePatternData(w);
+	uint8_t* packed = xmalloc(w * h * 4);
+
+	bool failed = false;
+	printf("  %-12s %10s %10s %8s\n", "format", "chain KB", "kept KB", "same");
+	for (int f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+		grTexture* whole = grTexture_Create(w, h);
+		whole->format = formats[f].format;
+		whole->layout = formats[f].layout;
+		packComponents(rgba, packed, w * h, grTextureFormat_Components(whole->format));
+		grTexture_SetData(whole, packed, w, h);
+
+		grTexture* tex = grTexture_Create(w, h);
+		tex->format = formats[f].format;
+		tex->layout = formats[f].layout;
+		BuildLevelsCheck check = { whole, true };
+		int kept = 4; // 62x43
+		check.same &= grTexture_BuildLevels(tex, packed, w, h, kept, checkBuiltLevel, &check);
+		check.same &= tex->residentLevel == kept && tex->dataSize == grTexture_TailBytes(whole, kept);
+		for (int level = kept; level < tex->numMipmaps && check.same; level++) {
+			check.same &= sameLevel(tex, whole, level);
+		}
+		failed |= !check.same;
+
+		printf("  %-12s %10zu %10zu %8s\n", formats[f].name, whole->dataSize >> 10, tex->dataSize >> 10, check.same ? "yes" : "no");
+
+		grTexture_Destroy(tex);
+		grTexture_Destroy(whole);
+	}
+
+	if (failed) {
+		printf("  FAILED: the levels built one at a time don't match\n");
+	}
+
+	free(rgba);
+	free(packed);
+}
+
+static void benchTextureFilters(void) {
+	printf("Texture filters: 1024x1024 pattern texture, 640x480, 4x MSAA\n");
+
+	struct {
+		const char* name;
+		grTextureFilter filter;
+		grTextureWrapMode wrap;
+		float uvScale;
+		int maxAnisotropy;
+		float tilt; // Rotation away from the camera about x, for grazing angles
+	} modes[] = {
+		{ "trilinear", GR_LINEAR_MIPMAP_LINEAR, GR_CLAMP, 1, 1, 0 },
+		{ "nearest mip nearest", GR_NEAREST_MIPMAP_NEAREST, GR_CLAMP, 1, 1, 0 },
+		{ "bilinear", GR_LINEAR, GR_CLAMP, 1, 1, 0 },
+		{ "nearest", GR_NEAREST, GR_CLAMP, 1, 1, 0 },
+		{ "trilinear, clamp 4x", GR_LINEAR_MIPMAP_LINEAR, GR_CLAMP, 4, 1, 0 },
+		{ "trilinear, repeat 4x", GR_LINEAR_MIPMAP_LINEAR, GR_REPEAT, 4, 1, 0 },
+		{ "trilinear, magnified", GR_LINEAR_MIPMAP_LINEAR, GR_CLAMP, 0.25f, 1, 0 },
+		{ "trilinear, tilted", GR_LINEAR_MIPMAP_LINEAR, GR_REPEAT, 4, 1, 1.4f },
+		{ "aniso 4x, tilted", GR_LINEAR_MIPMAP_LINEAR, GR_REPEAT, 4, 4, 1.4f },
+		{ "aniso 16x, tilted", GR_LINEAR_MIPMAP_LINEAR, GR_REPEAT, 4, 16, 1.4f },
+	};
+
+	int size = 1024;
+	uint8_t* rgba = makePatternData(size);
+	grTexture* tex = grTexture_Create(size, size);
+	tex->format = GR_RGBA8;
+	grTexture_SetData(tex, rgba, size, size);
+	free(rgba);
+
+	grDevice* dev = grDevice_Create();
+	dev->fb = grFramebuffer_Create(640, 480);
+	dev->proj = mat4_perspective(deg2rad(90), 640.f / 480, 0.1f, 100);
+	dev->view = mat4_lookat((vec3) { 0, 0, 1.5f }, (vec3) { 0, 0, 0 }, (vec3) { 0, 1, 0 });
+	dev->tex = tex;
+
+	grVertex verts[4];
+	memcpy(verts, QUAD_VERTS, sizeof(verts));
+	grMesh quad = { 0 };
+	quad.verts = verts;
+	quad.numVerts = 4;
+	quad.indices = QUAD_INDICES;
+	quad.count = 2;
+
+	printf("  %-22s %10s %14s %12s %32s\n", "mode", "ms/frame", "samples/frame", "aniso probes", "magnified/single/trilinear quads");
+	for (int m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+		tex->filter = modes[m].filter;
+		tex->wrapU = modes[m].wrap;
+		tex->wrapV = modes[m].wrap;
+		tex->maxAnisotropy = modes[m].maxAnisotropy;
+		for (int i = 0; i < 4; i++) {
+			verts[i].uv.x = QUAD_VERTS[i].uv.x * modes[m].uvScale;
+			verts[i].uv.y = QUAD_VERTS[i].uv.y * modes[m].uvScale;
+		}
+
+		memset(&dev->stats, 0, sizeof(dev->stats));
+		double start = seconds();
+		for (int i = 0; i < FRAMES; i++) {
+			quad.modelMat = mat4_rotate_zyx(i * 0.05f, 0, -modes[m].tilt);
+			grClear(dev, (rgb) { 0, 0, 0 });
+			grDraw(dev, &quad);
+		}
+		double ms = (seconds() - start) * 1000 / FRAMES;
+
+		grSamplerStats* st = &dev->stats;
+		long long quads = st->magnifiedQuads + st->singleLevelQuads + st->trilinearQuads;
+		printf("  %-22s %10.2f %14lld %12lld", modes[m].name, ms, st->samples / FRAMES, st->anisotropicProbes / FRAMES);
+		if (quads > 0) {
+			printf(" %13.1f%% %6.1f%% %9.1f%%", 100.0 * st->magnifiedQuads / quads,
+				100.0 * st->singleLevelQuads / quads, 100.0 * st->trilinearQuads / quads);
+		}
+		printf("\n");
+	}
+
+	grTexture_Destroy(tex);
+	grFramebuffer_Destroy(dev->fb);
+	grDevice_Destroy(dev);
+}
+
+// ATLAS_GRID x ATLAS_GRID quads, each a sub mesh with its own small texture
+#define ATLAS_GRID 8
+#define ATLAS_TEXTURE_SIZE 64
+
+static grMesh makeGridMesh(void) {
+	int cells = ATLAS_GRID * ATLAS_GRID;
+	grMesh m = { 0 };
+	m.verts = xmalloc(cells * 4 * sizeof(grVertex));
+	m.numVerts = cells * 4;
+	m.indices = xmalloc(cells * 6 * sizeof(int));
+	m.count = cells * 2;
+	m.subMeshes = xmalloc(cells * sizeof(grSubMesh));
+	m.numSubMeshes = cells;
+
+	float step = 2.f / ATLAS_GRID;
+	for (int c = 0; c < cells; c++) {
+		float x = -1 + (c % ATLAS_GRID) * step;
+		float y = -1 + (c / ATLAS_GRID) * step;
+		for (int k = 0; k < 4; k++) {
+			grVertex v = QUAD_VERTS[k];
+			v.pos.x = x + (v.pos.x + 1) / 2 * step;
+			v.pos.y = y + (v.pos.y + 1) / 2 * step;
+			m.verts[c * 4 + k] = v;
+		}
+		for (int k = 0; k < 6; k++) {
+			m.indices[c * 6 + k] = c * 4 + QUAD_INDICES[k];
+		}
+		m.subMeshes[c] = (grSubMesh){ c * 2, 2, NULL, 0 };
+	}
+	return m;
+}
+
+// The same grid three ways. The array and the atlas draw it as one batch instead of 64, but
+// they sample the same number of texels at the same levels, so they aren't expected to be
+// faster per frame. The atlas uses more memory for its padding and isn't bit exact.
+static void benchTextureAtlas(void) {
+	printf("Texture atlas: %d sub meshes with %dx%d textures, 640x480, 4x MSAA\n",
+		ATLAS_GRID * ATLAS_GRID, ATLAS_TEXTURE_SIZE, ATLAS_TEXTURE_SIZE);
+
+	const char* names[] = { "separate textures", "texture array", "atlas" };
+	int cells = ATLAS_GRID * ATLAS_GRID;
+	int texels = ATLAS_TEXTURE_SIZE * ATLAS_TEXTURE_SIZE;
+
+	// The pattern with a different tint for each cell
+	uint8_t* rgba = makePatternData(ATLAS_TEXTURE_SIZE);
+	uint8_t* layers = xmalloc(cells * texels * 3);
+	grTexture** textures = xmalloc(cells * sizeof(grTexture*));
+	for (int c = 0; c < cells; c++) {
+		uint8_t* layer = &layers[c * texels * 3];
+		for (int i = 0; i < texels; i++) {
+			layer[i * 3 + 0] = rgba[i * 4 + 0] * (c % 4 + 1) / 4;
+			layer[i * 3 + 1] = rgba[i * 4 + 1] * (c / 4 % 4 + 1) / 4;
+			layer[i * 3 + 2] = rgba[i * 4 + 2] * (c / 16 + 1) / 4;
+		}
+		textures[c] = grTexture_Create(ATLAS_TEXTURE_SIZE, ATLAS_TEXTURE_SIZE);
+		grTexture_SetData(textures[c], layer, ATLAS_TEXTURE_SIZE, ATLAS_TEXTURE_SIZE);
+	}
+
+	grTexture* array = grTexture_Create(ATLAS_TEXTURE_SIZE, ATLAS_TEXTURE_SIZE);
+	grTexture_SetArrayData(array, layers, ATLAS_TEXTURE_SIZE, ATLAS_TEXTURE_SIZE, cells);
+
+	grAtlasRegion* regions = xmalloc(cells * sizeof(grAtlasRegion));
+	grTexture* atlas = grAtlas_Build(textures, cells, GR_RGB8, 8, 4096, regions);
+
+	grDevice* dev = grDevice_Create();
+	dev->proj = mat4_perspective(deg2rad(90), 640.f / 480, 0.1f, 100);
+	dev->view = mat4_lookat((vec3) { 0, 0, 1.5f }, (vec3) { 0, 0, 0 }, (vec3) { 0, 1, 0 });
+	grFramebuffer* reference = grFramebuffer_Create(640, 480);
+
+	printf("  %-18s %10s %10s %10s %10s\n", "mode", "KB", "ms/frame", "batches", "PSNR dB");
+	for (int m = 0; m < 3; m++) {
+		grMesh grid = makeGridMesh();
+		size_t kb = 0;
+		if (m == 0) {
+			for (int c = 0; c < cells; c++) {
+				grid.subMeshes[c].tex = textures[c];
+				kb += textures[c]->dataSize >> 10;
+			}
+		}
+		else if (m == 1) {
+			for (int c = 0; c < cells; c++) {
+				grid.subMeshes[c].tex = array;
+				grid.subMeshes[c].layer = c;
+			}
+			kb = array->dataSize >> 10;
+		}
+		else {
+			for (int c = 0; c < cells; c++) {
+				grid.subMeshes[c].tex = textures[c];
+			}
+			grAtlas_RemapMesh(&grid, atlas, textures, regions, cells);
+			kb = atlas->dataSize >> 10;
+		}
+
+		// Separate textures are the reference for the other two
+		dev->fb = m == 0 ? reference : grFramebuffer_Create(640, 480);
+		dev->batches = 0;
+		double start = seconds();
+		for (int i = 0; i < FRAMES; i++) {
+			grid.modelMat = mat4_rotate_zyx(i * 0.05f, 0, 0);
+			grClear(dev, (rgb) { 0, 0, 0 });
+			grDraw(dev, &grid);
+		}
+		double ms = (seconds() - start) * 1000 / FRAMES;
+
+		printf("  %-18s %10zu %10.2f %10lld %10.2f\n", names[m], kb, ms, dev->batches / FRAMES, psnr(reference, dev->fb));
+
+		if (dev->fb != reference) {
+			grFramebuffer_Destroy(dev->fb);
+		}
+		free(grid.verts);
+		free(grid.indices);
+		free(grid.subMeshes);
+	}
+
+	for (int c = 0; c < cells; c++) {
+		grTexture_Destroy(textures[c]);
+	}
+	free(textures);
+	free(regions);
+	free(rgba);
+	free(layers);
+	grTexture_Destroy(array);
+	grTexture_Destroy(atlas);
+	grFramebuffer_Destroy(reference);
+	grDevice_Destroy(dev);
+}
+
+// size x size quads in the xy plane from -1 to 1
+static grMesh makePlaneMesh(int size) {
+	grMesh m = { 0 };
+	m.verts = xmalloc((size + 1) * (size + 1) * sizeof(grVertex));
+	m.numVerts = (size + 1) * (size + 1);
+	m.indices = xmalloc(size * size * 6 * sizeof(int));
+	m.count = size * size * 2;
+	m.modelMat = mat4_identity();
+
+	for (int y = 0; y <= size; y++) {
+		for (int x = 0; x <= size; x++) {
+			grVertex* v = &m.verts[y * (size + 1) + x];
+			memset(v, 0, sizeof(grVertex));
+			v->pos = (vec3) { -1 + 2.f * x / size, -1 + 2.f * y / size, 0 };
+			v->uv = (vec2) { (float)x / size, 1 - (float)y / size };
+		}
+	}
+	for (int y = 0; y < size; y++) {
+		for (int x = 0; x < size; x++) {
+			int i = y * (size + 1) + x;
+			int quad[6] = { i, i + 1, i + size + 2, i, i + size + 2, i + size + 1 };
+			memcpy(&m.indices[(y * size + x) * 6], quad, sizeof(quad));
+		}
+	}
+	return m;
+}
+
+static void benchRaster(void) {
+	printf("Rasteriser: 1920x1080, 4x MSAA, nearest filtering\n");
+
+	struct {
+		const char* name;
+		int size; // Of the plane mesh
+		float scale;
+		bool ground; // Lying down under the camera and clipped, rather than facing it
+	} cases[] = {
+		{ "large triangles", 1, 1, false },
+		{ "small triangles", 256, 1, false },
+		{ "clipped ground", 32, 200, true },
+	};
+
+	grDevice* dev = grDevice_Create();
+	dev->fb = grFramebuffer_Create(1920, 1080);
+	dev->proj = mat4_perspective(deg2rad(90), 1920.f / 1080, 0.1f, 100);
+	dev->tex = makeNoiseTexture(256, GR_LAYOUT_LINEAR);
+	dev->tex->filter = GR_NEAREST;
+
+	printf("  %-18s %10s %10s\n", "scene", "triangles", "ms/frame");
+	for (int c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+		grMesh plane = makePlaneMesh(cases[c].size);
+
+		double start = seconds();
+		for (int i = 0; i < FRAMES; i++) {
+			if (cases[c].ground) {
+				dev->view = mat4_identity();
+				mat4 down = mat4_rotate_zyx(0, i * 0.05f, 1.5708f);
+				mat4 scale = mat4_scale((vec3) { cases[c].scale, cases[c].scale, 1 });
+				mat4 m = mat4_mul(&down, &scale);
+				mat4 below = mat4_translate((vec3) { 0, -0.3f, 0 });
+				plane.modelMat = mat4_mul(&below, &m);
+			}
+			else {
+				dev->view = mat4_lookat((vec3) { 0, 0, 1 }, (vec3) { 0, 0, 0 }, (vec3) { 0, 1, 0 });
+				plane.modelMat = mat4_rotate_zyx(i * 0.05f, 0, 0);
+			}
+			grClear(dev, (rgb) { 0, 0, 0 });
+			grDraw(dev, &plane);
+		}
+		double ms = (seconds() - start) * 1000 / FRAMES;
+		printf("  %-18s %10d %10.2f\n", cases[c].name, plane.count, ms);
+
+		free(plane.verts);
+		free(plane.indices);
+	}
+
+	grTexture_Destroy(dev->tex);
+	grFramebuffer_Destroy(dev->fb);
+	grDevice_Destroy(dev);
+}
+
+// The textured shader called through a pointer for every quad, as it would be if the
+// rasteriser weren't compiled for each shader
+static int shadeTexturedRef(const grQuad* quad, rgb out[4]) {
+	grQuad_Sample(quad, 0, quad->mask, out);
+	return quad->mask;
+}
+
+static grPixelShaderFn volatile indirectShader = shadeTexturedRef;
+
+static int shadeIndirect(const grQuad* quad, rgb out[4]) {
+	return indirectShader(quad, out);
+}
+
+GR_DEFINE_PIXEL_SHADER(BENCH_SHADER_INDIRECT, shadeIndirect)
+
+static void benchShaders(void) {
+	printf("Pixel shaders: 1920x1080, 4x MSAA, nearest filtering, 64x64 quads facing the camera\n");
+
+	struct {
+		const char* name;
+		const grPixelShader* shader;
+		const grVertexFormat* format;
+	} cases[] = {
+		{ "textured", &GR_SHADER_TEXTURED, NULL },
+		{ "textured, indirect", &BENCH_SHADER_INDIRECT, NULL },
+		{ "lit", &GR_SHADER_LIT, &GR_VERTEX_FORMAT_LIT },
+		{ "mip levels", &GR_SHADER_MIP_LEVELS, NULL },
+	};
+
+	grDevice* dev = grDevice_Create();
+	dev->fb = grFramebuffer_Create(1920, 1080);
+	dev->proj = mat4_perspective(deg2rad(90), 1920.f / 1080, 0.1f, 100);
+	dev->view = mat4_lookat((vec3) { 0, 0, 1 }, (vec3) { 0, 0, 0 }, (vec3) { 0, 1, 0 });
+	dev->tex = makeNoiseTexture(256, GR_LAYOUT_LINEAR);
+	dev->tex->filter = GR_NEAREST;
+	grLightUniforms light = { vec3_normalize((vec3) { 1, 1, 1 }), 0.2f };
+	dev->uniforms = &light;
+
+	grMesh plane = makePlaneMesh(64);
+	for (int v = 0; v < plane.numVerts; v++) {
+		plane.verts[v].normal = (vec3) { 0, 0, 1 };
+	}
+
+	printf("  %-20s %10s\n", "shader", "ms/frame");
+	for (int c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+		dev->shader = cases[c].shader;
+		plane.format = cases[c].format;
+
+		double start = seconds();
+		for (int i = 0; i < FRAMES; i++) {
+			plane.modelMat = mat4_rotate_zyx(i * 0.05f, 0, 0);
+			grClear(dev, (rgb) { 0, 0, 0 });
+			grDraw(dev, &plane);
+		}
+		double ms = (seconds() - start) * 1000 / FRAMES;
+		printf("  %-20s %10.2f\n", cases[c].name, ms);
+	}
+
+	free(plane.verts);
+	free(plane.indices);
+	grTexture_Destroy(dev->tex);
+	grFramebuffer_Destroy(dev->fb);
+	grDevice_Destroy(dev);
+}
+
+typedef struct {
+	const vec3* target; // Position of each vertex in the morph target
+	float weight;
+} MorphUniforms;
+
+// Blend the positions towards a morph target, 4 vertices at a time
+static void morphShader(grVertexBatch* batch) {
+	const MorphUniforms* u = batch->uniforms;
+	float target[3][GR_VERTEX_BATCH_SIZE];
+	for (int i = 0; i < batch->count; i++) {
+		vec3 t = u->target[batch->indices[i]];
+		target[0][i] = t.x;
+		target[1][i] = t.y;
+		target[2][i] = t.z;
+	}
+
+	// The arrays are a multiple of 4 long, whatever's past count is ignored
+	f32x4 weight = f32x4_splat(u->weight);
+	for (int c = 0; c < 3; c++) {
+		for (int i = 0; i < batch->count; i += 4) {
+			f32x4 p = f32x4_load(&batch->pos[c][i]);
+			f32x4 t = f32x4_load(&target[c][i]);
+			f32x4_store(&batch->pos[c][i], f32x4_add(p, f32x4_mul(f32x4_sub(t, p), weight)));
+		}
+	}
+	grVertexShader_Default(batch);
+}
+
+static void benchVertexShaders(void) {
+	printf("Vertex shaders: 512x512 quad plane, mostly sub pixel triangles at 320x240\n");
+
+	grDevice* dev = grDevice_Create();
+	dev->fb = grFramebuffer_Create(320, 240);
+	dev->proj = mat4_perspective(deg2rad(90), 320.f / 240, 0.1f, 100);
+	dev->view = mat4_lookat((vec3) { 0, 0, 1 }, (vec3) { 0, 0, 0 }, (vec3) { 0, 1, 0 });
+	dev->tex = makeNoiseTexture(256, GR_LAYOUT_LINEAR);
+	dev->tex->filter = GR_NEAREST;
+
+	grMesh plane = makePlaneMesh(512);
+	vec3* target = xmalloc(plane.numVerts * sizeof(vec3));
+	for (int v = 0; v < plane.numVerts; v++) {
+		vec3 p = plane.verts[v].pos;
+		target[v] = (vec3) { p.x, p.y, 0.2f * sinf(p.x * 8) * cosf(p.y * 8) };
+	}
+	MorphUniforms morph = { target, 0.5f };
+
+	struct {
+		const char* name;
+		grVertexShaderFn shader;
+	} cases[] = {
+		{ "default", NULL },
+		{ "morph", morphShader },
+	};
+
+	printf("  %-10s %10s %12s\n", "shader", "ms/frame", "Mverts/s");
+	for (int c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+		dev->vertexShader = cases[c].shader;
+		dev->vertexUniforms = &morph;
+
+		double start = seconds();
+		for (int i = 0; i < FRAMES; i++) {
+			plane.modelMat = mat4_rotate_zyx(i * 0.05f, 0, 0);
+			grClear(dev, (rgb) { 0, 0, 0 });
+			grDraw(dev, &plane);
+		}
+		double ms = (seconds() - start) * 1000 / FRAMES;
+		printf("  %-10s %10.2f %12.1f\n", cases[c].name, ms, plane.numVerts / (ms * 1000));
+	}
+
+	free(target);
+	free(plane.verts);
+	free(plane.indices);
+	grTexture_Destroy(dev->tex);
+	grFramebuffer_Destroy(dev->fb);
+	grDevice_Destroy(dev);
+}
+
+#define SCENE_OBJECTS 2000
+#define SCENE_TEXTURES 8
+#define RECORD_THREADS 4
+
+typedef struct {
+	mat4 model;
+	grTexture* tex;
+} SceneObject;
+
+// Quads scattered through a frustum in random order, each with one of the textures
+static SceneObject* makeScene(grTexture* textures[SCENE_TEXTURES]) {
+	for (int t = 0; t < SCENE_TEXTURES; t++) {
+		textures[t] = makeNoiseTexture(256, GR_LAYOUT_LINEAR);
+	}
+
+	SceneObject* objects = xmalloc(SCENE_OBJECTS * sizeof(SceneObject));
+	rngState = 777;
+	for (int i = 0; i < SCENE_OBJECTS; i++) {
+		float x = (rng() % 1000) / 500.f - 1;
+		float y = (rng() % 1000) / 500.f - 1;
+		float z = -(float)(rng() % 1000) / 100;
+		mat4 t = mat4_translate((vec3) { x * (1 - z), y * (1 - z), z });
+		mat4 scale = mat4_scale((vec3) { 0.15f, 0.15f, 1 });
+		objects[i].model = mat4_mul(&t, &scale);
+		objects[i].tex = textures[rng() % SCENE_TEXTURES];
+	}
+	return objects;
+}
+
+// Record objects [first, end) of the scene
+static void recordObjects(grCommandBuffer* cb, const grDevice* dev, grMesh* mesh, const SceneObject* objects, int first, int end) {
+	grCommandBuffer_SetCamera(cb, &dev->proj, &dev->view);
+	for (int i = first; i < end; i++) {
+		grCommandBuffer_SetTexture(cb, objects[i].tex);
+		grCommandBuffer_Draw(cb, mesh, &objects[i].model);
+	}
+}
+
+static void benchCommandBuffers(void) {
+	printf("Command buffers: %d overlapping quads with %d trilinear textures in random order, 1920x1080\n", SCENE_OBJECTS, SCENE_TEXTURES);
+
+	grDevice* dev = grDevice_Create();
+	dev->fb = grFramebuffer_Create(1920, 1080);
+	dev->proj = mat4_perspective(deg2rad(90), 1920.f / 1080, 0.1f, 100);
+	dev->view = mat4_lookat((vec3) { 0, 0, 1 }, (vec3) { 0, 0, 0 }, (vec3) { 0, 1, 0 });
+
+	grTexture* textures[SCENE_TEXTURES];
+	SceneObject* objects = makeScene(textures);
+	grMesh quad = makePlaneMesh(1);
+
+	grCommandBuffer* buffers[RECORD_THREADS];
+	for (int t = 0; t < RECORD_THREADS; t++) {
+		buffers[t] = grCommandBuffer_Create();
+	}
+
+	printf("  %-22s %10s %10s\n", "", "record ms", "ms/frame");
+	const char* modes[] = { "immediate", "command buffer", "recorded on 4 threads" };
+	for (int mode = 0; mode < 3; mode++) {
+		double recordTime = 0;
+		double start = seconds();
+		for (int f = 0; f < FRAMES; f++) {
+			if (mode == 0) {
+				grClear(dev, (rgb) { 0, 0, 0 });
+				for (int i = 0; i < SCENE_OBJECTS; i++) {
+					dev->tex = objects[i].tex;
+					quad.modelMat = objects[i].model;
+					grDraw(dev, &quad);
+				}
+				continue;
+			}
+
+			int threads = mode == 1 ? 1 : RECORD_THREADS;
+			double recordStart = seconds();
+			#pragma omp parallel for num_threads(RECORD_THREADS)
+			for (int t = 0; t < threads; t++) {
+				grCommandBuffer_Reset(buffers[t]);
+				if (t == 0) {
+					grCommandBuffer_Clear(buffers[t], (rgb) { 0, 0, 0 });
+				}
+				recordObjects(buffers[t], dev, &quad, objects, SCENE_OBJECTS * t / threads, SCENE_OBJECTS * (t + 1) / threads);
+			}
+			recordTime += seconds() - recordStart;
+			grDevice_Execute(dev, buffers, threads);
+		}
+		double ms = (seconds() - start) * 1000 / FRAMES;
+		printf("  %-22s %10.3f %10.2f\n", modes[mode], recordTime * 1000 / FRAMES, ms);
+	}
+
+	for (int t = 0; t < RECORD_THREADS; t++) {
+		grCommandBuffer_Destroy(buffers[t]);
+	}
+	for (int t = 0; t < SCENE_TEXTURES; t++) {
+		grTexture_Destroy(textures[t]);
+	}
+	free(objects);
+	free(quad.verts);
+	free(quad.indices);
+	grFramebuffer_Destroy(dev->fb);
+	grDevice_Destroy(dev);
+}
+
+static long long shadedQuads(const grSamplerStats* stats) {
+	return stats->magnifiedQuads + stats->singleLevelQuads + stats->trilinearQuads + stats->anisotropicQuads;
+}
+
+static void benchDepthPrepass(void) {
+	printf("Depth pre-pass: the command buffer scene, %d overlapping quads\n", SCENE_OBJECTS);
+
+	grDevice* dev = grDevice_Create();
+	dev->fb = grFramebuffer_Create(1920, 1080);
+	dev->proj = mat4_perspective(deg2rad(90), 1920.f / 1080, 0.1f, 100);
+	dev->view = mat4_lookat((vec3) { 0, 0, 1 }, (vec3) { 0, 0, 0 }, (vec3) { 0, 1, 0 });
+	grFramebuffer* reference = grFramebuffer_Create(1920, 1080);
+
+	grTexture* textures[SCENE_TEXTURES];
+	SceneObject* objects = makeScene(textures);
+	grMesh quad = makePlaneMesh(1);
+
+	grCommandBuffer* cb = grCommandBuffer_Create();
+	grCommandBuffer_Clear(cb, (rgb) { 0, 0, 0 });
+	recordObjects(cb, dev, &quad, objects, 0, SCENE_OBJECTS);
+
+	// The command buffer sorts by texture before depth, so there's still overdraw
+	// between the textures' draws for the pre-pass to remove
+	struct {
+		const char* name;
+		bool commandBuffer;
+		bool prepass;
+	} cases[] = {
+		{ "immediate", false, false },
+		{ "command buffer", true, false },
+		{ "with pre-pass", true, true },
+	};
+
+	printf("  %-16s %10s %14s %8s\n", "", "ms/frame", "quads shaded", "PSNR");
+	for (int c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+		dev->depthPrepass = cases[c].prepass;
+		memset(&dev->stats, 0, sizeof(dev->stats));
+		double start = seconds();
+		for (int f = 0; f < FRAMES; f++) {
+			if (cases[c].commandBuffer) {
+				grDevice_Execute(dev, &cb, 1);
+			}
+			else {
+				grClear(dev, (rgb) { 0, 0, 0 });
+				for (int i = 0; i < SCENE_OBJECTS; i++) {
+					dev->tex = objects[i].tex;
+					quad.modelMat = objects[i].model;
+					grDraw(dev, &quad);
+				}
+			}
+		}
+		double ms = (seconds() - start) * 1000 / FRAMES;
+
+		if (c == 0) {
+			memcpy(reference->colour, dev->fb->colour, 1920 * 1080 * sizeof(rgb) * MSAA_SAMPLES);
+		}
+		printf("  %-16s %10.2f %14lld %8.1f\n", cases[c].name, ms, shadedQuads(&dev->stats) / FRAMES, psnr(reference, dev->fb));
+	}
+
+	grCommandBuffer_Destroy(cb);
+	for (int t = 0; t < SCENE_TEXTURES; t++) {
+		grTexture_Destroy(textures[t]);
+	}
+	free(objects);
+	free(quad.verts);
+	free(quad.indices);
+	grFramebuffer_Destroy(reference);
+	grFramebuffer_Destroy(dev->fb);
+	grDevice_Destroy(dev);
+}
+
+static void benchVisibilityBuffer(void) {
+	printf("Visibility buffer: 1920x1080, 4x MSAA, trilinear\n");
+
+	grDevice* dev = grDevice_Create();
+	dev->fb = grFramebuffer_Create(1920, 1080);
+	dev->proj = mat4_perspective(deg2rad(90), 1920.f / 1080, 0.1f, 100);
+	dev->view = mat4_lookat((vec3) { 0, 0, 1 }, (vec3) { 0, 0, 0 }, (vec3) { 0, 1, 0 });
+	grFramebuffer* reference = grFramebuffer_Create(1920, 1080);
+
+	grTexture* textures[SCENE_TEXTURES];
+	SceneObject* objects = makeScene(textures);
+	grMesh quad = makePlaneMesh(1);
+
+	grCommandBuffer* cb = grCommandBuffer_Create();
+	grCommandBuffer_Clear(cb, (rgb) { 0, 0, 0 });
+	recordObjects(cb, dev, &quad, objects, 0, SCENE_OBJECTS);
+
+	// Triangles of a few pixels, so most quads the forward rasteriser shades are partly
+	// covered and shaded again by the neighbouring triangles
+	grMesh grid = makePlaneMesh(512);
+	grid.modelMat = mat4_scale((vec3) { 1.6f, 0.9f, 1 });
+
+	const char* scenes[] = { "overlapping quads", "dense grid" };
+	const char* modes[] = { "forward", "depth pre-pass", "visibility buffer" };
+
+	printf("  %-18s %-18s %10s %14s %8s\n", "scene", "", "ms/frame", "quads shaded", "PSNR");
+	for (int scene = 0; scene < 2; scene++) {
+		for (int mode = 0; mode < 3; mode++) {
+			dev->depthPrepass = mode == 1;
+			dev->visibilityBuffer = mode == 2;
+			memset(&dev->stats, 0, sizeof(dev->stats));
+
+			double start = seconds();
+			for (int f = 0; f < FRAMES; f++) {
+				if (scene == 0) {
+					grDevice_Execute(dev, &cb, 1);
+				}
+				else {
+					dev->tex = textures[0];
+					grClear(dev, (rgb) { 0, 0, 0 });
+					grDraw(dev, &grid);
+				}
+			}
+			double ms = (seconds() - start) * 1000 / FRAMES;
+
+			if (mode == 0) {
+				memcpy(reference->colour, dev->fb->colour, 1920 * 1080 * sizeof(rgb) * MSAA_SAMPLES);
+			}
+			printf("  %-18s %-18s %10.2f %14lld %8.1f\n", mode == 0 ? scenes[scene] : "", modes[mode], ms, shadedQuads(&dev->stats) / FRAMES, psnr(reference, dev->fb));
+		}
+	}
+
+	grCommandBuffer_Destroy(cb);
+	for (int t = 0; t < SCENE_TEXTURES; t++) {
+		grTexture_Destroy(textures[t]);
+	}
+	free(objects);
+	free(quad.verts);
+	free(quad.indices);
+	free(grid.verts);
+	free(grid.indices);
+	grFramebuffer_Destroy(reference);
+	grFramebuffer_Destroy(dev->fb);
+	grDevice_Destroy(dev);
+}
+
+typedef struct {
+	const char* name;
+	void (*fn)(void);
+} Benchmark;
+
+static Benchmark BENCHMARKS[] = {
+	{ "texture_layout", benchTextureLayout },
+	{ "texture_formats", benchTextureFormats },
+	{ "texture_npot", benchTextureNpot },
+	{ "texture_streaming", benchTextureStreaming },
+	{ "texture_filters", benchTextureFilters },
+	{ "texture_atlas", benchTextureAtlas },
+	{ "math", benchMath },
+	{ "raster", benchRaster },
+	{ "shaders", benchShaders },
+	{ "vertex_shaders", benchVertexShaders },
+	{ "command_buffers", benchCommandBuffers },
+	{ "depth_prepass", benchDepthPrepass },
+	{ "visibility_buffer", benchVisibilityBuffer },
+};
+
+int Bench_Run(int argc, char** argv) {
+	const char* only = argc >= 1 ? argv[0] : NULL;
+	int ran = 0;
+
+	for (int i = 0; i < sizeof(BENCHMARKS) / sizeof(BENCHMARKS[0]); i++) {
+		if (only == NULL || strcmp(only, BENCHMARKS[i].name) == 0) {
+			BENCHMARKS[i].fn();
+			ran++;
+		}
+	}
+
+	if (ran == 0) {
+		printf("Unknown benchmark %s\n", only);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
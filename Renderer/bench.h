@@ -0,0 +1,8 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+// Headless benchmarks, run with "Renderer -bench [name]".
+// With no name every benchmark is run.
+int Bench_Run(int argc, char** argv);
+
+#endif
@@ -1,11 +1,15 @@
 #include <stdlib.h>
 #include <string.h>
-#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <assert.h>
+#include <math.h>
 
 #include "util.h"
 
 #include "gr.h"
+#include "gr_internal.h"
+#include "gr_shader.h"
 
 grFramebuffer* grFramebuffer_Create(int width, int height) {
 	grFramebuffer* fb = xmalloc(sizeof(grFramebuffer));
@@ -13,87 +17,30 @@ grFramebuffer* grFramebuffer_Create(int width, int height) {
 	fb->height = height;
 	fb->colour = xmalloc(width * height * sizeof(rgb) * MSAA_SAMPLES);
 	fb->depth = xmalloc(width * height * sizeof(float) * MSAA_SAMPLES);
+	fb->visibility = NULL;
+	fb->visibilityInstances = 0;
 	return fb;
 }
 
 void grFramebuffer_Destroy(grFramebuffer* fb) {
 	free(fb->colour);
 	free(fb->depth);
+	free(fb->visibility);
 	free(fb);
 }
 
-grTexture* grTexture_Create(int width, int height) {
-	grTexture* tex = xmalloc(sizeof(grTexture));
-	tex->width = width;
-	tex->height = height;
-	tex->filter = GR_LINEAR;
-	tex->wrapU = GR_CLAMP;
-	tex->wrapV = GR_CLAMP;
-	tex->mipmaps = NULL;
-	tex->numMipmaps = 0;
-	return tex;
-}
-
-int IsPowerOfTwo(int x) {
-	return (x != 0) && ((x & (x - 1)) == 0);
-}
-
-int int_log2(int x) {
-	int l = 0;
-	while (x >>= 1) ++l;
-	return l;
-}
-
-void grTexture_SetData(grTexture* tex, rgb* data, int width, int height) {
-	// For now I will only support square power of 2 textures
-	// it just makes things easier
-	assert(IsPowerOfTwo(width));
-	assert(IsPowerOfTwo(height));
-	assert(width == height);
-
-	// Calculate number of mipmaps required
-	int numLevels = int_log2(width) + 1;
-	tex->numMipmaps = numLevels;
-	tex->mipmaps = xmalloc(numLevels * sizeof(grMipmapLevel));
-
-	// Allocate mipmaps
-	int mipSize = width;
-	for (int i = 0; i < numLevels; i++) {
-		grMipmapLevel* mip = &tex->mipmaps[i];
-		mip->width = mipSize;
-		mip->height = mipSize;
-		mip->data = xmalloc(mipSize * mipSize * sizeof(rgb));
-		mipSize /= 2;
-	}
-
-	// First mipmap is just the original data
-	memcpy(tex->mipmaps[0].data, data, width * height * sizeof(rgb));
-
-	// Generate mipmap chain
-	// I want to use i and j for y and x like in every other loop
-	for (int i_m = 1; i_m < numLevels; i_m++) {
-		grMipmapLevel* mip = &tex->mipmaps[i_m];
-		grMipmapLevel* prev = &tex->mipmaps[i_m - 1];
-
-		for (int i = 0; i < mip->height; i++) {
-			for (int j = 0; j < mip->width; j++) {
-				rgb a = prev->data[i * 2 * prev->width + j * 2];
-				rgb b = prev->data[i * 2 * prev->width + j * 2 + 1];
-				rgb c = prev->data[(i * 2 + 1) * prev->width + j * 2];
-				rgb d = prev->data[(i * 2 + 1) * prev->width + j * 2 + 1];
-
-				int R = (a.r + b.r + c.r + d.r) / 4;
-				int G = (a.g + b.g + c.g + d.g) / 4;
-				int B = (a.b + b.b + c.b + d.b) / 4;
-				mip->data[i * mip->width + j] = (rgb){ R, G, B };
-			}
-		}
-	}
-}
-
 grDevice* grDevice_Create(void) {
 	grDevice* dev = xmalloc(sizeof(grDevice));
 	dev->fb = NULL;
+	dev->tex = NULL;
+	dev->shader = NULL;
+	dev->uniforms = NULL;
+	dev->vertexShader = NULL;
+	dev->vertexUniforms = NULL;
+	dev->depthPrepass = false;
+	dev->visibilityBuffer = false;
+	memset(&dev->stats, 0, sizeof(dev->stats));
+	dev->batches = 0;
 	return dev;
 }
 
@@ -114,6 +61,10 @@ void grClear(grDevice* dev, rgb colour) {
 		}
 	}
 
+	if (fb->visibility) {
+		memset(fb->visibility, 0xff, fb->width * fb->height * sizeof(grVisibilitySample) * MSAA_SAMPLES);
+		fb->visibilityInstances = 0;
+	}
 }
 
 void grPoint(grDevice* dev, float x, float y, rgb colour) {
@@ -134,57 +85,85 @@ void grPixel(grDevice* dev, int x, int y, rgb colour) {
 	}
 }
 
-// GLSL: textureLOD
-rgb Texture_sample(grTexture* tex, float u, float v, int level) {
-	grMipmapLevel* mip = &tex->mipmaps[level];
-
-	u *= mip->width;
-	v *= mip->height;
-
-	float t1;
-	if (u < 0.5f) t1 = 0;
-	else if (u > mip->width - 0.5f) t1 = 1;
-	else t1 = fractf(u - 0.5f);
-
-	float t2;
-	if (v < 0.5f) t2 = 0;
-	else if (v > mip->height - 0.5f) t2 = 1;
-	else t2 = fractf(v - 0.5f);
+#if GR_SUBPIXEL_BITS < 4 || GR_SUBPIXEL_BITS > 8
+#error GR_SUBPIXEL_BITS must be between 4 and 8
+#endif
 
-	int x0 = u - 0.5f;
-	int x1 = u + 0.5f;
+#define SUBPIXEL_ONE (1 << GR_SUBPIXEL_BITS)
+#define SUBPIXEL_HALF (SUBPIXEL_ONE / 2)
 
-	int y0 = v - 0.5f;
-	int y1 = v + 0.5f;
+// Range analysis for the fixed point screen coordinates.
+// Snapped vertices are kept within +-2^22 subpixels by clipping triangles to a guard band,
+// so differences between coordinates fit in 24 bits, a sample offset (< 2^7 subpixels)
+// times a difference fits in an int, and the edge functions, which multiply two
+// differences, need 48 bits and are int64_t. 2^22 also keeps the coordinates exact in a float.
+#define GUARD_BAND_PIXELS (1 << (22 - GR_SUBPIXEL_BITS))
 
-	x0 = clampf(x0, 0, mip->width - 1);
-	x1 = clampf(x1, 0, mip->width - 1);
-
-	y0 = clampf(y0, 0, mip->height - 1);
-	y1 = clampf(y1, 0, mip->height - 1);
-
-	rgb c00 = mip->data[y0 * mip->width + x0];
-	rgb c10 = mip->data[y0 * mip->width + x1];
-	rgb c01 = mip->data[y1 * mip->width + x0];
-	rgb c11 = mip->data[y1 * mip->width + x1];
-
-	rgb c = {
-		lerpf(lerpf(c00.r, c10.r, t1), lerpf(c01.r, c11.r, t1), t2),
-		lerpf(lerpf(c00.g, c10.g, t1), lerpf(c01.g, c11.g, t1), t2),
-		lerpf(lerpf(c00.b, c10.b, t1), lerpf(c01.b, c11.b, t1), t2),
-	};
-
-	return c;
-}
+#if GR_MAX_VARYINGS % 4 != 0
+#error GR_MAX_VARYINGS must be a multiple of 4
+#endif
 
+// A vertex after the perspective divide, ready for triangle setup
 typedef struct {
-	int x;
+	int x; // Subpixels
 	int y;
 	float z;
 	float w;
-	vec2 uv;
+	float varyings[GR_MAX_VARYINGS]; // Divided by w
 } VertexAttr;
 
+// A vertex before the perspective divide
+typedef struct {
+	vec4 pos;
+	float varyings[GR_MAX_VARYINGS];
+} ClipVertex;
+
+// Planes in clip space that triangles are clipped to. A vertex's outcode has a bit set
+// for each plane it's outside.
+enum {
+	CLIP_NEAR, // z >= 0
+	CLIP_FAR, // z <= w. Only used to reject triangles, the depth test does the rest.
+	CLIP_LEFT, // The guard band, see GUARD_BAND_PIXELS
+	CLIP_RIGHT,
+	CLIP_TOP,
+	CLIP_BOTTOM,
+	CLIP_PLANES,
+};
+
+#define CLIP_MASK (~(1 << CLIP_FAR))
+
+typedef struct {
+	vec4 planes[CLIP_PLANES]; // Inside where dot(plane, pos) >= 0
+} ClipPlanes;
+
+static ClipPlanes clipPlanes(const grFramebuffer* fb) {
+	// The guard band in NDC, a little inside +-GUARD_BAND_PIXELS so rounding can't take
+	// clipped vertices outside it
+	float gx = (float)(GUARD_BAND_PIXELS - 1) * 2 / fb->width - 1;
+	float gy = (float)(GUARD_BAND_PIXELS - 1) * 2 / fb->height - 1;
+
+	return (ClipPlanes) { {
+		{ 0, 0, 1, 0 },
+		{ 0, 0, -1, 1 },
+		{ 1, 0, 0, gx },
+		{ -1, 0, 0, gx },
+		{ 0, -1, 0, gy },
+		{ 0, 1, 0, gy },
+	} };
+}
+
+// What stays the same for a whole batch of triangles
+typedef struct {
+	grDevice* dev;
+	RasteriseFn rasterise; // The shader's, for the pass
+	bool positionsOnly; // Drop the varyings after the vertex shader, for the depth and visibility passes
+	RasterState raster;
+	VisibilityFrame* frame; // PASS_VISIBILITY's
+	ClipPlanes clip;
+	int numVaryings; // Floats
+} Batch;
+
+// Sample positions relative to the pixel centre, in 1/16ths of a pixel
 int SAMPLE_PATTERN[4][2] = {
 	{-2, -6},
 	{6, -2},
@@ -192,169 +171,354 @@ int SAMPLE_PATTERN[4][2] = {
 	{2, 6},
 };
 
-// TODO allocate extra border memory for shading
-// so if part of the quad is off the left or bottom of the screen it doesn't crash
+// f at the origin pixel's centre and its gradient, given its value at each vertex
+// Done in double, since the edge functions can be much bigger than a float's precision
+static Plane planeSetup(const TriSetup* t, const int64_t edge[3], double invArea, float f0, float f1, float f2) {
+	return (Plane) {
+		(float)(((double)f0 * edge[0] + (double)f1 * edge[1] + (double)f2 * edge[2]) * invArea),
+		(float)(((double)f0 * t->edgeDx[0] + (double)f1 * t->edgeDx[1] + (double)f2 * t->edgeDx[2]) * invArea),
+		(float)(((double)f0 * t->edgeDy[0] + (double)f1 * t->edgeDy[1] + (double)f2 * t->edgeDy[2]) * invArea),
+	};
+}
 
-static void tri(grDevice* dev, VertexAttr attr[3]) {
-	grFramebuffer* fb = dev->fb;
+// Returns false if the triangle is back facing, degenerate or off screen
+static bool setupTri(const grFramebuffer* fb, const VertexAttr* attr[3], int numVaryings, TriSetup* t) {
+	int x[3] = { attr[0]->x, attr[1]->x, attr[2]->x };
+	int y[3] = { attr[0]->y, attr[1]->y, attr[2]->y };
 
-	int x0 = attr[0].x;
-	int y0 = attr[0].y;
-	float z0 = attr[0].z;
-	vec2 uv0 = attr[0].uv;
+	// Twice the area, negative for front faces
+	int64_t A = (int64_t)(x[1] - x[0]) * (y[2] - y[0]) - (int64_t)(y[1] - y[0]) * (x[2] - x[0]);
+	if (A >= 0) {
+		return false;
+	}
 
-	int x1 = attr[1].x;
-	int y1 = attr[1].y;
-	float z1 = attr[1].z;
-	vec2 uv1 = attr[1].uv;
+	// Bounding box of the triangle in pixels, on screen. The triangle has already been
+	// clipped to the near plane, but not the far one, that's left to the depth test.
+	t->left = max(min(min(x[0], x[1]), x[2]) >> GR_SUBPIXEL_BITS, 0);
+	t->right = min(max(max(x[0], x[1]), x[2]) >> GR_SUBPIXEL_BITS, fb->width - 1);
+	t->top = max(min(min(y[0], y[1]), y[2]) >> GR_SUBPIXEL_BITS, 0);
+	t->bottom = min(max(max(y[0], y[1]), y[2]) >> GR_SUBPIXEL_BITS, fb->height - 1);
+	if (t->left > t->right || t->top > t->bottom) {
+		return false;
+	}
 
-	int x2 = attr[2].x;
-	int y2 = attr[2].y;
-	float z2 = attr[2].z;
-	vec2 uv2 = attr[2].uv;
+	int cx = (t->left << GR_SUBPIXEL_BITS) + SUBPIXEL_HALF;
+	int cy = (t->top << GR_SUBPIXEL_BITS) + SUBPIXEL_HALF;
+
+	// Edge k runs between the two vertices other than k, so it's 0 at them and -A at vertex k
+	int64_t exact[3];
+	for (int k = 0; k < 3; k++) {
+		int a = (k + 1) % 3;
+		int b = (k + 2) % 3;
+		int dx = x[b] - x[a];
+		int dy = y[b] - y[a];
+
+		// Points exactly on the edge count as inside for top and left edges only,
+		// so samples on an edge shared by two triangles are drawn once
+		int bias = (dy == 0 && dx < 0) || dy < 0;
+
+		exact[k] = (int64_t)(cx - x[a]) * dy - (int64_t)(cy - y[a]) * dx;
+		t->edge[k] = exact[k] + bias;
+		t->edgeDx[k] = (int64_t)dy * SUBPIXEL_ONE;
+		t->edgeDy[k] = -(int64_t)dx * SUBPIXEL_ONE;
+		for (int i = 0; i < MSAA_SAMPLES; i++) {
+			int sx = SAMPLE_PATTERN[i][0] * (SUBPIXEL_ONE / 16);
+			int sy = SAMPLE_PATTERN[i][1] * (SUBPIXEL_ONE / 16);
+			t->sampleOffset[k][i] = sx * dy - sy * dx;
+		}
+	}
 
-	// Cull backfaces
-	int A = (x1 - x0) * (y2 - y0) - (y1 - y0) * (x2 - x0);
-	if (A > 0) {
-		return;
+	// The barycentric coordinates are the exact edge functions (without the bias) over -A
+	double invArea = -1.0 / A;
+	t->z = planeSetup(t, exact, invArea, attr[0]->z, attr[1]->z, attr[2]->z);
+	t->invW = planeSetup(t, exact, invArea, 1 / attr[0]->w, 1 / attr[1]->w, 1 / attr[2]->w);
+	for (int a = 0; a < numVaryings; a++) {
+		t->varyings[a] = planeSetup(t, exact, invArea, attr[0]->varyings[a], attr[1]->varyings[a], attr[2]->varyings[a]);
 	}
+	t->numVaryings = numVaryings;
+	return true;
+}
 
-	// Compute bounding box of the triangle.
-	// TODO: Implement proper triangle clipping
-	// Current implementation will waste time shading pixels
-	// that will be discarded because their z values are not in [0-1]
-	// BTW my program doesn't actually discard these pixels anyway
-	// because this is kind of bodged together.
-	int left = min(min(x0, x1), x2) & ~15;
-	int right = max(max(x0, x1), x2) & ~15;
-	int top = min(min(y0, y1), y2) & ~15;
-	int bottom = max(max(y0, y1), y2) & ~15;
-
-	left = max(left, 0);
-	right = min(right, (fb->width - 1) * 16);
-	top = max(top, 0);
-	bottom = min(bottom, (fb->height - 1) * 16);
-
-	for (int y = top; y <= bottom; y += 32) {
-		for (int x = left; x <= right; x += 32) {
-			// 0: x, y
-			// 1: x + 1, y
-			// 2: x, y + 1
-			// 3: x + 1, y + 1
-
-			int px[4] = { x / 16, x / 16 + 1,x / 16,x / 16 + 1 };
-			int py[4] = { y / 16,y / 16,y / 16 + 1,y / 16 + 1 };
-
-			int e01[4];
-			e01[0] = ((x + 8) - x0) * (y1 - y0) - ((y + 8) - y0) * (x1 - x0) + ((y0 == y1 && x1 < x0) || (y1 < y0));
-			e01[1] = (((x + 16) + 8) - x0) * (y1 - y0) - ((y + 8) - y0) * (x1 - x0) + ((y0 == y1 && x1 < x0) || (y1 < y0));
-			e01[2] = ((x + 8) - x0) * (y1 - y0) - (((y + 16) + 8) - y0) * (x1 - x0) + ((y0 == y1 && x1 < x0) || (y1 < y0));
-			e01[3] = (((x + 16) + 8) - x0) * (y1 - y0) - (((y + 16) + 8) - y0) * (x1 - x0) + ((y0 == y1 && x1 < x0) || (y1 < y0));
-
-			int e12[4];
-			e12[0] = ((x + 8) - x1) * (y2 - y1) - ((y + 8) - y1) * (x2 - x1) + ((y1 == y2 && x2 < x1) || (y2 < y1));
-			e12[1] = (((x + 16) + 8) - x1) * (y2 - y1) - ((y + 8) - y1) * (x2 - x1) + ((y1 == y2 && x2 < x1) || (y2 < y1));
-			e12[2] = ((x + 8) - x1) * (y2 - y1) - (((y + 16) + 8) - y1) * (x2 - x1) + ((y1 == y2 && x2 < x1) || (y2 < y1));
-			e12[3] = (((x + 16) + 8) - x1) * (y2 - y1) - (((y + 16) + 8) - y1) * (x2 - x1) + ((y1 == y2 && x2 < x1) || (y2 < y1));
-
-			int e20[4];
-			e20[0] = ((x + 8) - x2) * (y0 - y2) - ((y + 8) - y2) * (x0 - x2) + ((y2 == y0 && x0 < x2) || (y0 < y2));
-			e20[1] = (((x + 16) + 8) - x2) * (y0 - y2) - ((y + 8) - y2) * (x0 - x2) + ((y2 == y0 && x0 < x2) || (y0 < y2));
-			e20[2] = ((x + 8) - x2) * (y0 - y2) - (((y + 16) + 8) - y2) * (x0 - x2) + ((y2 == y0 && x0 < x2) || (y0 < y2));
-			e20[3] = (((x + 16) + 8) - x2) * (y0 - y2) - (((y + 16) + 8) - y2) * (x0 - x2) + ((y2 == y0 && x0 < x2) || (y0 < y2));
-
-			int coverage[4] = { 0 };
-			float l0[4];
-			float l1[4];
-			float l2[4];
-			float z[4];
-			vec2 uv[4];
-			vec2 uvv[4];
-
-			for (int q = 0; q < 4; q++) {
-				for (int i = 0; i < 4; i++) {
-					int sx = SAMPLE_PATTERN[i][0];
-					int sy = SAMPLE_PATTERN[i][1];
-
-					if ((e01[q] + sx * (y1 - y0) + sy * (x1 - x0)) > 0 &&
-						(e12[q] + sx * (y2 - y1) + sy * (x2 - x1)) > 0 &&
-						(e20[q] + sx * (y0 - y2) + sy * (x0 - x2)) > 0) {
-						coverage[q] |= 1 << i;
-					}
-				}
+static void drawTri(const Batch* batch, const TriSetup* setup) {
+	// The resolve only needs to look at the pixels the visibility pass drew to
+	VisibilityFrame* frame = batch->frame;
+	if (frame) {
+		frame->left = min(frame->left, setup->left);
+		frame->top = min(frame->top, setup->top);
+		frame->right = max(frame->right, setup->right);
+		frame->bottom = max(frame->bottom, setup->bottom);
+	}
+	batch->rasterise(&batch->raster, setup);
+}
 
-				l0[q] = (float)e12[q] / (e01[q] + e12[q] + e20[q]);
-				l1[q] = (float)e20[q] / (e01[q] + e12[q] + e20[q]);
-				l2[q] = (float)e01[q] / (e01[q] + e12[q] + e20[q]);
+static int outcode(const ClipPlanes* clip, vec4 pos) {
+	int code = 0;
+	for (int p = 0; p < CLIP_PLANES; p++) {
+		if (vec4_dot(clip->planes[p], pos) < 0) {
+			code |= 1 << p;
+		}
+	}
+	return code;
+}
 
-				z[q] = 1 / (1 / z0 * l0[q] + 1 / z1 * l1[q] + 1 / z2 * l2[q]);
+// Perspective divide and snap to subpixels
+static VertexAttr projectVertex(const grFramebuffer* fb, const ClipVertex* v, int numVaryings) {
+	vec4 pos = v->pos;
+	pos.x /= pos.w;
+	pos.y /= pos.w;
+	pos.z /= pos.w;
+
+	VertexAttr attr;
+	attr.x = (int)floorf(remapf(pos.x, -1, 1, 0, fb->width) * SUBPIXEL_ONE + 0.5f);
+	attr.y = (int)floorf(remapf(pos.y, -1, 1, fb->height, 0) * SUBPIXEL_ONE + 0.5f);
+	attr.z = pos.z;
+	attr.w = pos.w;
+
+	// 4 varyings at a time. Unused ones are 0, so it doesn't matter if the last group is partly used.
+	f32x4 invW = f32x4_splat(1 / pos.w);
+	for (int a = 0; a < numVaryings; a += 4) {
+		f32x4_store(&attr.varyings[a], f32x4_mul(f32x4_load(&v->varyings[a]), invW));
+	}
+	return attr;
+}
 
-				for (int i = 0; i < MSAA_SAMPLES; i++) {
-					if (z[q] > fb->depth[py[q] * fb->width + px[q]][i]) {
-						coverage[q] &= ~(1 << i);
-					}
+// Clip a triangle that crosses the near plane or the guard band and draw what's left as a fan.
+// Each plane can add a vertex to the polygon.
+static void clipTri(const Batch* batch, const ClipVertex* verts[3], int outcodes) {
+	const ClipPlanes* clip = &batch->clip;
+	ClipVertex polys[2][3 + CLIP_PLANES];
+	ClipVertex* in = polys[0];
+	ClipVertex* out = polys[1];
+	int n = 3;
+	for (int k = 0; k < 3; k++) {
+		in[k] = *verts[k];
+	}
+
+	for (int p = 0; p < CLIP_PLANES && n >= 3; p++) {
+		if (!(outcodes & CLIP_MASK & (1 << p))) {
+			continue;
+		}
+
+		// Sutherland-Hodgman: keep the inside vertices, and add one wherever an edge crosses the plane
+		int count = 0;
+		for (int k = 0; k < n; k++) {
+			const ClipVertex* a = &in[k];
+			const ClipVertex* b = &in[(k + 1) % n];
+			float da = vec4_dot(clip->planes[p], a->pos);
+			float db = vec4_dot(clip->planes[p], b->pos);
+
+			if (da >= 0) {
+				out[count++] = *a;
+			}
+			if ((da >= 0) != (db >= 0)) {
+				float t = da / (da - db);
+				ClipVertex* c = &out[count++];
+				c->pos = vec4_lerp(a->pos, b->pos, t);
+				f32x4 ta = f32x4_splat(1 - t);
+				f32x4 tb = f32x4_splat(t);
+				for (int i = 0; i < batch->numVaryings; i += 4) {
+					f32x4 va = f32x4_mul(f32x4_load(&a->varyings[i]), ta);
+					f32x4 vb = f32x4_mul(f32x4_load(&b->varyings[i]), tb);
+					f32x4_store(&c->varyings[i], f32x4_add(va, vb));
 				}
+			}
+		}
+
+		ClipVertex* tmp = in;
+		in = out;
+		out = tmp;
+		n = count;
+	}
+
+	if (n < 3) {
+		return;
+	}
+
+	grFramebuffer* fb = batch->dev->fb;
+	VertexAttr attr[3 + CLIP_PLANES];
+	for (int k = 0; k < n; k++) {
+		attr[k] = projectVertex(fb, &in[k], batch->numVaryings);
+	}
+	for (int k = 1; k + 1 < n; k++) {
+		const VertexAttr* fan[3] = { &attr[0], &attr[k], &attr[k + 1] };
+		TriSetup setup;
+		if (setupTri(fb, fan, batch->numVaryings, &setup)) {
+			drawTri(batch, &setup);
+		}
+	}
+}
+
+const grVertexFormat GR_VERTEX_FORMAT_DEFAULT = {
+	sizeof(grVertex),
+	offsetof(grVertex, pos),
+	{ { offsetof(grVertex, uv), 2 } },
+	1,
+};
+
+const grVertexFormat GR_VERTEX_FORMAT_LIT = {
+	sizeof(grVertex),
+	offsetof(grVertex, pos),
+	{ { offsetof(grVertex, uv), 2 }, { offsetof(grVertex, normal), 3 } },
+	2,
+};
+
+static VaryingLayout varyingLayout(const grVertexFormat* format) {
+	VaryingLayout layout = { { 0 }, 0 };
+	for (int a = 0; a < format->numVaryings; a++) {
+		for (int i = 0; i < format->varyings[a].components; i++) {
+			assert(layout.count < GR_MAX_VARYINGS);
+			layout.offsets[layout.count++] = format->varyings[a].offset + i * sizeof(float);
+		}
+	}
+	return layout;
+}
+
+void grVertexShader_Default(grVertexBatch* batch) {
+	mat4_mul_vec4_soa(batch->mvp, batch->pos[0], batch->pos[1], batch->pos[2], batch->pos[3], batch->count);
+}
+
+typedef struct {
+	ClipVertex clip;
+	int outcode;
+	VertexAttr attr; // Only valid if the vertex is inside all the planes in CLIP_MASK
+} ShadedVertex;
+
+// Direct mapped from mesh indices to a window's vertices. A collision only means a vertex
+// is shaded twice.
+#define WINDOW_TAGS 1024
+
+// The vertices of GR_VERTEX_WINDOW triangles, see drawBatch
+typedef struct {
+	int tags[WINDOW_TAGS]; // Mesh index, or -1
+	int slots[WINDOW_TAGS]; // Where that vertex is in verts
+	int indices[GR_VERTEX_WINDOW * 3]; // Mesh index of each of verts
+	int corners[GR_VERTEX_WINDOW * 3]; // Which of verts each corner of each triangle is
+	ShadedVertex verts[GR_VERTEX_WINDOW * 3];
+	grVertexBatch batch;
+} VertexWindow;
+
+void VertexInput_Shade(const VertexInput* in, grVertexBatch* b) {
+	b->numVaryings = in->layout.count;
+	for (int i = 0; i < b->count; i++) {
+		const uint8_t* vert = in->vertexData + (size_t)b->indices[i] * in->format->stride;
+		vec3 pos;
+		memcpy(&pos, vert + in->format->position, sizeof(vec3));
+		b->pos[0][i] = pos.x;
+		b->pos[1][i] = pos.y;
+		b->pos[2][i] = pos.z;
+		b->pos[3][i] = 1;
+		for (int a = 0; a < in->layout.count; a++) {
+			memcpy(&b->varyings[a][i], vert + in->layout.offsets[a], sizeof(float));
+		}
+	}
+
+	in->shader(b);
+	assert(b->numVaryings >= 0 && b->numVaryings <= GR_MAX_VARYINGS);
+}
+
+// Read count of the window's vertices from first into the SoA batch, shade them, then clip
+// test and project them
+static void shadeVertices(Batch* batch, const VertexInput* in, VertexWindow* w, int first, int count) {
+	grVertexBatch* b = &w->batch;
+	b->count = count;
+	b->indices = &w->indices[first];
+	VertexInput_Shade(in, b);
+	batch->numVaryings = batch->positionsOnly ? 0 : b->numVaryings;
+
+	for (int i = 0; i < count; i++) {
+		ShadedVertex* v = &w->verts[first + i];
+		v->clip.pos = (vec4) { b->pos[0][i], b->pos[1][i], b->pos[2][i], b->pos[3][i] };
+		// Varyings past the shader's are never read, but are copied 4 at a time
+		for (int a = 0; a < GR_MAX_VARYINGS; a++) {
+			v->clip.varyings[a] = a < batch->numVaryings ? b->varyings[a][i] : 0;
+		}
+
+		v->outcode = outcode(&batch->clip, v->clip.pos);
+		if (!(v->outcode & CLIP_MASK)) {
+			v->attr = projectVertex(batch->dev->fb, &v->clip, batch->numVaryings);
+		}
+	}
+}
+
+// Find the distinct vertices of count triangles, and which of them each corner uses.
+// Returns the number of vertices.
+static int gatherWindow(VertexWindow* w, const int* indices, int count) {
+	memset(w->tags, 0xff, sizeof(w->tags));
+	int numVerts = 0;
+	for (int i = 0; i < count * 3; i++) {
+		int index = indices[i];
+		int tag = index & (WINDOW_TAGS - 1);
+		if (w->tags[tag] != index) {
+			w->tags[tag] = index;
+			w->slots[tag] = numVerts;
+			w->indices[numVerts++] = index;
+		}
+		w->corners[i] = w->slots[tag];
+	}
+	return numVerts;
+}
+
+// Draw a run of sub meshes that all use tex as one batch. The sampler is picked once, and
+// only the texture array layer changes between them.
+// Triangles are drawn a window at a time: the vertices the window's triangles use are
+// shaded, GR_VERTEX_BATCH_SIZE at a time, then the triangles are clipped and rasterised.
+static void drawBatch(grDevice* dev, grMesh* mesh, const VertexInput* in, VertexWindow* w, const grSubMesh* subs, int numSubs, grTexture* tex, DrawPass pass, VisibilityFrame* frame) {
+	const grPixelShader* shader = dev->shader ? dev->shader : &GR_SHADER_TEXTURED;
+	Batch batch;
+	batch.dev = dev;
+	batch.rasterise = shader->rasterise[pass];
+	batch.positionsOnly = (pass == PASS_DEPTH || pass == PASS_VISIBILITY) && !shader->discards;
+	batch.raster.fb = dev->fb;
+	batch.raster.tex = tex;
+	// The filter and wrap modes are looked at once per batch. Shaders that don't sample
+	// can draw without a texture.
+	if (tex) {
+		batch.raster.sampler = Texture_GetSampler(tex);
+	}
+	else {
+		memset(&batch.raster.sampler, 0, sizeof(batch.raster.sampler));
+	}
+	batch.raster.uniforms = dev->uniforms;
+	batch.raster.id = (grVisibilitySample) { GR_NO_INSTANCE, 0 };
+	batch.frame = pass == PASS_VISIBILITY ? frame : NULL;
+	batch.clip = clipPlanes(dev->fb);
+	batch.numVaryings = in->layout.count;
+	dev->batches++;
+
+	for (int s = 0; s < numSubs; s++) {
+		const grSubMesh* sub = &subs[s];
+		batch.raster.sampler.layer = sub->layer;
+		if (batch.frame) {
+			// Each sub mesh is an instance, so the resolve knows which layer it uses
+			VisibilityInstance instance = { mesh, *in, *w->batch.mvp, *w->batch.model, dev->vertexUniforms, shader, batch.raster };
+			batch.raster.id.instance = Visibility_AddInstance(batch.frame, &instance);
+		}
 
-				float W = 1 / (1 / attr[0].w * l0[q] + 1 / attr[1].w * l1[q] + 1 / attr[2].w * l2[q]);
-				uv[q] = (vec2){
-					W * (uv0.x * l0[q] + uv1.x * l1[q] + uv2.x * l2[q])/* * dev->tex->width*/,
-					W * (uv0.y * l0[q] + uv1.y * l1[q] + uv2.y * l2[q])/* * dev->tex->width*/,
-				};
-				uvv[q] = (vec2){
-					W * (uv0.x * l0[q] + uv1.x * l1[q] + uv2.x * l2[q]) * dev->tex->width,
-					W * (uv0.y * l0[q] + uv1.y * l1[q] + uv2.y * l2[q]) * dev->tex->width,
-				};
+		for (int first = sub->first; first < sub->first + sub->count; first += GR_VERTEX_WINDOW) {
+			int count = min(GR_VERTEX_WINDOW, sub->first + sub->count - first);
+			int numVerts = gatherWindow(w, &mesh->indices[first * 3], count);
+			for (int i = 0; i < numVerts; i += GR_VERTEX_BATCH_SIZE) {
+				shadeVertices(&batch, in, w, i, min(GR_VERTEX_BATCH_SIZE, numVerts - i));
 			}
 
-			// Screen-space partial derivatives of uvs required for mipmapping
-			vec2 dFdx_uv[4] = {
-				{uvv[1].x - uvv[0].x, uvv[1].y - uvv[0].y},
-				{uvv[1].x - uvv[0].x, uvv[1].y - uvv[0].y},
-				{uvv[3].x - uvv[2].x, uvv[3].y - uvv[2].y},
-				{uvv[3].x - uvv[2].x, uvv[3].y - uvv[2].y},
-			};
-			vec2 dFdy_uv[4] = {
-				{uvv[2].x - uvv[0].x, uvv[2].y - uvv[0].y},
-				{uvv[3].x - uvv[1].x, uvv[3].y - uvv[1].y},
-				{uvv[2].x - uvv[0].x, uvv[2].y - uvv[0].y},
-				{uvv[3].x - uvv[1].x, uvv[3].y - uvv[1].y},
-			};
-
-			rgb MIPCOLOURS[] = {
-				{0, 0, 0},
-				{255, 0, 0},
-				{0, 255, 0},
-				{0, 0, 255},
-				{255, 255, 0},
-				{255, 0, 255},
-				{0, 255, 255},
-				{127, 127, 127}
-			};
-
-			for (int q = 0; q < 4; q++) {
-				float fx = squaref(dFdx_uv[q].x) + squaref(dFdx_uv[q].y);
-				float fy = squaref(dFdy_uv[q].x) + squaref(dFdy_uv[q].y);
-				float level = log2f(fmaxf(fx, fy)) / 2.f;
-				level = fmaxf(level, 0.);
-
-				rgb tc1 = Texture_sample(dev->tex, uv[q].x, uv[q].y, fminf((int)level, dev->tex->numMipmaps - 1));
-				rgb tc2 = Texture_sample(dev->tex, uv[q].x, uv[q].y, fminf((int)level + 1, dev->tex->numMipmaps - 1));
-				/*rgb tc1 = MIPCOLOURS[(int)level];
-				rgb tc2 = MIPCOLOURS[(int)level + 1];*/
-				rgb tc = (rgb){
-					lerpf(tc1.r, tc2.r, fmodf(level, 1.f)),
-					lerpf(tc1.g, tc2.g, fmodf(level, 1.f)),
-					lerpf(tc1.b, tc2.b, fmodf(level, 1.f)),
-				};
-				//tc = Texture_sample(dev->tex, uv[q].x, uv[q].y, 0);
-				
-				rgb* c = fb->colour[py[q] * fb->width + px[q]];
-				float* d = fb->depth[py[q] * fb->width + px[q]];
-
-				for (int i = 0; i < MSAA_SAMPLES; i++) {
-					if (coverage[q] & (1 << i)) {
-						c[i] = tc;
-						d[i] = z[q];
+			for (int i = 0; i < count * 3; i += 3) {
+				batch.raster.id.triangle = first + i / 3;
+				const ShadedVertex* v[3] = { &w->verts[w->corners[i]], &w->verts[w->corners[i + 1]], &w->verts[w->corners[i + 2]] };
+
+				// Entirely outside one of the planes
+				if (v[0]->outcode & v[1]->outcode & v[2]->outcode) {
+					continue;
+				}
+
+				if ((v[0]->outcode | v[1]->outcode | v[2]->outcode) & CLIP_MASK) {
+					const ClipVertex* verts[3] = { &v[0]->clip, &v[1]->clip, &v[2]->clip };
+					clipTri(&batch, verts, v[0]->outcode | v[1]->outcode | v[2]->outcode);
+				}
+				else {
+					const VertexAttr* attr[3] = { &v[0]->attr, &v[1]->attr, &v[2]->attr };
+					TriSetup setup;
+					if (setupTri(dev->fb, attr, batch.numVaryings, &setup)) {
+						drawTri(&batch, &setup);
 					}
 				}
 			}
@@ -362,59 +526,55 @@ static void tri(grDevice* dev, VertexAttr attr[3]) {
 	}
 }
 
-#include <stdio.h>
+void Device_Draw(grDevice* dev, grMesh* mesh, const mat4* model, DrawPass pass, VisibilityFrame* frame) {
+	mat4 vp = mat4_mul(&dev->proj, &dev->view);
+	mat4 mvp = mat4_mul(&vp, model);
+
+	VertexInput in;
+	in.format = mesh->format ? mesh->format : &GR_VERTEX_FORMAT_DEFAULT;
+	in.vertexData = mesh->vertexData ? mesh->vertexData : (const uint8_t*)mesh->verts;
+	in.layout = varyingLayout(in.format);
+	in.shader = dev->vertexShader ? dev->vertexShader : grVertexShader_Default;
+
+	// Too big for the stack
+	VertexWindow* w = xmalloc(sizeof(VertexWindow));
+	w->batch.mvp = &mvp;
+	w->batch.model = model;
+	w->batch.uniforms = dev->vertexUniforms;
+
+	if (mesh->numSubMeshes == 0) {
+		grSubMesh all = { 0, mesh->count, NULL, 0 };
+		drawBatch(dev, mesh, &in, w, &all, 1, dev->tex, pass, frame);
+	}
+	else {
+		// Each run of sub meshes with the same texture is one batch
+		int first = 0;
+		while (first < mesh->numSubMeshes) {
+			grTexture* tex = mesh->subMeshes[first].tex ? mesh->subMeshes[first].tex : dev->tex;
+			int end = first + 1;
+			while (end < mesh->numSubMeshes && (mesh->subMeshes[end].tex ? mesh->subMeshes[end].tex : dev->tex) == tex) {
+				end++;
+			}
+			drawBatch(dev, mesh, &in, w, &mesh->subMeshes[first], end - first, tex, pass, frame);
+			first = end;
+		}
+	}
+
+	free(w);
+	Sampler_FlushStats(&dev->stats);
+}
 
 void grDraw(grDevice* dev, grMesh* mesh) {
-	mat4 vp = mat4_mul(&dev->proj, &dev->view);
-	mat4 mvp = mat4_mul(&vp, &mesh->modelMat);
-
-	for (int i = 0; i < mesh->count * 3; i += 3) {
-		grVertex a = mesh->verts[mesh->indices[i + 0]];
-		grVertex b = mesh->verts[mesh->indices[i + 1]];
-		grVertex c = mesh->verts[mesh->indices[i + 2]];
-
-		vec4 a_pos = mat4_mul_vec4(&mvp, (vec4) { a.pos.x, a.pos.y, a.pos.z, 1 });
-		a_pos.x /= a_pos.w;
-		a_pos.y /= a_pos.w;
-		a_pos.z /= a_pos.w;
-		//a_pos.w /= a_pos.w;
-
-		vec4 b_pos = mat4_mul_vec4(&mvp, (vec4) { b.pos.x, b.pos.y, b.pos.z, 1 });
-		b_pos.x /= b_pos.w;
-		b_pos.y /= b_pos.w;
-		b_pos.z /= b_pos.w;
-		//b_pos.w /= b_pos.w;
-
-		vec4 c_pos = mat4_mul_vec4(&mvp, (vec4) { c.pos.x, c.pos.y, c.pos.z, 1 });
-		c_pos.x /= c_pos.w;
-		c_pos.y /= c_pos.w;
-		c_pos.z /= c_pos.w;
-		//c_pos.w /= c_pos.w;
-
-		//printf("%f %f %f\n", a_pos.z, b_pos.z, c_pos.z);
-
-		int x0 = remapf(a_pos.x, -1, 1, 0, dev->fb->width) * 16;
-		int y0 = remapf(a_pos.y, -1, 1, dev->fb->height, 0) * 16;
-
-		int x1 = remapf(b_pos.x, -1, 1, 0, dev->fb->width) * 16;
-		int y1 = remapf(b_pos.y, -1, 1, dev->fb->height, 0) * 16;
-
-		int x2 = remapf(c_pos.x, -1, 1, 0, dev->fb->width) * 16;
-		int y2 = remapf(c_pos.y, -1, 1, dev->fb->height, 0) * 16;
-
-		a.uv.x /= a_pos.w;
-		a.uv.y /= a_pos.w;
-		b.uv.x /= b_pos.w;
-		b.uv.y /= b_pos.w;
-		c.uv.x /= c_pos.w;
-		c.uv.y /= c_pos.w;
-
-		VertexAttr attr[3] = {
-			{x0, y0, a_pos.z, a_pos.w, a.uv},
-			{x1, y1, b_pos.z, b_pos.w, b.uv},
-			{x2, y2, c_pos.z, c_pos.w, c.uv},
-		};
-
-		tri(dev, attr);
+	if (dev->visibilityBuffer) {
+		VisibilityFrame* frame = Visibility_Begin(dev);
+		Device_Draw(dev, mesh, &mesh->modelMat, PASS_VISIBILITY, frame);
+		Visibility_Resolve(dev, frame);
+	}
+	else if (dev->depthPrepass) {
+		Device_Draw(dev, mesh, &mesh->modelMat, PASS_DEPTH, NULL);
+		Device_Draw(dev, mesh, &mesh->modelMat, PASS_SHADE_EQUAL, NULL);
+	}
+	else {
+		Device_Draw(dev, mesh, &mesh->modelMat, PASS_SHADE, NULL);
 	}
 }
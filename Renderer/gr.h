@@ -1,26 +1,49 @@
 #ifndef GR_H
 #define GR_H
 
+#include <stdbool.h>
+#include <stddef.h>
+
 #include "gr_math.h"
 
 // TODO Allow this to be set at runtime
 #define MSAA_SAMPLES 4
 
+// Vertices are snapped to 1 / 2^GR_SUBPIXEL_BITS of a pixel, 4 to 8 bits. 8 is more
+// precise but shrinks the guard band triangles are clipped to (see gr.c) to 16K pixels.
+#ifndef GR_SUBPIXEL_BITS
+#define GR_SUBPIXEL_BITS 4
+#endif
+
+// A sample of the visibility buffer, see grDevice.visibilityBuffer
+typedef struct {
+	// One for each sub mesh of each draw, numbered from 0 after each clear in the order
+	// they're drawn. GR_NO_INSTANCE where nothing has been drawn since the clear.
+	unsigned int instance;
+	unsigned int triangle; // In the draw's mesh
+} grVisibilitySample;
+
+#define GR_NO_INSTANCE 0xffffffffu
+
 typedef struct {
 	int width;
 	int height;
 	rgb (*colour)[MSAA_SAMPLES];
 	float (*depth)[MSAA_SAMPLES];
+	// Which triangle is at each sample, e.g. for picking. NULL until the first draw with
+	// grDevice.visibilityBuffer set, and only written by those draws.
+	grVisibilitySample (*visibility)[MSAA_SAMPLES];
+	unsigned int visibilityInstances; // Instance numbers used since the last clear
 } grFramebuffer;
 
 grFramebuffer* grFramebuffer_Create(int width, int height);
 void grFramebuffer_Destroy(grFramebuffer* fb);
 
 typedef enum {
-	GR_NEAREST,
-	GR_LINEAR,
-	GR_NEAREST_MIPMAP_NEAREST,
-	GR_LINEAR_MIPMAP_LINEAR,
+	GR_NEAREST, // Nearest texel of the top level
+	GR_LINEAR, // Bilinear from the top level
+	GR_NEAREST_MIPMAP_NEAREST, // Nearest texel of the nearest level
+	GR_LINEAR_MIPMAP_LINEAR, // Trilinear
 } grTextureFilter;
 
 typedef enum {
@@ -28,10 +51,41 @@ typedef enum {
 	GR_REPEAT,
 } grTextureWrapMode;
 
+typedef enum {
+	GR_LAYOUT_LINEAR, // Row major
+	GR_LAYOUT_TILED, // GR_TILE_SIZE x GR_TILE_SIZE tiles in row major order, row major texels within each tile
+} grTextureLayout;
+
+// A 4x4 tile of rgb texels is 48 bytes, so a bilinear footprint almost always
+// touches one or two cache lines whatever direction the texture is walked in
+#define GR_TILE_SIZE 4
+
+typedef enum {
+	GR_RGB8,
+	GR_RGBA8, // Alpha is stored but not used yet
+	GR_R8, // Sampled as greyscale
+	GR_RG8, // Sampled with blue = 0
+	GR_RGB565,
+	GR_BC1, // 4x4 blocks of 8 bytes, 4 bits per texel
+	GR_BC3, // 4x4 blocks of 16 bytes, 8 bits per texel. Alpha is stored but not used yet.
+} grTextureFormat;
+
+// Block compressed formats are decoded on the fly by the sampler. Their blocks are
+// GR_TILE_SIZE x GR_TILE_SIZE and stored in row major order, the layout is ignored.
+bool grTextureFormat_IsCompressed(grTextureFormat format);
+// Bytes per texel in memory, or 0 for block compressed formats
+int grTextureFormat_BytesPerTexel(grTextureFormat format);
+// Bytes per 4x4 block of a block compressed format
+int grTextureFormat_BlockBytes(grTextureFormat format);
+// Number of 8 bit components grTexture_SetData expects per texel (RGB565 takes RGB8)
+int grTextureFormat_Components(grTextureFormat format);
+
 typedef struct {
 	int width;
 	int height;
-	rgb* data;
+	int tilesX; // Number of tiles (or compressed blocks) across
+	void* data; // In the texture's format and layout
+	size_t layerSize; // Bytes between the layers of a texture array
 } grMipmapLevel;
 
 typedef struct {
@@ -39,22 +93,147 @@ typedef struct {
 	int height;
 	grMipmapLevel* mipmaps;
 	int numMipmaps;
+	// Texture arrays have several layers with the same size, format and mip chain.
+	// Each level holds all the layers one after the other. 1 for an ordinary texture.
+	int layers;
+
+	// Storage order of the texels. This must be set before grTexture_SetData,
+	// and is otherwise invisible because the sampler handles both layouts.
+	grTextureLayout layout;
+	// Storage format of the texels. This must also be set before grTexture_SetData.
+	grTextureFormat format;
+	void* mipmapData; // Every resident level's data, in one allocation
+	size_t dataSize; // Size of mipmapData in bytes
+
+	// Milliseconds spent building the mip chain in the last grTexture_SetData
+	float mipGenTime;
 
-	// For now these are unimplemented and just ignored
+	// Can be changed at any time, the sampler is picked at the start of each draw.
+	// Defaults to GR_LINEAR_MIPMAP_LINEAR and GR_CLAMP.
 	grTextureFilter filter;
 	grTextureWrapMode wrapU;
 	grTextureWrapMode wrapV;
+	// Anisotropic filtering takes up to this many trilinear probes along the long axis
+	// of a pixel's footprint. Only used with GR_LINEAR_MIPMAP_LINEAR. 1 (the default) disables it.
+	int maxAnisotropy;
+
+	// Unique for every grTexture_SetData call, tags the texture's blocks in the sampler's cache
+	unsigned int id;
+
+	// Finest level with data. Finer levels have NULL data and the sampler uses this one
+	// instead. Always 0 unless the texture is being streamed with grTexture_SetResidentData.
+	int residentLevel;
+	// Finest level the sampler wanted since this was last set to numMipmaps, resident or
+	// not. A texture manager can reset it every frame to find out which levels are needed.
+	int sampledLevel;
 } grTexture;
 
 grTexture* grTexture_Create(int width, int height);
-void grTexture_SetData(grTexture* tex, rgb* data, int width, int height);
+void grTexture_Destroy(grTexture* tex);
+// data has grTextureFormat_Components(tex->format) 8 bit components per texel.
+// Any size works. Each mip level halves both sizes, rounding down, until the level is 1x1.
+void grTexture_SetData(grTexture* tex, const void* data, int width, int height);
+// Same for a texture array. data holds the layers one after the other.
+void grTexture_SetArrayData(grTexture* tex, const void* data, int width, int height, int layers);
+// Set already compressed data for a block compressed format, e.g. read from a DDS file.
+// data holds the blocks of every mip level down to 1x1, largest first, with each level's
+// layers one after the other if tex->layers has been set.
+void grTexture_SetCompressedData(grTexture* tex, const void* data, int width, int height);
+
+// Streaming. Levels are stored largest first, so the resident ones are always a tail of the chain.
+// Bytes of level and all the coarser ones, in the texture's format and layout
+size_t grTexture_TailBytes(const grTexture* tex, int level);
+// Replace the texture's data with levels level and coarser of a width x height texture, already
+// in the texture's format and layout, e.g. read back from disk. The texture takes ownership of data.
+void grTexture_SetResidentData(grTexture* tex, void* data, int level, int width, int height);
+// Free the levels finer than level
+void grTexture_Evict(grTexture* tex, int level);
+// Build the mip chain of an ordinary texture like grTexture_SetData, but a level at a time,
+// e.g. to write it out to disk without ever holding all of it. Each level is passed to fn,
+// largest first, in the texture's format and layout at tex->mipmaps[level].data, which is
+// only valid during the call. Only residentLevel and coarser levels are kept. Apart from
+// data and the kept levels, at most a third of data's size is allocated at once (plus one
+// encoded level 0 for formats other than 8 bit linear).
+// Stops and returns false as soon as fn does.
+typedef bool (*grTextureLevelFn)(void* user, const grTexture* tex, int level);
+bool grTexture_BuildLevels(grTexture* tex, const void* data, int width, int height, int residentLevel, grTextureLevelFn fn, void* user);
+
+// Index of texel (x, y) of a mip level in grMipmapLevel.data, for whichever layout the texture uses.
+// Not meaningful for block compressed formats.
+int grTexture_TexelIndex(const grTexture* tex, int level, int x, int y);
+
+// Texture sampling counters. grDraw adds to them, zero them whenever you like.
+typedef struct {
+	long long samples; // Nearest or bilinear samples of a single level
+	// Decoded block cache, only used by block compressed formats.
+	// Each bilinear sample does 4 lookups.
+	long long blockHits;
+	long long blockMisses;
+	// Trilinear quads by the path they took. LOD is worked out once per 2x2 quad.
+	long long magnifiedQuads; // LOD <= 0, level 0 only
+	long long singleLevelQuads; // Negligible blend weight or both levels past the end of the chain
+	long long trilinearQuads;
+	// Anisotropic quads, and the trilinear probes taken for their pixels
+	long long anisotropicQuads;
+	long long anisotropicProbes;
+	// Quads that wanted a finer level than was resident and used the finest resident one
+	long long nonResidentQuads;
+} grSamplerStats;
+
+// A pixel shader and the rasteriser compiled for it. Write your own with gr_shader.h.
+typedef struct grPixelShader grPixelShader;
+
+// Textured, with the first two varyings as uvs. What grDraw uses if there's no shader.
+extern const grPixelShader GR_SHADER_TEXTURED;
+// Colours each quad by the mip level it samples, black for level 0 then red, green, blue,
+// yellow, magenta, cyan and grey
+extern const grPixelShader GR_SHADER_MIP_LEVELS;
+// Textured and lit by a directional light, with normals in varyings 2 to 4 (see
+// GR_VERTEX_FORMAT_LIT). Its uniforms are a grLightUniforms.
+extern const grPixelShader GR_SHADER_LIT;
+
+typedef struct {
+	vec3 direction; // Towards the light, in the mesh's model space
+	float ambient; // Light from every direction, 0 to 1
+} grLightUniforms;
+
+// See below
+typedef struct grVertexBatch grVertexBatch;
+
+// Turns a batch of vertices into clip space, see grVertexBatch
+typedef void (*grVertexShaderFn)(grVertexBatch* batch);
 
 typedef struct {
 	grFramebuffer* fb;
 	mat4 proj;
 	mat4 view;
 
+	// May be NULL if the shader doesn't sample a texture, e.g. for depth only drawing
 	grTexture* tex;
+	// Colours the pixels, GR_SHADER_TEXTURED if NULL
+	const grPixelShader* shader;
+	// Passed to the shader, which knows what they are
+	const void* uniforms;
+	// Transforms the vertices, grVertexShader_Default if NULL
+	grVertexShaderFn vertexShader;
+	// Passed to the vertex shader
+	const void* vertexUniforms;
+	// Draw depth first, without shading, then shade only the samples that are still
+	// visible, so each sample is shaded at most once however many triangles cover it.
+	// grDraw does it a mesh at a time, grDevice_Execute (gr_command.h) for everything
+	// between clears. The vertices are shaded twice.
+	bool depthPrepass;
+	// Rasterise only which triangle is at each sample, into the framebuffer's visibility
+	// buffer, then shade the screen in tiles on every core, once per pixel for each triangle
+	// in it. The cost of shading no longer depends on how many triangles are drawn or in
+	// what order. Done a mesh at a time or for everything between clears like depthPrepass,
+	// which it replaces. The vertices of the visible triangles are shaded again for each
+	// tile they're in.
+	bool visibilityBuffer;
+
+	grSamplerStats stats;
+	// Number of batches grDraw has drawn, zero it whenever you like
+	long long batches;
 } grDevice;
 
 grDevice* grDevice_Create(void);
@@ -67,15 +246,92 @@ void grPixel(grDevice* dev, int x, int y, rgb colour);
 typedef struct {
 	vec3 pos;
 	vec2 uv;
+	vec3 normal;
 } grVertex;
 
+// Most floats a vertex can have interpolated across its triangles. A multiple of 4.
+#define GR_MAX_VARYINGS 8
+
+// Some floats next to each other in a vertex
+typedef struct {
+	int offset; // Bytes from the start of the vertex
+	int components; // Number of floats
+} grVertexAttribute;
+
+// How grDraw reads a mesh's vertices
+typedef struct {
+	int stride; // Bytes from one vertex to the next
+	int position; // Byte offset of the 3 float position
+	// Attributes interpolated perspective correct across triangles, at most GR_MAX_VARYINGS
+	// floats in all. The pixel shader sees them one after the other in this order, the
+	// default one samples the texture with the first two.
+	grVertexAttribute varyings[GR_MAX_VARYINGS];
+	int numVaryings;
+} grVertexFormat;
+
+// grVertex with its uvs as the only varyings
+extern const grVertexFormat GR_VERTEX_FORMAT_DEFAULT;
+// grVertex with its uvs then its normal, for GR_SHADER_LIT
+extern const grVertexFormat GR_VERTEX_FORMAT_LIT;
+
+// A range of triangles drawn with the same material
+typedef struct {
+	int first; // First triangle
+	int count; // Number of triangles
+	grTexture* tex; // If NULL the device's texture is used, which may be NULL too
+	int layer; // Layer of tex to sample, if it's a texture array
+} grSubMesh;
+
 typedef struct {
 	grVertex* verts;
+	int numVerts;
+	// Optional. Vertices in another layout, or with other varyings. grDraw reads vertexData
+	// with format if vertexData is set, otherwise it reads verts with format, which
+	// defaults to GR_VERTEX_FORMAT_DEFAULT. The tools in gr_mesh.h and gr_atlas.h only
+	// know about verts.
+	const grVertexFormat* format;
+	const void* vertexData;
 	int* indices;
-	int count;
+	int count; // Number of triangles
 	mat4 modelMat;
+
+	// Optional. If there are no sub meshes the whole mesh is drawn with the device's texture.
+	// Consecutive sub meshes with the same texture (e.g. layers of one texture array, or
+	// regions of an atlas, see gr_atlas.h) are drawn as a single batch.
+	grSubMesh* subMeshes;
+	int numSubMeshes;
 } grMesh;
 
+// grDraw shades the vertices of up to this many triangles at a time, each one once however
+// many of the triangles use it. Run the mesh through grMesh_OptimizeVertexCache and
+// grMesh_OptimizeVertexFetch (gr_mesh.h) so triangles that share vertices are close together.
+#define GR_VERTEX_WINDOW 256
+
+// Most vertices a vertex shader gets at once
+#define GR_VERTEX_BATCH_SIZE 64
+
+// Vertices being shaded, as a structure of arrays so a vertex shader can work on 4 at a
+// time with f32x4s, and make one call for many vertices
+struct grVertexBatch {
+	int count; // Up to GR_VERTEX_BATCH_SIZE
+	const int* indices; // Of each vertex in the mesh, for data that isn't in its format (bone weights, morph targets...)
+
+	// x, y, z and w. The format's position in model space with w = 1 in, clip space out.
+	float pos[4][GR_VERTEX_BATCH_SIZE];
+	// The format's varyings in, what's interpolated for the pixel shader out
+	float varyings[GR_MAX_VARYINGS][GR_VERTEX_BATCH_SIZE];
+	// The format's number of varyings in. The shader can change it, as long as it does
+	// the same for every batch.
+	int numVaryings;
+
+	const mat4* mvp; // Model view projection
+	const mat4* model;
+	const void* uniforms; // grDevice.vertexUniforms
+};
+
+// Multiplies the positions by the model view projection matrix
+void grVertexShader_Default(grVertexBatch* batch);
+
 void grDraw(grDevice* dev, grMesh* mesh);
 
 #endif
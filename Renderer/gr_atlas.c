@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "util.h"
+
+#include "gr_atlas.h"
+#include "gr_internal.h"
+
+static int roundUp(int x, int multiple) {
+	return (x + multiple - 1) / multiple * multiple;
+}
+
+typedef struct {
+	int index; // Into the textures being packed
+	int width; // Including the border, rounded up to a multiple of the padding
+	int height;
+	int x;
+	int y;
+} AtlasItem;
+
+// Tallest first, which keeps the shelves tight
+static int compareItems(const void* a, const void* b) {
+	const AtlasItem* ia = a;
+	const AtlasItem* ib = b;
+	if (ia->height != ib->height) {
+		return ib->height - ia->height;
+	}
+	return ia->index - ib->index;
+}
+
+// Place the items left to right in rows as tall as their first (tallest) item.
+// Returns the height used, or -1 if an item is wider than the atlas.
+static int packShelves(AtlasItem* items, int count, int width) {
+	int x = 0;
+	int y = 0;
+	int shelf = 0;
+	for (int i = 0; i < count; i++) {
+		if (items[i].width > width) {
+			return -1;
+		}
+		if (x + items[i].width > width) {
+			y += shelf;
+			x = 0;
+			shelf = 0;
+		}
+		items[i].x = x;
+		items[i].y = y;
+		x += items[i].width;
+		shelf = max(shelf, items[i].height);
+	}
+	return y + shelf;
+}
+
+grTexture* grAtlas_Build(grTexture* const* textures, int count, grTextureFormat format, int padding, int maxSize, grAtlasRegion* regions) {
+	int align = max(padding, 1);
+	AtlasItem* items = xmalloc(max(count, 1) * sizeof(AtlasItem));
+	long long area = 0;
+	for (int i = 0; i < count; i++) {
+		items[i].index = i;
+		items[i].width = roundUp(textures[i]->width + padding * 2, align);
+		items[i].height = roundUp(textures[i]->height + padding * 2, align);
+		area += (long long)items[i].width * items[i].height;
+	}
+	qsort(items, count, sizeof(AtlasItem), compareItems);
+
+	// Start from the smallest square that could hold everything and widen it a quarter
+	// at a time until it's at least as wide as it is tall. Sizes needn't be powers of 2.
+	int width = min(roundUp((int)ceil(sqrt((double)area)), align), maxSize);
+	int height = packShelves(items, count, width);
+	while ((height < 0 || height > width) && width < maxSize) {
+		width = min(roundUp(width + width / 4, align), maxSize);
+		height = packShelves(items, count, width);
+	}
+	if (height <= 0 || height > maxSize) {
+		free(items);
+		return NULL;
+	}
+
+	// Borders repeat the edge texels, the rounding up to the alignment is left black
+	int components = grTextureFormat_Components(format);
+	uint8_t* data = xmalloc((size_t)width * height * components);
+	memset(data, 0, (size_t)width * height * components);
+
+	for (int i = 0; i < count; i++) {
+		const AtlasItem* item = &items[i];
+		const grTexture* tex = textures[item->index];
+		int left = item->x + padding;
+		int top = item->y + padding;
+
+		for (int y = -padding; y < tex->height + padding; y++) {
+			int ty = min(max(y, 0), tex->height - 1);
+			uint8_t* row = &data[((size_t)(top + y) * width + left) * components];
+			for (int x = -padding; x < tex->width + padding; x++) {
+				rgb c = Texture_ReadTexel(tex, 0, 0, min(max(x, 0), tex->width - 1), ty);
+				uint8_t texel[4] = { c.r, c.g, c.b, 255 };
+				memcpy(&row[x * components], texel, components);
+			}
+		}
+
+		regions[item->index].scale = (vec2) { (float)tex->width / width, (float)tex->height / height };
+		regions[item->index].offset = (vec2) { (float)left / width, (float)top / height };
+	}
+
+	grTexture* atlas = grTexture_Create(width, height);
+	atlas->format = format;
+	grTexture_SetData(atlas, data, width, height);
+
+	free(data);
+	free(items);
+	return atlas;
+}
+
+static int findTexture(grTexture* const* textures, int count, const grTexture* tex) {
+	for (int i = 0; i < count; i++) {
+		if (textures[i] == tex) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static bool uvsInUnitSquare(const grMesh* mesh, const grSubMesh* sub) {
+	for (int i = sub->first * 3; i < (sub->first + sub->count) * 3; i++) {
+		vec2 uv = mesh->verts[mesh->indices[i]].uv;
+		if (uv.x < 0 || uv.x > 1 || uv.y < 0 || uv.y > 1) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static vec2 remapUv(vec2 uv, const grAtlasRegion* region) {
+	return (vec2) { uv.x * region->scale.x + region->offset.x, uv.y * region->scale.y + region->offset.y };
+}
+
+// Vertex owners other than sub mesh indices
+#define OWNER_NONE -1
+#define OWNER_KEEP -2 // Used by a sub mesh that stays on its own texture
+
+int grAtlas_RemapMesh(grMesh* mesh, grTexture* atlas, grTexture* const* textures, const grAtlasRegion* regions, int count) {
+	int numVerts = mesh->numVerts;
+
+	// Region each sub mesh moves to, or -1 if it stays put
+	int* target = xmalloc(max(mesh->numSubMeshes, 1) * sizeof(int));
+	for (int s = 0; s < mesh->numSubMeshes; s++) {
+		grSubMesh* sub = &mesh->subMeshes[s];
+		target[s] = findTexture(textures, count, sub->tex);
+		if (target[s] >= 0 && !uvsInUnitSquare(mesh, sub)) {
+			target[s] = -1;
+		}
+	}
+
+	// Each vertex is remapped in place for the first sub mesh that moves it. Any other
+	// sub mesh that uses it gets its own copy, made from the original uvs.
+	int* owner = xmalloc(max(numVerts, 1) * sizeof(int));
+	int* copyFor = xmalloc(max(numVerts, 1) * sizeof(int));
+	int* copyIndex = xmalloc(max(numVerts, 1) * sizeof(int));
+	vec2* uvs = xmalloc(max(numVerts, 1) * sizeof(vec2));
+	for (int v = 0; v < numVerts; v++) {
+		owner[v] = OWNER_NONE;
+		copyFor[v] = -1;
+		uvs[v] = mesh->verts[v].uv;
+	}
+	for (int s = 0; s < mesh->numSubMeshes; s++) {
+		const grSubMesh* sub = &mesh->subMeshes[s];
+		for (int i = sub->first * 3; i < (sub->first + sub->count) * 3 && target[s] < 0; i++) {
+			owner[mesh->indices[i]] = OWNER_KEEP;
+		}
+	}
+
+	int capacity = numVerts;
+	int moved = 0;
+	for (int s = 0; s < mesh->numSubMeshes; s++) {
+		grSubMesh* sub = &mesh->subMeshes[s];
+		if (target[s] < 0) {
+			continue;
+		}
+		const grAtlasRegion* region = &regions[target[s]];
+
+		for (int i = sub->first * 3; i < (sub->first + sub->count) * 3; i++) {
+			int v = mesh->indices[i];
+			if (owner[v] == OWNER_NONE) {
+				owner[v] = s;
+				mesh->verts[v].uv = remapUv(uvs[v], region);
+			}
+			else if (owner[v] != s) {
+				if (copyFor[v] != s) {
+					if (mesh->numVerts == capacity) {
+						capacity = capacity * 2 + 64;
+						mesh->verts = realloc(mesh->verts, capacity * sizeof(grVertex));
+						if (mesh->verts == NULL) {
+							fprintf(stderr, "Error allocating %zu bytes\n", capacity * sizeof(grVertex));
+							exit(EXIT_FAILURE);
+						}
+					}
+					grVertex copy = mesh->verts[v];
+					copy.uv = remapUv(uvs[v], region);
+					copyFor[v] = s;
+					copyIndex[v] = mesh->numVerts;
+					mesh->verts[mesh->numVerts++] = copy;
+				}
+				mesh->indices[i] = copyIndex[v];
+			}
+		}
+
+		sub->tex = atlas;
+		sub->layer = 0;
+		moved++;
+	}
+
+	free(target);
+	free(owner);
+	free(copyFor);
+	free(copyIndex);
+	free(uvs);
+	return moved;
+}
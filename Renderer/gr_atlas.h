@@ -0,0 +1,37 @@
+#ifndef GR_ATLAS_H
+#define GR_ATLAS_H
+
+#include "gr.h"
+
+// Texture atlases.
+// Lots of small textures packed into one, so a mesh with many small materials can be
+// drawn as one batch rather than one per material.
+// That only helps when the per batch cost matters. Sampling an atlas isn't any faster than
+// sampling the separate textures, and often a little slower: the padding makes it bigger
+// (80x80 texels for each 64x64 texture with 8 texels of padding), so it has more to cache,
+// and the coarse levels and the borders don't quite match clamping each texture on its own.
+// The texture_atlas bench shows the trade-off.
+
+// Where a texture ended up in an atlas. Its uvs map to uv * scale + offset.
+typedef struct {
+	vec2 scale;
+	vec2 offset;
+} grAtlasRegion;
+
+// Pack level 0 of count textures into a new texture of the given format, and write where
+// each one went to regions. Every texture gets a border of padding texels copied from its
+// edges and is placed on a multiple of padding texels, so mip levels down to log2(padding)
+// never mix texels of neighbouring textures (coarser ones do a little). padding should be a
+// power of 2. The textures need level 0 resident, arrays only have their first layer packed.
+// Returns NULL if they don't fit in maxSize x maxSize.
+grTexture* grAtlas_Build(grTexture* const* textures, int count, grTextureFormat format, int padding, int maxSize, grAtlasRegion* regions);
+
+// Move the sub meshes that use one of the count textures onto the atlas, remapping their uvs
+// into the texture's region. Vertices shared with sub meshes that aren't moved (or are moved
+// to another region) are duplicated, so mesh->verts must have come from malloc.
+// Sub meshes with uvs outside [0, 1], which rely on GR_REPEAT or clamping, are left alone.
+// The sub meshes stay in order, so only consecutive ones end up in the same batch.
+// Returns the number of sub meshes moved.
+int grAtlas_RemapMesh(grMesh* mesh, grTexture* atlas, grTexture* const* textures, const grAtlasRegion* regions, int count);
+
+#endif
@@ -0,0 +1,167 @@
+#include <stdlib.h>
+#include <math.h>
+
+#include "gr_bc.h"
+
+static uint16_t pack565(const uint8_t* c) {
+	return ((c[0] >> 3) << 11) | ((c[1] >> 2) << 5) | (c[2] >> 3);
+}
+
+static int colourDistance(const uint8_t* a, rgb b) {
+	int dr = a[0] - b.r;
+	int dg = a[1] - b.g;
+	int db = a[2] - b.b;
+	return dr * dr + dg * dg + db * db;
+}
+
+// Endpoints are the two texels furthest apart along the principal axis of the block's
+// colours, which is found with a few rounds of power iteration on the covariance matrix.
+// Not as good as a proper least squares fit but plenty fast enough to run at load time.
+static void encodeColour(const uint8_t* rgba, uint8_t* out) {
+	float mean[3] = { 0, 0, 0 };
+	for (int i = 0; i < 16; i++) {
+		for (int c = 0; c < 3; c++) mean[c] += rgba[i * 4 + c];
+	}
+	for (int c = 0; c < 3; c++) mean[c] /= 16;
+
+	// xx, xy, xz, yy, yz, zz
+	float cov[6] = { 0 };
+	for (int i = 0; i < 16; i++) {
+		float r = rgba[i * 4 + 0] - mean[0];
+		float g = rgba[i * 4 + 1] - mean[1];
+		float b = rgba[i * 4 + 2] - mean[2];
+		cov[0] += r * r;
+		cov[1] += r * g;
+		cov[2] += r * b;
+		cov[3] += g * g;
+		cov[4] += g * b;
+		cov[5] += b * b;
+	}
+
+	// Start from the covariance row of the channel with the most variance. (1, 1, 1)
+	// would be the obvious guess but gets stuck when two channels are anticorrelated.
+	float axis[3];
+	int row = cov[0] >= cov[3] && cov[0] >= cov[5] ? 0 : cov[3] >= cov[5] ? 1 : 2;
+	static const int ROWS[3][3] = { { 0, 1, 2 }, { 1, 3, 4 }, { 2, 4, 5 } };
+	for (int c = 0; c < 3; c++) axis[c] = cov[ROWS[row][c]];
+
+	for (int iter = 0; iter < 4; iter++) {
+		float x = cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2];
+		float y = cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2];
+		float z = cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2];
+		float len = fmaxf(fmaxf(fabsf(x), fabsf(y)), fabsf(z));
+		if (len == 0) break;
+		axis[0] = x / len;
+		axis[1] = y / len;
+		axis[2] = z / len;
+	}
+
+	int lo = 0;
+	int hi = 0;
+	float minT = INFINITY;
+	float maxT = -INFINITY;
+	for (int i = 0; i < 16; i++) {
+		float t = rgba[i * 4 + 0] * axis[0] + rgba[i * 4 + 1] * axis[1] + rgba[i * 4 + 2] * axis[2];
+		if (t < minT) { minT = t; lo = i; }
+		if (t > maxT) { maxT = t; hi = i; }
+	}
+
+	uint16_t e0 = pack565(&rgba[hi * 4]);
+	uint16_t e1 = pack565(&rgba[lo * 4]);
+	// e0 > e1 selects 4 colour mode in BC1
+	if (e0 < e1) {
+		uint16_t t = e0;
+		e0 = e1;
+		e1 = t;
+	}
+
+	uint32_t indices = 0;
+	if (e0 != e1) {
+		rgb palette[4];
+		for (int p = 0; p < 4; p++) {
+			palette[p] = BC_PaletteColour(BC_Expand565(e0), BC_Expand565(e1), p, true);
+		}
+
+		for (int i = 0; i < 16; i++) {
+			int best = 0;
+			int bestDist = colourDistance(&rgba[i * 4], palette[0]);
+			for (int p = 1; p < 4; p++) {
+				int d = colourDistance(&rgba[i * 4], palette[p]);
+				if (d < bestDist) {
+					bestDist = d;
+					best = p;
+				}
+			}
+			indices |= (uint32_t)best << (i * 2);
+		}
+	}
+
+	memcpy(out, &e0, 2);
+	memcpy(out + 2, &e1, 2);
+	memcpy(out + 4, &indices, 4);
+}
+
+// a0 > a1 gives 6 interpolated alphas between the endpoints, which is what we always use
+static void encodeAlpha(const uint8_t* rgba, uint8_t* out) {
+	int a0 = 0;
+	int a1 = 255;
+	for (int i = 0; i < 16; i++) {
+		a0 = max(a0, rgba[i * 4 + 3]);
+		a1 = min(a1, rgba[i * 4 + 3]);
+	}
+
+	uint64_t indices = 0;
+	if (a0 != a1) {
+		int palette[8] = { a0, a1 };
+		for (int p = 2; p < 8; p++) {
+			palette[p] = ((8 - p) * a0 + (p - 1) * a1) / 7;
+		}
+
+		for (int i = 0; i < 16; i++) {
+			int best = 0;
+			int bestDist = 256;
+			for (int p = 0; p < 8; p++) {
+				int d = abs(rgba[i * 4 + 3] - palette[p]);
+				if (d < bestDist) {
+					bestDist = d;
+					best = p;
+				}
+			}
+			indices |= (uint64_t)best << (i * 3);
+		}
+	}
+
+	out[0] = a0;
+	out[1] = a1;
+	for (int i = 0; i < 6; i++) {
+		out[2 + i] = (indices >> (i * 8)) & 255;
+	}
+}
+
+void BC_DecodeColourBlock(const uint8_t* block, bool bc1, rgb out[16]) {
+	uint16_t e0, e1;
+	uint32_t indices;
+	memcpy(&e0, block, 2);
+	memcpy(&e1, block + 2, 2);
+	memcpy(&indices, block + 4, 4);
+
+	rgb c0 = BC_Expand565(e0);
+	rgb c1 = BC_Expand565(e1);
+	rgb palette[4];
+	for (int p = 0; p < 4; p++) {
+		palette[p] = BC_PaletteColour(c0, c1, p, !bc1 || e0 > e1);
+	}
+
+	for (int i = 0; i < 16; i++) {
+		out[i] = palette[(indices >> (i * 2)) & 3];
+	}
+}
+
+void BC1_EncodeBlock(const uint8_t rgba[16 * 4], uint8_t out[BC1_BLOCK_BYTES]) {
+	encodeColour(rgba, out);
+}
+
+void BC3_EncodeBlock(const uint8_t rgba[16 * 4], uint8_t out[BC3_BLOCK_BYTES]) {
+	encodeAlpha(rgba, out);
+	encodeColour(rgba, out + 8);
+}
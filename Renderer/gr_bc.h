@@ -0,0 +1,49 @@
+#ifndef GR_BC_H
+#define GR_BC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "gr_math.h"
+
+// BC1 and BC3 (aka DXT1 and DXT5) block compression.
+// A block holds 4x4 texels. BC1 is 8 bytes: two RGB565 endpoints and 2 bit indices into
+// a palette of 4 colours made from them. BC3 is 16 bytes: an 8 byte alpha block (two 8 bit
+// endpoints and 3 bit indices) followed by a BC1 colour block.
+
+#define BC_BLOCK_SIZE 4
+#define BC1_BLOCK_BYTES 8
+#define BC3_BLOCK_BYTES 16
+
+// Compress 16 RGBA texels in row major order. BC1 ignores the alpha.
+void BC1_EncodeBlock(const uint8_t rgba[16 * 4], uint8_t out[BC1_BLOCK_BYTES]);
+void BC3_EncodeBlock(const uint8_t rgba[16 * 4], uint8_t out[BC3_BLOCK_BYTES]);
+
+static inline rgb BC_Expand565(uint16_t c) {
+	int r = c >> 11;
+	int g = (c >> 5) & 63;
+	int b = c & 31;
+	return (rgb) { (r << 3) | (r >> 2), (g << 2) | (g >> 4), (b << 3) | (b >> 2) };
+}
+
+// Palette entry i of a colour block.
+// fourColour is false for BC1 blocks with c0 <= c1, which have 3 colours and black instead.
+static inline rgb BC_PaletteColour(rgb c0, rgb c1, int i, bool fourColour) {
+	switch (i) {
+	case 0: return c0;
+	case 1: return c1;
+	case 2:
+		if (fourColour) return (rgb) { (2 * c0.r + c1.r) / 3, (2 * c0.g + c1.g) / 3, (2 * c0.b + c1.b) / 3 };
+		return (rgb) { (c0.r + c1.r) / 2, (c0.g + c1.g) / 2, (c0.b + c1.b) / 2 };
+	default:
+		if (fourColour) return (rgb) { (c0.r + 2 * c1.r) / 3, (c0.g + 2 * c1.g) / 3, (c0.b + 2 * c1.b) / 3 };
+		return (rgb) { 0, 0, 0 };
+	}
+}
+
+// Decode all 16 texels of a colour block, in row major order.
+// bc1 selects the BC1 rules, the colour half of a BC3 block always has 4 colours.
+void BC_DecodeColourBlock(const uint8_t* block, bool bc1, rgb out[16]);
+
+#endif
@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "util.h"
+
+#include "gr_command.h"
+#include "gr_internal.h"
+
+// Everything a draw is drawn with besides its mesh
+typedef struct {
+	mat4 proj;
+	mat4 view;
+	grTexture* tex;
+	const grPixelShader* shader;
+	const void* uniforms;
+	grVertexShaderFn vertexShader;
+	const void* vertexUniforms;
+} DrawState;
+
+enum {
+	CMD_CLEAR,
+	CMD_DRAW,
+};
+
+typedef struct {
+	int type;
+	rgb colour; // Clears
+	// Draws
+	int state; // Index into the buffer's states
+	grMesh* mesh;
+	mat4 model;
+	float depth; // w of the model's origin in clip space, for sorting front to back
+} Command;
+
+// Draws only point at their state, which is stored once however many draws use it
+struct grCommandBuffer {
+	Command* commands;
+	int numCommands;
+	int commandsCap;
+	DrawState* states;
+	int numStates;
+	int statesCap;
+
+	DrawState current;
+	bool changed; // current has changed since it was last added to states
+	mat4 viewProj; // Of current
+};
+
+grCommandBuffer* grCommandBuffer_Create(void) {
+	grCommandBuffer* cb = xmalloc(sizeof(grCommandBuffer));
+	cb->commands = NULL;
+	cb->commandsCap = 0;
+	cb->states = NULL;
+	cb->statesCap = 0;
+	grCommandBuffer_Reset(cb);
+	return cb;
+}
+
+void grCommandBuffer_Destroy(grCommandBuffer* cb) {
+	free(cb->commands);
+	free(cb->states);
+	free(cb);
+}
+
+void grCommandBuffer_Reset(grCommandBuffer* cb) {
+	cb->numCommands = 0;
+	cb->numStates = 0;
+	memset(&cb->current, 0, sizeof(cb->current));
+	cb->current.proj = mat4_identity();
+	cb->current.view = mat4_identity();
+	cb->viewProj = mat4_identity();
+	cb->changed = true;
+}
+
+void grCommandBuffer_SetCamera(grCommandBuffer* cb, const mat4* proj, const mat4* view) {
+	cb->current.proj = *proj;
+	cb->current.view = *view;
+	cb->viewProj = mat4_mul(proj, view);
+	cb->changed = true;
+}
+
+void grCommandBuffer_SetTexture(grCommandBuffer* cb, grTexture* tex) {
+	cb->current.tex = tex;
+	cb->changed = true;
+}
+
+void grCommandBuffer_SetShader(grCommandBuffer* cb, const grPixelShader* shader, const void* uniforms) {
+	cb->current.shader = shader;
+	cb->current.uniforms = uniforms;
+	cb->changed = true;
+}
+
+void grCommandBuffer_SetVertexShader(grCommandBuffer* cb, grVertexShaderFn shader, const void* uniforms) {
+	cb->current.vertexShader = shader;
+	cb->current.vertexUniforms = uniforms;
+	cb->changed = true;
+}
+
+static Command* addCommand(grCommandBuffer* cb, int type) {
+	cb->commands = grow(cb->commands, &cb->commandsCap, cb->numCommands, sizeof(Command));
+	Command* c = &cb->commands[cb->numCommands++];
+	memset(c, 0, sizeof(Command));
+	c->type = type;
+	return c;
+}
+
+void grCommandBuffer_Clear(grCommandBuffer* cb, rgb colour) {
+	addCommand(cb, CMD_CLEAR)->colour = colour;
+}
+
+void grCommandBuffer_Draw(grCommandBuffer* cb, grMesh* mesh, const mat4* model) {
+	if (cb->changed) {
+		cb->states = grow(cb->states, &cb->statesCap, cb->numStates, sizeof(DrawState));
+		cb->states[cb->numStates++] = cb->current;
+		cb->changed = false;
+	}
+
+	Command* c = addCommand(cb, CMD_DRAW);
+	c->state = cb->numStates - 1;
+	c->mesh = mesh;
+	c->model = *model;
+	// The bottom row of the view projection matrix times the model's translation
+	const float* vp = cb->viewProj.m;
+	const float* m = model->m;
+	c->depth = vp[12] * m[3] + vp[13] * m[7] + vp[14] * m[11] + vp[15] * m[15];
+}
+
+int grCommandBuffer_Count(const grCommandBuffer* cb) {
+	return cb->numCommands;
+}
+
+typedef struct {
+	const DrawState* state;
+	const Command* cmd;
+	int order; // Position in the buffers, so the sort is stable
+} DrawRef;
+
+static int comparePointers(const void* a, const void* b) {
+	return (uintptr_t)a < (uintptr_t)b ? -1 : (uintptr_t)a > (uintptr_t)b;
+}
+
+// By shader, since each one has its own rasteriser, then texture, then the rest of the
+// state, then nearest first so the depth test throws away as many pixels as it can
+// before they're shaded
+static int compareDraws(const void* a, const void* b) {
+	const DrawRef* da = a;
+	const DrawRef* db = b;
+	const DrawState* sa = da->state;
+	const DrawState* sb = db->state;
+
+	int c = comparePointers(sa->shader, sb->shader);
+	if (c == 0) {
+		c = comparePointers(sa->tex, sb->tex);
+	}
+	if (c == 0) {
+		c = comparePointers(sa->uniforms, sb->uniforms);
+	}
+	if (c == 0) {
+		c = comparePointers((const void*)(uintptr_t)sa->vertexShader, (const void*)(uintptr_t)sb->vertexShader);
+	}
+	if (c == 0) {
+		c = comparePointers(sa->vertexUniforms, sb->vertexUniforms);
+	}
+	if (c == 0 && da->cmd->depth != db->cmd->depth) {
+		c = da->cmd->depth < db->cmd->depth ? -1 : 1;
+	}
+	return c ? c : da->order - db->order;
+}
+
+// Nothing is shaded until the visibility buffer is resolved, so only the depth matters
+static int compareDepths(const void* a, const void* b) {
+	const DrawRef* da = a;
+	const DrawRef* db = b;
+	if (da->cmd->depth != db->cmd->depth) {
+		return da->cmd->depth < db->cmd->depth ? -1 : 1;
+	}
+	return da->order - db->order;
+}
+
+static void applyState(grDevice* dev, const DrawState* s) {
+	dev->proj = s->proj;
+	dev->view = s->view;
+	dev->tex = s->tex;
+	dev->shader = s->shader;
+	dev->uniforms = s->uniforms;
+	dev->vertexShader = s->vertexShader;
+	dev->vertexUniforms = s->vertexUniforms;
+}
+
+static void drawPass(grDevice* dev, const DrawRef* draws, int count, DrawPass pass, VisibilityFrame* frame) {
+	const DrawState* applied = NULL;
+	for (int i = 0; i < count; i++) {
+		if (draws[i].state != applied) {
+			applyState(dev, draws[i].state);
+			applied = draws[i].state;
+		}
+		Device_Draw(dev, draws[i].cmd->mesh, &draws[i].cmd->model, pass, frame);
+	}
+}
+
+static void drawSorted(grDevice* dev, DrawRef* draws, int count) {
+	if (count == 0) {
+		return;
+	}
+
+	if (dev->visibilityBuffer) {
+		qsort(draws, count, sizeof(DrawRef), compareDepths);
+		VisibilityFrame* frame = Visibility_Begin(dev);
+		drawPass(dev, draws, count, PASS_VISIBILITY, frame);
+		Visibility_Resolve(dev, frame);
+		return;
+	}
+
+	qsort(draws, count, sizeof(DrawRef), compareDraws);
+	if (dev->depthPrepass) {
+		drawPass(dev, draws, count, PASS_DEPTH, NULL);
+		drawPass(dev, draws, count, PASS_SHADE_EQUAL, NULL);
+	}
+	else {
+		drawPass(dev, draws, count, PASS_SHADE, NULL);
+	}
+}
+
+void grDevice_Execute(grDevice* dev, grCommandBuffer* const* buffers, int count) {
+	DrawState saved = { dev->proj, dev->view, dev->tex, dev->shader, dev->uniforms, dev->vertexShader, dev->vertexUniforms };
+
+	int total = 0;
+	for (int b = 0; b < count; b++) {
+		total += buffers[b]->numCommands;
+	}
+	DrawRef* draws = xmalloc(max(total, 1) * sizeof(DrawRef));
+
+	// Draws are collected until a clear, which has to wait for them
+	int numDraws = 0;
+	for (int b = 0; b < count; b++) {
+		const grCommandBuffer* cb = buffers[b];
+		for (int i = 0; i < cb->numCommands; i++) {
+			const Command* c = &cb->commands[i];
+			if (c->type == CMD_CLEAR) {
+				drawSorted(dev, draws, numDraws);
+				numDraws = 0;
+				grClear(dev, c->colour);
+			}
+			else {
+				draws[numDraws].state = &cb->states[c->state];
+				draws[numDraws].cmd = c;
+				draws[numDraws].order = numDraws;
+				numDraws++;
+			}
+		}
+	}
+	drawSorted(dev, draws, numDraws);
+
+	free(draws);
+	applyState(dev, &saved);
+}
@@ -0,0 +1,45 @@
+#ifndef GR_COMMAND_H
+#define GR_COMMAND_H
+
+#include "gr.h"
+
+// Command buffers.
+// Clears, draws and the state they're drawn with are recorded into a command buffer rather
+// than drawn straight away, then run by grDevice_Execute. Each draw keeps a copy of the
+// state it was recorded with, so the device is free to reorder them: between clears, draws
+// are sorted so ones with the same state run together, nearest first. With a visibility
+// buffer (grDevice.visibilityBuffer) nothing is shaded until it's resolved, so they're only
+// sorted nearest first.
+// Buffers don't share anything, so each thread can record its own, as long as the meshes,
+// textures and uniforms they point to aren't changed until they've been executed.
+
+typedef struct grCommandBuffer grCommandBuffer;
+
+grCommandBuffer* grCommandBuffer_Create(void);
+void grCommandBuffer_Destroy(grCommandBuffer* cb);
+// Remove every command but keep the memory, ready to record the next frame.
+// The state goes back to what a new buffer starts with.
+void grCommandBuffer_Reset(grCommandBuffer* cb);
+
+// State used by the draws recorded after it. A new buffer has identity matrices, no
+// texture and the default shaders.
+void grCommandBuffer_SetCamera(grCommandBuffer* cb, const mat4* proj, const mat4* view);
+void grCommandBuffer_SetTexture(grCommandBuffer* cb, grTexture* tex);
+void grCommandBuffer_SetShader(grCommandBuffer* cb, const grPixelShader* shader, const void* uniforms);
+void grCommandBuffer_SetVertexShader(grCommandBuffer* cb, grVertexShaderFn shader, const void* uniforms);
+
+// Clear the framebuffer. Draws are never moved past a clear.
+void grCommandBuffer_Clear(grCommandBuffer* cb, rgb colour);
+// Draw mesh with the model matrix model rather than its own, so a mesh can be drawn any
+// number of times in a buffer
+void grCommandBuffer_Draw(grCommandBuffer* cb, grMesh* mesh, const mat4* model);
+
+// Number of draws and clears recorded
+int grCommandBuffer_Count(const grCommandBuffer* cb);
+
+// Run count buffers' commands, as if the buffers had been recorded one after the other.
+// The buffers aren't changed, so they can be executed again. The device's own state
+// (camera, texture, shaders) is left as it was.
+void grDevice_Execute(grDevice* dev, grCommandBuffer* const* buffers, int count);
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef GR_INTERNAL_H
+#define GR_INTERNAL_H
+
+#include <stdint.h>
+
+#include "gr.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#define GR_THREAD_LOCAL __declspec(thread)
+#define GR_ATOMIC_INC(p) ((unsigned int)_InterlockedIncrement((volatile long*)(p)))
+#else
+#define GR_THREAD_LOCAL _Thread_local
+#define GR_ATOMIC_INC(p) __atomic_add_fetch((p), 1, __ATOMIC_RELAXED)
+#endif
+
+// Shared between the gr_*.c files but not part of the public API
+
+typedef rgb (*SampleLevelFn)(grTexture* tex, float u, float v, int level, int layer);
+
+typedef struct Sampler Sampler;
+
+// Functions specialised for a texture's format, layout, filter and wrap modes.
+// Picked once per draw by Texture_GetSampler, so the filter and wrap modes cost nothing per texel.
+struct Sampler {
+	// Sample one level, nearest or bilinear. GLSL: textureLod
+	SampleLevelFn sampleLevel;
+	// Sample the pixels of a 2x2 quad in mask with the texture's mip filter.
+	// dx and dy are the quad's screen space derivatives of the uvs, in level 0 texels.
+	void (*sampleQuad)(const Sampler* s, grTexture* tex, const vec2 uv[4], int mask, vec2 dx, vec2 dy, rgb out[4]);
+	// Layer sampleQuad reads from a texture array. Can be changed between quads.
+	int layer;
+};
+
+Sampler Texture_GetSampler(const grTexture* tex);
+
+// Texel (x, y) of a resident level, for any format. Slow, meant for tools like the atlas builder.
+rgb Texture_ReadTexel(const grTexture* tex, int level, int layer, int x, int y);
+
+// Isotropic LOD for a quad with these derivatives
+float Sampler_Lod(vec2 dx, vec2 dy);
+
+// Add the calling thread's sampler counters to stats and zero them
+void Sampler_FlushStats(grSamplerStats* stats);
+
+// What the rasteriser does with the samples it covers, see grDevice.depthPrepass
+typedef enum {
+	PASS_SHADE, // Shade the ones at least as near as the depth buffer and write their depth
+	PASS_SHADE_EQUAL, // Shade the ones exactly as near as the depth buffer, after PASS_DEPTH
+	PASS_DEPTH, // Write the depth of the ones at least as near as the depth buffer
+	// PASS_DEPTH, and write the triangle to the visibility buffer for Visibility_Resolve
+	PASS_VISIBILITY,
+	DRAW_PASSES,
+} DrawPass;
+
+// Byte offset in a vertex of each varying float, so they can be copied without looking at the attributes
+typedef struct {
+	int offsets[GR_MAX_VARYINGS];
+	int count;
+} VaryingLayout;
+
+// Where a mesh's vertices come from and how they're shaded
+typedef struct {
+	const grVertexFormat* format;
+	const uint8_t* vertexData;
+	VaryingLayout layout;
+	grVertexShaderFn shader;
+} VertexInput;
+
+// Read the vertices in batch->indices into the batch and run the vertex shader on them
+void VertexInput_Shade(const VertexInput* in, grVertexBatch* batch);
+
+// The draws rasterised into the visibility buffer since it was last resolved
+typedef struct VisibilityFrame VisibilityFrame;
+
+VisibilityFrame* Visibility_Begin(grDevice* dev);
+// Shade the pixels the frame's draws are visible in, then free it
+void Visibility_Resolve(grDevice* dev, VisibilityFrame* frame);
+
+// grDraw with a model matrix other than the mesh's, and only one pass. frame is only used
+// by PASS_VISIBILITY.
+void Device_Draw(grDevice* dev, grMesh* mesh, const mat4* model, DrawPass pass, VisibilityFrame* frame);
+
+#endif
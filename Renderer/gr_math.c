@@ -3,60 +3,23 @@
 
 #include "gr_math.h"
 
-float squaref(float x) {
-	return x * x;
-}
-
-float clampf(float x, float a, float b) {
-	if (x < a) return a;
-	if (x > b) return b;
-	return x;
-}
-
-float fractf(float x) {
-	return x - floorf(x);
-}
-
-float lerpf(float a, float b, float t) {
-	return a * (1 - t) + b * t;
-}
-
-float remapf(float x, float a1, float b1, float a2, float b2) {
-	float t = (x - a1) / (b1 - a1);
-	return a2 + t * (b2 - a2);
-}
-
 float deg2rad(float d) {
 	return d * M_PI / 180.f;
 }
 
-vec3 vec3_add(vec3 a, vec3 b) {
-	return (vec3) { a.x + b.x, a.y + b.y, a.z + b.z };
-}
-
-vec3 vec3_sub(vec3 a, vec3 b) {
-	return (vec3) { a.x - b.x, a.y - b.y, a.z - b.z };
-}
-
-float vec3_dot(vec3 a, vec3 b) {
-	return a.x * b.x + a.y * b.y + a.z * b.z;
-}
-
-vec3 vec3_cross(vec3 a, vec3 b) {
-	return (vec3) {
-		a.y * b.z - a.z * b.y,
-		a.z * b.x - a.x * b.z,
-		a.x * b.y - a.y * b.x,
-	};
-}
-
-float vec3_length(vec3 v) {
-	return sqrtf(v.x * v.x + v.y * v.y + v.z * v.z);
-}
-
-vec3 vec3_normalize(vec3 v) {
-	float l = vec3_length(v);
-	return (vec3) { v.x / l, v.y / l, v.z / l };
+// Split 4 vectors into x, y and z registers so the square roots and divides are done
+// 4 at a time. The results are bit for bit the same as vec3_normalize.
+void vec3_normalize_batch(const vec3* in, vec3* out, int count) {
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		f32x4 x, y, z;
+		f32x4_load3(&in[i].x, &x, &y, &z);
+		f32x4 l = f32x4_sqrt(f32x4_add(f32x4_add(f32x4_mul(x, x), f32x4_mul(y, y)), f32x4_mul(z, z)));
+		f32x4_store3(&out[i].x, f32x4_div(x, l), f32x4_div(y, l), f32x4_div(z, l));
+	}
+	for (; i < count; i++) {
+		out[i] = vec3_normalize(in[i]);
+	}
 }
 
 mat4 mat4_identity() {
@@ -68,9 +31,9 @@ mat4 mat4_identity() {
 	};
 }
 
-mat4 mat4_mul(mat4* a, mat4* b) {
-	float* A = a->m;
-	float* B = b->m;
+mat4 mat4_mul(const mat4* a, const mat4* b) {
+	const float* A = a->m;
+	const float* B = b->m;
 	return (mat4) {
 		A[0] * B[0] + A[1] * B[4] + A[2] * B[8] + A[3] * B[12],
 		A[0] * B[1] + A[1] * B[5] + A[2] * B[9] + A[3] * B[13],
@@ -94,14 +57,72 @@ mat4 mat4_mul(mat4* a, mat4* b) {
 	};
 }
 
-vec4 mat4_mul_vec4(mat4* m, vec4 v) {
-	float* M = m->m;
-	return (vec4) {
-		v.x * M[0] + v.y * M[1] + v.z * M[2] + v.w * M[3],
-		v.x * M[4] + v.y * M[5] + v.z * M[6] + v.w * M[7],
-		v.x * M[8] + v.y * M[9] + v.z * M[10] + v.w * M[11],
-		v.x * M[12] + v.y * M[13] + v.z * M[14] + v.w * M[15],
-	};
+static f32x4 column(const mat4* m, int j) {
+	float c[4] = { m->m[j], m->m[4 + j], m->m[8 + j], m->m[12 + j] };
+	return f32x4_load(c);
+}
+
+// Each result is the matrix's columns weighted by the point's coordinates, added up in
+// the same order as mat4_mul_vec4 so the results match it exactly
+void mat4_mul_points(const mat4* m, const void* points, size_t stride, vec4* out, int count) {
+	f32x4 c0 = column(m, 0);
+	f32x4 c1 = column(m, 1);
+	f32x4 c2 = column(m, 2);
+	f32x4 c3 = column(m, 3);
+
+	const char* p = points;
+	for (int i = 0; i < count; i++, p += stride) {
+		const vec3* v = (const vec3*)p;
+		f32x4 r = f32x4_mul(f32x4_splat(v->x), c0);
+		r = f32x4_add(r, f32x4_mul(f32x4_splat(v->y), c1));
+		r = f32x4_add(r, f32x4_mul(f32x4_splat(v->z), c2));
+		f32x4_store(&out[i].x, f32x4_add(r, c3));
+	}
+}
+
+void mat4_mul_vec4_batch(const mat4* m, const vec4* in, vec4* out, int count) {
+	f32x4 c0 = column(m, 0);
+	f32x4 c1 = column(m, 1);
+	f32x4 c2 = column(m, 2);
+	f32x4 c3 = column(m, 3);
+
+	for (int i = 0; i < count; i++) {
+		f32x4 r = f32x4_mul(f32x4_splat(in[i].x), c0);
+		r = f32x4_add(r, f32x4_mul(f32x4_splat(in[i].y), c1));
+		r = f32x4_add(r, f32x4_mul(f32x4_splat(in[i].z), c2));
+		f32x4_store(&out[i].x, f32x4_add(r, f32x4_mul(f32x4_splat(in[i].w), c3)));
+	}
+}
+
+// 4 vectors at a time with no shuffling, each row of the matrix is a dot product with
+// the 4 arrays
+void mat4_mul_vec4_soa(const mat4* m, float* x, float* y, float* z, float* w, int count) {
+	const float* M = m->m;
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		f32x4 X = f32x4_load(&x[i]);
+		f32x4 Y = f32x4_load(&y[i]);
+		f32x4 Z = f32x4_load(&z[i]);
+		f32x4 W = f32x4_load(&w[i]);
+		f32x4 r[4];
+		for (int j = 0; j < 4; j++) {
+			r[j] = f32x4_mul(X, f32x4_splat(M[j * 4]));
+			r[j] = f32x4_add(r[j], f32x4_mul(Y, f32x4_splat(M[j * 4 + 1])));
+			r[j] = f32x4_add(r[j], f32x4_mul(Z, f32x4_splat(M[j * 4 + 2])));
+			r[j] = f32x4_add(r[j], f32x4_mul(W, f32x4_splat(M[j * 4 + 3])));
+		}
+		f32x4_store(&x[i], r[0]);
+		f32x4_store(&y[i], r[1]);
+		f32x4_store(&z[i], r[2]);
+		f32x4_store(&w[i], r[3]);
+	}
+	for (; i < count; i++) {
+		vec4 v = mat4_mul_vec4(m, (vec4) { x[i], y[i], z[i], w[i] });
+		x[i] = v.x;
+		y[i] = v.y;
+		z[i] = v.z;
+		w[i] = v.w;
+	}
 }
 
 mat4 mat4_scale(vec3 v) {
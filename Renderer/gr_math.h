@@ -2,14 +2,121 @@
 #define GR_MATH_H
 
 #include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+
+// SSE2 is always there on x64, and on x86 if the compiler was told it can use it
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define GR_SSE2
+#include <emmintrin.h>
+// NEON (with the divide and square root AArch64 added) on 64 bit ARM
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define GR_NEON
+#include <arm_neon.h>
+#endif
+
+// Everything small is inline so it can be used in the rasteriser's inner loops without
+// a call per operation. The SIMD code is written once against the f32x4 type below,
+// which is SSE2, NEON or plain scalar code depending on the target.
+
+static inline float squaref(float x) {
+	return x * x;
+}
+
+static inline float clampf(float x, float a, float b) {
+	if (x < a) return a;
+	if (x > b) return b;
+	return x;
+}
+
+static inline float fractf(float x) {
+	return x - floorf(x);
+}
+
+static inline float lerpf(float a, float b, float t) {
+	return a * (1 - t) + b * t;
+}
+
+static inline float remapf(float x, float a1, float b1, float a2, float b2) {
+	float t = (x - a1) / (b1 - a1);
+	return a2 + t * (b2 - a2);
+}
 
-float squaref(float x);
-float clampf(float x, float a, float b);
-float fractf(float x);
-float lerpf(float a, float b, float t);
-float remapf(float x, float a1, float b1, float a2, float b2);
 float deg2rad(float d);
 
+// 4 floats. Loads and stores are unaligned.
+// load3 and store3 convert between 4 packed xyz triples and a register each of x, y and z.
+#if defined(GR_SSE2)
+typedef __m128 f32x4;
+static inline f32x4 f32x4_load(const float* p) { return _mm_loadu_ps(p); }
+static inline void f32x4_store(float* p, f32x4 a) { _mm_storeu_ps(p, a); }
+static inline f32x4 f32x4_splat(float x) { return _mm_set1_ps(x); }
+static inline f32x4 f32x4_add(f32x4 a, f32x4 b) { return _mm_add_ps(a, b); }
+static inline f32x4 f32x4_sub(f32x4 a, f32x4 b) { return _mm_sub_ps(a, b); }
+static inline f32x4 f32x4_mul(f32x4 a, f32x4 b) { return _mm_mul_ps(a, b); }
+static inline f32x4 f32x4_div(f32x4 a, f32x4 b) { return _mm_div_ps(a, b); }
+static inline f32x4 f32x4_sqrt(f32x4 a) { return _mm_sqrt_ps(a); }
+static inline void f32x4_load3(const float* p, f32x4* x, f32x4* y, f32x4* z) {
+	__m128 a = _mm_loadu_ps(p); // x0 y0 z0 x1
+	__m128 b = _mm_loadu_ps(p + 4); // y1 z1 x2 y2
+	__m128 c = _mm_loadu_ps(p + 8); // z2 x3 y3 z3
+	*x = _mm_shuffle_ps(a, _mm_shuffle_ps(b, c, _MM_SHUFFLE(1, 1, 2, 2)), _MM_SHUFFLE(2, 0, 3, 0));
+	*y = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(0, 0, 1, 1)), _mm_shuffle_ps(b, c, _MM_SHUFFLE(2, 2, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+	*z = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 1, 2, 2)), _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 3, 0, 0)), _MM_SHUFFLE(2, 0, 2, 0));
+}
+static inline void f32x4_store3(float* p, f32x4 x, f32x4 y, f32x4 z) {
+	_mm_storeu_ps(p, _mm_shuffle_ps(_mm_shuffle_ps(x, y, _MM_SHUFFLE(1, 0, 1, 0)), _mm_shuffle_ps(z, x, _MM_SHUFFLE(1, 1, 0, 0)), _MM_SHUFFLE(2, 0, 2, 0)));
+	_mm_storeu_ps(p + 4, _mm_shuffle_ps(_mm_shuffle_ps(y, z, _MM_SHUFFLE(1, 1, 1, 1)), _mm_shuffle_ps(x, y, _MM_SHUFFLE(2, 2, 2, 2)), _MM_SHUFFLE(2, 0, 2, 0)));
+	_mm_storeu_ps(p + 8, _mm_shuffle_ps(_mm_shuffle_ps(z, x, _MM_SHUFFLE(3, 3, 2, 2)), _mm_shuffle_ps(y, z, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0)));
+}
+#elif defined(GR_NEON)
+typedef float32x4_t f32x4;
+static inline f32x4 f32x4_load(const float* p) { return vld1q_f32(p); }
+static inline void f32x4_store(float* p, f32x4 a) { vst1q_f32(p, a); }
+static inline f32x4 f32x4_splat(float x) { return vdupq_n_f32(x); }
+static inline f32x4 f32x4_add(f32x4 a, f32x4 b) { return vaddq_f32(a, b); }
+static inline f32x4 f32x4_sub(f32x4 a, f32x4 b) { return vsubq_f32(a, b); }
+static inline f32x4 f32x4_mul(f32x4 a, f32x4 b) { return vmulq_f32(a, b); }
+static inline f32x4 f32x4_div(f32x4 a, f32x4 b) { return vdivq_f32(a, b); }
+static inline f32x4 f32x4_sqrt(f32x4 a) { return vsqrtq_f32(a); }
+static inline void f32x4_load3(const float* p, f32x4* x, f32x4* y, f32x4* z) {
+	float32x4x3_t v = vld3q_f32(p);
+	*x = v.val[0];
+	*y = v.val[1];
+	*z = v.val[2];
+}
+static inline void f32x4_store3(float* p, f32x4 x, f32x4 y, f32x4 z) {
+	float32x4x3_t v = { { x, y, z } };
+	vst3q_f32(p, v);
+}
+#else
+typedef struct {
+	float v[4];
+} f32x4;
+static inline f32x4 f32x4_load(const float* p) { return (f32x4) { p[0], p[1], p[2], p[3] }; }
+static inline void f32x4_store(float* p, f32x4 a) { for (int i = 0; i < 4; i++) p[i] = a.v[i]; }
+static inline f32x4 f32x4_splat(float x) { return (f32x4) { x, x, x, x }; }
+static inline f32x4 f32x4_add(f32x4 a, f32x4 b) { for (int i = 0; i < 4; i++) a.v[i] += b.v[i]; return a; }
+static inline f32x4 f32x4_sub(f32x4 a, f32x4 b) { for (int i = 0; i < 4; i++) a.v[i] -= b.v[i]; return a; }
+static inline f32x4 f32x4_mul(f32x4 a, f32x4 b) { for (int i = 0; i < 4; i++) a.v[i] *= b.v[i]; return a; }
+static inline f32x4 f32x4_div(f32x4 a, f32x4 b) { for (int i = 0; i < 4; i++) a.v[i] /= b.v[i]; return a; }
+static inline f32x4 f32x4_sqrt(f32x4 a) { for (int i = 0; i < 4; i++) a.v[i] = sqrtf(a.v[i]); return a; }
+static inline void f32x4_load3(const float* p, f32x4* x, f32x4* y, f32x4* z) {
+	for (int i = 0; i < 4; i++) {
+		x->v[i] = p[i * 3];
+		y->v[i] = p[i * 3 + 1];
+		z->v[i] = p[i * 3 + 2];
+	}
+}
+static inline void f32x4_store3(float* p, f32x4 x, f32x4 y, f32x4 z) {
+	for (int i = 0; i < 4; i++) {
+		p[i * 3] = x.v[i];
+		p[i * 3 + 1] = y.v[i];
+		p[i * 3 + 2] = z.v[i];
+	}
+}
+#endif
+
 typedef struct {
 	float x;
 	float y;
@@ -21,12 +128,37 @@ typedef struct {
 	float z;
 } vec3;
 
-vec3 vec3_add(vec3 a, vec3 b);
-vec3 vec3_sub(vec3 a, vec3 b);
-float vec3_dot(vec3 a, vec3 b);
-vec3 vec3_cross(vec3 a, vec3 b);
-float vec3_length(vec3 v);
-vec3 vec3_normalize(vec3 v);
+static inline vec3 vec3_add(vec3 a, vec3 b) {
+	return (vec3) { a.x + b.x, a.y + b.y, a.z + b.z };
+}
+
+static inline vec3 vec3_sub(vec3 a, vec3 b) {
+	return (vec3) { a.x - b.x, a.y - b.y, a.z - b.z };
+}
+
+static inline float vec3_dot(vec3 a, vec3 b) {
+	return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+static inline vec3 vec3_cross(vec3 a, vec3 b) {
+	return (vec3) {
+		a.y * b.z - a.z * b.y,
+		a.z * b.x - a.x * b.z,
+		a.x * b.y - a.y * b.x,
+	};
+}
+
+static inline float vec3_length(vec3 v) {
+	return sqrtf(v.x * v.x + v.y * v.y + v.z * v.z);
+}
+
+static inline vec3 vec3_normalize(vec3 v) {
+	float l = vec3_length(v);
+	return (vec3) { v.x / l, v.y / l, v.z / l };
+}
+
+// Normalize count vectors, 4 at a time. in and out can be the same array.
+void vec3_normalize_batch(const vec3* in, vec3* out, int count);
 
 typedef struct {
 	float x;
@@ -35,13 +167,67 @@ typedef struct {
 	float w;
 } vec4;
 
+static inline f32x4 vec4_load(vec4 v) {
+	return f32x4_load(&v.x);
+}
+
+static inline vec4 vec4_store(f32x4 a) {
+	vec4 v;
+	f32x4_store(&v.x, a);
+	return v;
+}
+
+static inline vec4 vec4_add(vec4 a, vec4 b) {
+	return vec4_store(f32x4_add(vec4_load(a), vec4_load(b)));
+}
+
+static inline vec4 vec4_sub(vec4 a, vec4 b) {
+	return vec4_store(f32x4_sub(vec4_load(a), vec4_load(b)));
+}
+
+static inline vec4 vec4_scale(vec4 v, float s) {
+	return vec4_store(f32x4_mul(vec4_load(v), f32x4_splat(s)));
+}
+
+// a * (1 - t) + b * t, like lerpf
+static inline vec4 vec4_lerp(vec4 a, vec4 b, float t) {
+	f32x4 r = f32x4_add(f32x4_mul(vec4_load(a), f32x4_splat(1 - t)), f32x4_mul(vec4_load(b), f32x4_splat(t)));
+	return vec4_store(r);
+}
+
+static inline float vec4_dot(vec4 a, vec4 b) {
+	return a.x * b.x + a.y * b.y + a.z * b.z + a.w * b.w;
+}
+
+// Row major
 typedef struct {
 	float m[16];
 } mat4;
 
 mat4 mat4_identity();
-mat4 mat4_mul(mat4* a, mat4* b);
-vec4 mat4_mul_vec4(mat4* m, vec4 v);
+
+mat4 mat4_mul(const mat4* a, const mat4* b);
+
+// One vector at a time is 4 dot products with the rows, which is left to the compiler.
+// Use mat4_mul_points for lots of them.
+static inline vec4 mat4_mul_vec4(const mat4* m, vec4 v) {
+	const float* M = m->m;
+	return (vec4) {
+		v.x * M[0] + v.y * M[1] + v.z * M[2] + v.w * M[3],
+		v.x * M[4] + v.y * M[5] + v.z * M[6] + v.w * M[7],
+		v.x * M[8] + v.y * M[9] + v.z * M[10] + v.w * M[11],
+		v.x * M[12] + v.y * M[13] + v.z * M[14] + v.w * M[15],
+	};
+}
+
+// Transform count points (w = 1), the same as mat4_mul_vec4 on each but a whole vector
+// at a time. The points are vec3s stride bytes apart, so they can be read straight out
+// of an array of vertices.
+void mat4_mul_points(const mat4* m, const void* points, size_t stride, vec4* out, int count);
+// Same for vec4s
+void mat4_mul_vec4_batch(const mat4* m, const vec4* in, vec4* out, int count);
+// Same for vec4s in separate arrays of x, y, z and w, in place
+void mat4_mul_vec4_soa(const mat4* m, float* x, float* y, float* z, float* w, int count);
 
 mat4 mat4_scale(vec3 v);
 mat4 mat4_translate(vec3 v);
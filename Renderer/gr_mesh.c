@@ -0,0 +1,438 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+
+#include "util.h"
+
+#include "gr_mesh.h"
+
+float grMesh_ACMR(const grMesh* mesh, int cacheSize) {
+	if (mesh->count == 0) {
+		return 0;
+	}
+
+	int* cache = xmalloc(cacheSize * sizeof(int));
+	for (int i = 0; i < cacheSize; i++) {
+		cache[i] = -1;
+	}
+	int head = 0;
+	int misses = 0;
+
+	for (int i = 0; i < mesh->count * 3; i++) {
+		int v = mesh->indices[i];
+
+		int hit = 0;
+		for (int j = 0; j < cacheSize; j++) {
+			if (cache[j] == v) {
+				hit = 1;
+				break;
+			}
+		}
+
+		if (!hit) {
+			cache[head] = v;
+			head = (head + 1) % cacheSize;
+			misses++;
+		}
+	}
+
+	free(cache);
+	return (float)misses / mesh->count;
+}
+
+static uint32_t hashVertex(const grVertex* v) {
+	// FNV-1a over the raw bytes
+	const uint8_t* p = (const uint8_t*)v;
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < sizeof(grVertex); i++) {
+		h ^= p[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+void grMesh_Weld(grMesh* mesh) {
+	int tableSize = 1;
+	while (tableSize < mesh->numVerts * 2) tableSize *= 2;
+
+	// Open addressing hash table of output vertex indices
+	int* table = xmalloc(tableSize * sizeof(int));
+	for (int i = 0; i < tableSize; i++) {
+		table[i] = -1;
+	}
+
+	int* remap = xmalloc(mesh->numVerts * sizeof(int));
+	int numUnique = 0;
+
+	for (int i = 0; i < mesh->numVerts; i++) {
+		grVertex* v = &mesh->verts[i];
+		uint32_t slot = hashVertex(v) & (tableSize - 1);
+
+		while (table[slot] != -1 && memcmp(&mesh->verts[table[slot]], v, sizeof(grVertex)) != 0) {
+			slot = (slot + 1) & (tableSize - 1);
+		}
+
+		if (table[slot] == -1) {
+			// Compacting in place is safe because numUnique <= i
+			mesh->verts[numUnique] = *v;
+			table[slot] = numUnique++;
+		}
+		remap[i] = table[slot];
+	}
+
+	for (int i = 0; i < mesh->count * 3; i++) {
+		mesh->indices[i] = remap[mesh->indices[i]];
+	}
+	mesh->numVerts = numUnique;
+
+	free(remap);
+	free(table);
+}
+
+// Forsyth's algorithm
+// https://tomforsyth1000.github.io/papers/fast_vert_cache_opt.html
+
+#define FORSYTH_CACHE_SIZE 32
+
+static float forsythScore(int cachePos, int remaining) {
+	if (remaining == 0) {
+		return -1;
+	}
+
+	float score = 0;
+	if (cachePos >= 0) {
+		if (cachePos < 3) {
+			// The last triangle's vertices get a fixed score so we don't
+			// always pick a triangle right next to the one we just emitted
+			score = 0.75f;
+		}
+		else {
+			score = powf(1 - (float)(cachePos - 3) / (FORSYTH_CACHE_SIZE - 3), 1.5f);
+		}
+	}
+
+	// Favour vertices with few triangles left so we don't leave lone triangles behind
+	score += 2.0f / sqrtf(remaining);
+	return score;
+}
+
+static void optimizeVertexCacheRange(int* indices, int numTris, int numVerts) {
+	if (numTris == 0) {
+		return;
+	}
+
+	// Build vertex -> triangle adjacency
+	int* remaining = xmalloc(numVerts * sizeof(int));
+	memset(remaining, 0, numVerts * sizeof(int));
+	int* adjOffset = xmalloc((numVerts + 1) * sizeof(int));
+	int* adj = xmalloc(numTris * 3 * sizeof(int));
+
+	for (int i = 0; i < numTris * 3; i++) {
+		remaining[indices[i]]++;
+	}
+	adjOffset[0] = 0;
+	for (int i = 0; i < numVerts; i++) {
+		adjOffset[i + 1] = adjOffset[i] + remaining[i];
+	}
+	int* fill = xmalloc(numVerts * sizeof(int));
+	memcpy(fill, adjOffset, numVerts * sizeof(int));
+	for (int i = 0; i < numTris * 3; i++) {
+		adj[fill[indices[i]]++] = i / 3;
+	}
+	free(fill);
+
+	int* cachePos = xmalloc(numVerts * sizeof(int));
+	float* vertScore = xmalloc(numVerts * sizeof(float));
+	for (int i = 0; i < numVerts; i++) {
+		cachePos[i] = -1;
+		vertScore[i] = forsythScore(-1, remaining[i]);
+	}
+
+	char* emitted = xmalloc(numTris);
+	memset(emitted, 0, numTris);
+
+	int* out = xmalloc(numTris * 3 * sizeof(int));
+	int cache[FORSYTH_CACHE_SIZE + 3];
+	int cacheCount = 0;
+	int cursor = 0;
+	int best = -1;
+
+	for (int n = 0; n < numTris; n++) {
+		if (best < 0) {
+			// Nothing useful in the cache, start again from the next unused triangle
+			while (emitted[cursor]) cursor++;
+			best = cursor;
+		}
+
+		int tri = best;
+		int* t = &indices[tri * 3];
+		out[n * 3 + 0] = t[0];
+		out[n * 3 + 1] = t[1];
+		out[n * 3 + 2] = t[2];
+		emitted[tri] = 1;
+
+		// Push the triangle's vertices to the front of the LRU cache
+		int newCache[FORSYTH_CACHE_SIZE + 3];
+		int newCount = 0;
+		for (int k = 0; k < 3; k++) {
+			newCache[newCount++] = t[k];
+		}
+		for (int k = 0; k < cacheCount; k++) {
+			int v = cache[k];
+			if (v != t[0] && v != t[1] && v != t[2]) {
+				newCache[newCount++] = v;
+			}
+		}
+
+		// Remove the triangle from its vertices' adjacency lists
+		for (int k = 0; k < 3; k++) {
+			int v = t[k];
+			int* list = &adj[adjOffset[v]];
+			for (int j = 0; j < remaining[v]; j++) {
+				if (list[j] == tri) {
+					list[j] = list[remaining[v] - 1];
+					break;
+				}
+			}
+			remaining[v]--;
+		}
+
+		// Update vertex scores for everything that was in the cache, including
+		// vertices that just fell out of it
+		for (int k = 0; k < newCount; k++) {
+			int v = newCache[k];
+			cachePos[v] = k < FORSYTH_CACHE_SIZE ? k : -1;
+			vertScore[v] = forsythScore(cachePos[v], remaining[v]);
+		}
+
+		// Rescore the triangles touching those vertices and pick the best one
+		best = -1;
+		float bestScore = -1;
+		for (int k = 0; k < newCount; k++) {
+			int v = newCache[k];
+			int* list = &adj[adjOffset[v]];
+			for (int j = 0; j < remaining[v]; j++) {
+				int* u = &indices[list[j] * 3];
+				float s = vertScore[u[0]] + vertScore[u[1]] + vertScore[u[2]];
+				if (s > bestScore) {
+					bestScore = s;
+					best = list[j];
+				}
+			}
+		}
+
+		cacheCount = min(newCount, FORSYTH_CACHE_SIZE);
+		memcpy(cache, newCache, cacheCount * sizeof(int));
+	}
+
+	memcpy(indices, out, numTris * 3 * sizeof(int));
+
+	free(out);
+	free(emitted);
+	free(vertScore);
+	free(cachePos);
+	free(adj);
+	free(adjOffset);
+	free(remaining);
+}
+
+// Triangles are never moved between sub meshes, so each one is optimised on its own.
+// A mesh without sub meshes is treated as a single range.
+static int numRanges(const grMesh* mesh) {
+	return mesh->numSubMeshes ? mesh->numSubMeshes : 1;
+}
+
+static grSubMesh getRange(const grMesh* mesh, int i) {
+	if (mesh->numSubMeshes == 0) {
+		return (grSubMesh) { 0, mesh->count, NULL };
+	}
+	return mesh->subMeshes[i];
+}
+
+void grMesh_OptimizeVertexCache(grMesh* mesh) {
+	// Each range is renumbered to only the vertices it uses, so the per vertex
+	// arrays are sized for the range rather than the whole mesh. Otherwise a
+	// mesh with lots of materials costs numSubMeshes * numVerts to optimise.
+	int* local = xmalloc(mesh->numVerts * sizeof(int));
+	int* global = xmalloc(mesh->numVerts * sizeof(int));
+	for (int i = 0; i < mesh->numVerts; i++) {
+		local[i] = -1;
+	}
+
+	for (int i = 0; i < numRanges(mesh); i++) {
+		grSubMesh r = getRange(mesh, i);
+		int* indices = &mesh->indices[r.first * 3];
+		int numLocal = 0;
+		for (int j = 0; j < r.count * 3; j++) {
+			int v = indices[j];
+			if (local[v] < 0) {
+				global[numLocal] = v;
+				local[v] = numLocal++;
+			}
+			indices[j] = local[v];
+		}
+
+		optimizeVertexCacheRange(indices, r.count, numLocal);
+
+		for (int j = 0; j < r.count * 3; j++) {
+			indices[j] = global[indices[j]];
+		}
+		// Only reset what this range touched
+		for (int j = 0; j < numLocal; j++) {
+			local[global[j]] = -1;
+		}
+	}
+
+	free(global);
+	free(local);
+}
+
+typedef struct {
+	int first;
+	int count;
+	float key;
+} Cluster;
+
+static int compareClusters(const void* a, const void* b) {
+	const Cluster* ca = a;
+	const Cluster* cb = b;
+	if (ca->key > cb->key) return -1;
+	if (ca->key < cb->key) return 1;
+	// Keep the original order for ties so the result is deterministic
+	return ca->first - cb->first;
+}
+
+// Sander et al. "Fast Triangle Reordering for Vertex Locality and Reduced Overdraw"
+// The cache optimised order is split into clusters wherever the cache has been
+// completely flushed (all 3 vertices of a triangle miss), so moving clusters around
+// costs very little ACMR. Clusters are then sorted so the ones facing away from the
+// mesh centre are drawn first, which means they tend to occlude the rest.
+static void optimizeOverdrawRange(grMesh* mesh, int* indices, int numTris, vec3 centre) {
+	if (numTris == 0) {
+		return;
+	}
+
+	Cluster* clusters = xmalloc(numTris * sizeof(Cluster));
+	int numClusters = 0;
+
+#define OVERDRAW_CACHE_SIZE 16
+	int cache[OVERDRAW_CACHE_SIZE];
+	for (int i = 0; i < OVERDRAW_CACHE_SIZE; i++) {
+		cache[i] = -1;
+	}
+	int head = 0;
+
+	for (int i = 0; i < numTris; i++) {
+		int misses = 0;
+		for (int k = 0; k < 3; k++) {
+			int v = indices[i * 3 + k];
+			int hit = 0;
+			for (int j = 0; j < OVERDRAW_CACHE_SIZE; j++) {
+				if (cache[j] == v) {
+					hit = 1;
+					break;
+				}
+			}
+			if (!hit) {
+				cache[head] = v;
+				head = (head + 1) % OVERDRAW_CACHE_SIZE;
+				misses++;
+			}
+		}
+
+		if (misses == 3 || numClusters == 0) {
+			clusters[numClusters++] = (Cluster){ i, 0, 0 };
+		}
+		clusters[numClusters - 1].count++;
+	}
+
+	for (int c = 0; c < numClusters; c++) {
+		Cluster* cl = &clusters[c];
+
+		// Area weighted normal and centroid of the cluster
+		vec3 normal = { 0, 0, 0 };
+		vec3 centroid = { 0, 0, 0 };
+		float area = 0;
+		for (int i = cl->first; i < cl->first + cl->count; i++) {
+			vec3 p0 = mesh->verts[indices[i * 3 + 0]].pos;
+			vec3 p1 = mesh->verts[indices[i * 3 + 1]].pos;
+			vec3 p2 = mesh->verts[indices[i * 3 + 2]].pos;
+
+			vec3 n = vec3_cross(vec3_sub(p1, p0), vec3_sub(p2, p0));
+			float a = vec3_length(n);
+
+			vec3 mid = vec3_add(vec3_add(p0, p1), p2);
+			centroid.x += mid.x / 3 * a;
+			centroid.y += mid.y / 3 * a;
+			centroid.z += mid.z / 3 * a;
+			normal = vec3_add(normal, n);
+			area += a;
+		}
+
+		if (area > 0) {
+			centroid.x /= area;
+			centroid.y /= area;
+			centroid.z /= area;
+			normal = vec3_normalize(normal);
+			cl->key = vec3_dot(vec3_sub(centroid, centre), normal);
+		}
+	}
+
+	qsort(clusters, numClusters, sizeof(Cluster), compareClusters);
+
+	int* out = xmalloc(numTris * 3 * sizeof(int));
+	int n = 0;
+	for (int c = 0; c < numClusters; c++) {
+		memcpy(&out[n], &indices[clusters[c].first * 3], clusters[c].count * 3 * sizeof(int));
+		n += clusters[c].count * 3;
+	}
+	memcpy(indices, out, numTris * 3 * sizeof(int));
+
+	free(out);
+	free(clusters);
+}
+
+void grMesh_OptimizeOverdraw(grMesh* mesh) {
+	if (mesh->numVerts == 0) {
+		return;
+	}
+
+	vec3 centre = { 0, 0, 0 };
+	for (int i = 0; i < mesh->numVerts; i++) {
+		centre = vec3_add(centre, mesh->verts[i].pos);
+	}
+	centre.x /= mesh->numVerts;
+	centre.y /= mesh->numVerts;
+	centre.z /= mesh->numVerts;
+
+	for (int i = 0; i < numRanges(mesh); i++) {
+		grSubMesh r = getRange(mesh, i);
+		optimizeOverdrawRange(mesh, &mesh->indices[r.first * 3], r.count, centre);
+	}
+}
+
+void grMesh_OptimizeVertexFetch(grMesh* mesh) {
+	int* remap = xmalloc(mesh->numVerts * sizeof(int));
+	for (int i = 0; i < mesh->numVerts; i++) {
+		remap[i] = -1;
+	}
+
+	grVertex* verts = xmalloc(mesh->numVerts * sizeof(grVertex));
+	int numUsed = 0;
+
+	for (int i = 0; i < mesh->count * 3; i++) {
+		int v = mesh->indices[i];
+		if (remap[v] < 0) {
+			remap[v] = numUsed;
+			verts[numUsed++] = mesh->verts[v];
+		}
+		mesh->indices[i] = remap[v];
+	}
+
+	memcpy(mesh->verts, verts, numUsed * sizeof(grVertex));
+	mesh->numVerts = numUsed;
+
+	free(verts);
+	free(remap);
+}
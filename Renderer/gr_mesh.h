@@ -0,0 +1,28 @@
+#ifndef GR_MESH_H
+#define GR_MESH_H
+
+#include "gr.h"
+
+// Load-time mesh optimisation passes.
+// The usual order is Weld -> OptimizeVertexCache -> OptimizeOverdraw -> OptimizeVertexFetch.
+
+// Average cache miss ratio: the number of vertices that would need to be
+// transformed per triangle with a FIFO post-transform cache of the given size.
+// 3 is the worst case (no reuse at all), ~0.5 is about the best a real mesh can do.
+float grMesh_ACMR(const grMesh* mesh, int cacheSize);
+
+// Merge bitwise identical vertices so triangles can share them.
+void grMesh_Weld(grMesh* mesh);
+
+// Reorder triangles for post-transform vertex cache locality (Tom Forsyth's algorithm).
+void grMesh_OptimizeVertexCache(grMesh* mesh);
+
+// Reorder clusters of triangles so outward facing ones are drawn first (Tipsify style).
+// This should be run after OptimizeVertexCache because it only moves whole clusters around.
+void grMesh_OptimizeOverdraw(grMesh* mesh);
+
+// Reorder the vertex array into first-use order so vertex fetches are sequential.
+// Unreferenced vertices are dropped.
+void grMesh_OptimizeVertexFetch(grMesh* mesh);
+
+#endif
@@ -0,0 +1,71 @@
+#include <math.h>
+
+#include "gr.h"
+#include "gr_shader.h"
+
+void Raster_Depth(const RasterState* r, const TriSetup* t) {
+	Raster_Tri(r, t, NULL, PASS_DEPTH);
+}
+
+void Raster_Visibility(const RasterState* r, const TriSetup* t) {
+	Raster_Tri(r, t, NULL, PASS_VISIBILITY);
+}
+
+// The built in pixel shaders
+
+static int shadeTextured(const grQuad* quad, rgb out[4]) {
+	grQuad_Sample(quad, 0, quad->mask, out);
+	return quad->mask;
+}
+
+GR_DEFINE_PIXEL_SHADER(GR_SHADER_TEXTURED, shadeTextured)
+
+static int shadeMipLevels(const grQuad* quad, rgb out[4]) {
+	static const rgb COLOURS[] = {
+		{0, 0, 0},
+		{255, 0, 0},
+		{0, 255, 0},
+		{0, 0, 255},
+		{255, 255, 0},
+		{255, 0, 255},
+		{0, 255, 255},
+		{127, 127, 127},
+	};
+
+	vec2 dx = { grQuad_Ddx(quad, 0) * quad->tex->width, grQuad_Ddx(quad, 1) * quad->tex->height };
+	vec2 dy = { grQuad_Ddy(quad, 0) * quad->tex->width, grQuad_Ddy(quad, 1) * quad->tex->height };
+	int level = min(max((int)Sampler_Lod(dx, dy), 0), 7);
+	for (int q = 0; q < 4; q++) {
+		out[q] = COLOURS[level];
+	}
+	return quad->mask;
+}
+
+GR_DEFINE_PIXEL_SHADER(GR_SHADER_MIP_LEVELS, shadeMipLevels)
+
+static int shadeLit(const grQuad* quad, rgb out[4]) {
+	const grLightUniforms* light = quad->uniforms;
+	grQuad_Sample(quad, 0, quad->mask, out);
+
+	// The varyings are already one array per component, so the 4 normals are lit together
+	f32x4 nx = f32x4_load(quad->varyings[2]);
+	f32x4 ny = f32x4_load(quad->varyings[3]);
+	f32x4 nz = f32x4_load(quad->varyings[4]);
+	f32x4 len2 = f32x4_add(f32x4_mul(nx, nx), f32x4_add(f32x4_mul(ny, ny), f32x4_mul(nz, nz)));
+	f32x4 dot = f32x4_add(f32x4_mul(nx, f32x4_splat(light->direction.x)),
+		f32x4_add(f32x4_mul(ny, f32x4_splat(light->direction.y)), f32x4_mul(nz, f32x4_splat(light->direction.z))));
+	// Interpolated normals aren't unit length. Zero ones (meshes without normals) get ambient only.
+	f32x4 diffuse = f32x4_div(dot, f32x4_sqrt(f32x4_add(len2, f32x4_splat(1e-12f))));
+
+	float d[4];
+	f32x4_store(d, diffuse);
+	for (int q = 0; q < 4; q++) {
+		float intensity = min(light->ambient + max(d[q], 0.0f) * (1 - light->ambient), 1.0f);
+		out[q].r = (uint8_t)(out[q].r * intensity);
+		out[q].g = (uint8_t)(out[q].g * intensity);
+		out[q].b = (uint8_t)(out[q].b * intensity);
+	}
+	return quad->mask;
+}
+
+GR_DEFINE_PIXEL_SHADER(GR_SHADER_LIT, shadeLit)
@@ -0,0 +1,526 @@
+#ifndef GR_SHADER_H
+#define GR_SHADER_H
+
+#include <stdint.h>
+
+#include "gr.h"
+#include "gr_internal.h"
+
+// Pixel shaders.
+// A pixel shader colours a 2x2 quad of pixels at a time. Each shader gets its own copy of
+// the rasteriser's inner loop, made by GR_DEFINE_PIXEL_SHADER, with the shader inlined into
+// it. So there's one indirect call per triangle, not one per quad or pixel.
+// Include this in the file that defines the shader. The rest of the program only needs gr.h.
+
+// A 2x2 quad of pixels being shaded. Pixels are in the order
+// 0: x, y
+// 1: x + 1, y
+// 2: x, y + 1
+// 3: x + 1, y + 1
+typedef struct {
+	int x; // Top left pixel
+	int y;
+	// Pixels with a sample that's covered and passed the depth test. The others still
+	// have varyings, for the derivatives, but aren't drawn.
+	int mask;
+	// Perspective correct varyings of each pixel, [varying][pixel]. If the vertex format
+	// has fewer than 2, the missing ones are 0.
+	float varyings[GR_MAX_VARYINGS][4];
+	int numVaryings;
+	float z[4]; // z/w, 0 at the near plane and 1 at the far one
+
+	// The draw's texture, see grQuad_Sample
+	grTexture* tex;
+	const Sampler* sampler;
+	const void* uniforms; // grDevice.uniforms
+} grQuad;
+
+// Write the colours of the pixels in quad->mask to out, and return the ones to draw.
+// Clearing a pixel's bit discards it, leaving its colour and depth alone.
+typedef int (*grPixelShaderFn)(const grQuad* quad, rgb out[4]);
+
+// Screen space derivatives of a varying, once per quad from the top left pixel's
+// neighbours, like GPUs' coarse derivatives
+static inline float grQuad_Ddx(const grQuad* quad, int varying) {
+	return quad->varyings[varying][1] - quad->varyings[varying][0];
+}
+
+static inline float grQuad_Ddy(const grQuad* quad, int varying) {
+	return quad->varyings[varying][2] - quad->varyings[varying][0];
+}
+
+// Sample the draw's texture, with its filters, for the pixels in mask at the uvs in
+// varyings u and u + 1
+static inline void grQuad_Sample(const grQuad* quad, int u, int mask, rgb out[4]) {
+	grTexture* tex = quad->tex;
+	vec2 uv[4];
+	vec2 uvv[4];
+	for (int q = 0; q < 4; q++) {
+		uv[q] = (vec2){ quad->varyings[u][q], quad->varyings[u + 1][q] };
+		uvv[q] = (vec2){ uv[q].x * tex->width, uv[q].y * tex->height };
+	}
+
+	// In level 0 texels for mipmapping
+	vec2 dx = { uvv[1].x - uvv[0].x, uvv[1].y - uvv[0].y };
+	vec2 dy = { uvv[2].x - uvv[0].x, uvv[2].y - uvv[0].y };
+	quad->sampler->sampleQuad(quad->sampler, tex, uv, mask, dx, dy, out);
+}
+
+// The rest is the rasteriser the shaders are compiled into
+
+#ifdef _MSC_VER
+#define GR_FORCEINLINE __forceinline
+#else
+#define GR_FORCEINLINE inline __attribute__((always_inline))
+#endif
+
+// What the rasteriser needs from a batch
+typedef struct {
+	grFramebuffer* fb;
+	grTexture* tex;
+	Sampler sampler;
+	const void* uniforms;
+	// What PASS_VISIBILITY writes, with the triangle changed for each one
+	grVisibilitySample id;
+} RasterState;
+
+// An attribute that varies linearly across the screen, value = c + dx * x + dy * y
+// with x and y in pixels from the triangle's origin pixel
+typedef struct {
+	float c;
+	float dx;
+	float dy;
+} Plane;
+
+// Pixel positions in a quad relative to its top left pixel
+static const float QUAD_X[4] = { 0, 1, 0, 1 };
+static const float QUAD_Y[4] = { 0, 0, 1, 1 };
+
+// The plane at the 4 pixels of a quad. Evaluated directly rather than stepped from the
+// last quad so there's no error building up across a 4K screen, which would matter for uvs.
+static inline f32x4 Plane_EvalQuad(const Plane* p, f32x4 x, f32x4 y) {
+	return f32x4_add(f32x4_splat(p->c), f32x4_add(f32x4_mul(f32x4_splat(p->dx), x), f32x4_mul(f32x4_splat(p->dy), y)));
+}
+
+// Everything the rasteriser needs to know about a triangle, worked out once by setupTri in gr.c.
+// Pixel coordinates are relative to the origin, the top left of the bounding box.
+typedef struct {
+	// Bounding box in pixels, on screen
+	int left;
+	int top;
+	int right;
+	int bottom;
+
+	// Edge functions of the edges opposite each vertex at the origin pixel's centre, and
+	// how much they change per pixel. Positive inside, with the fill rule bias included.
+	int64_t edge[3];
+	int64_t edgeDx[3];
+	int64_t edgeDy[3];
+	// Added to the edge functions at a pixel's centre to get them at each sample
+	int sampleOffset[3][MSAA_SAMPLES];
+
+	// z/w and 1/w are linear in screen space
+	Plane z;
+	Plane invW;
+	// As are the varyings over w, which are interpolated and multiplied by w to get them
+	// back perspective correct
+	Plane varyings[GR_MAX_VARYINGS];
+	int numVaryings;
+} TriSetup;
+
+// Draw a triangle with shader. Always inlined, so with a constant shader and pass the
+// compiler makes a rasteriser just for them. The depth and visibility passes only call the
+// shader if it isn't NULL, to find out which pixels it discards.
+static GR_FORCEINLINE void Raster_Tri(const RasterState* r, const TriSetup* t, grPixelShaderFn shader, DrawPass pass) {
+	grFramebuffer* fb = r->fb;
+	bool depthOnly = pass == PASS_DEPTH || pass == PASS_VISIBILITY;
+
+	grQuad quad;
+	quad.numVaryings = t->numVaryings;
+	quad.tex = r->tex;
+	quad.sampler = &r->sampler;
+	quad.uniforms = r->uniforms;
+	// Formats without uvs sample the texture at 0, 0
+	for (int a = t->numVaryings; a < 2; a++) {
+		f32x4_store(quad.varyings[a], f32x4_splat(0));
+	}
+
+	// The edge functions are exact integers, so they're stepped from quad to quad.
+	// Their values at the other pixels of a quad are offsets from the top left one.
+	int64_t rowEdge[3];
+	int64_t pixelEdge[3][4];
+	for (int k = 0; k < 3; k++) {
+		rowEdge[k] = t->edge[k];
+		pixelEdge[k][0] = 0;
+		pixelEdge[k][1] = t->edgeDx[k];
+		pixelEdge[k][2] = t->edgeDy[k];
+		pixelEdge[k][3] = t->edgeDx[k] + t->edgeDy[k];
+	}
+
+	// Pixel positions relative to the origin for evaluating the attribute planes
+	f32x4 pixelY = f32x4_load(QUAD_Y);
+
+	for (int y = t->top; y <= t->bottom; y += 2) {
+		int64_t edge[3] = { rowEdge[0], rowEdge[1], rowEdge[2] };
+		f32x4 pixelX = f32x4_load(QUAD_X);
+
+		for (int x = t->left; x <= t->right; x += 2) {
+			int px[4] = { x, x + 1, x, x + 1 };
+			int py[4] = { y, y, y + 1, y + 1 };
+
+			int coverage[4] = { 0 };
+			int mask = 0;
+			for (int q = 0; q < 4; q++) {
+				// The right or bottom pixels of the last quad can be off the edge of the
+				// framebuffer. They still get varyings for the derivatives, but aren't drawn.
+				if (px[q] >= fb->width || py[q] >= fb->height) {
+					continue;
+				}
+
+				int64_t e0 = edge[0] + pixelEdge[0][q];
+				int64_t e1 = edge[1] + pixelEdge[1][q];
+				int64_t e2 = edge[2] + pixelEdge[2][q];
+				for (int i = 0; i < MSAA_SAMPLES; i++) {
+					if (e0 + t->sampleOffset[0][i] > 0 && e1 + t->sampleOffset[1][i] > 0 && e2 + t->sampleOffset[2][i] > 0) {
+						coverage[q] |= 1 << i;
+					}
+				}
+				if (coverage[q]) {
+					mask |= 1 << q;
+				}
+			}
+
+			for (int k = 0; k < 3; k++) {
+				edge[k] += t->edgeDx[k] * 2;
+			}
+			f32x4 quadX = pixelX;
+			pixelX = f32x4_add(pixelX, f32x4_splat(2));
+
+			// Most quads in the bounding box of a big triangle are outside it
+			if (mask == 0) {
+				continue;
+			}
+
+			f32x4_store(quad.z, Plane_EvalQuad(&t->z, quadX, pixelY));
+			for (int q = 0; q < 4; q++) {
+				for (int i = 0; i < MSAA_SAMPLES; i++) {
+					if (!(coverage[q] & (1 << i))) {
+						continue;
+					}
+					// The depth pass worked the depths out the same way, so they're exactly equal
+					float* depth = &fb->depth[py[q] * fb->width + px[q]][i];
+					if (pass == PASS_SHADE_EQUAL ? quad.z[q] != *depth : quad.z[q] > *depth) {
+						coverage[q] &= ~(1 << i);
+					}
+					// Nothing else to do without a shader to run
+					else if (depthOnly && !shader) {
+						*depth = quad.z[q];
+						if (pass == PASS_VISIBILITY) {
+							fb->visibility[py[q] * fb->width + px[q]][i] = r->id;
+						}
+					}
+				}
+				if (!coverage[q]) {
+					mask &= ~(1 << q);
+				}
+			}
+			if (mask == 0 || (depthOnly && !shader)) {
+				continue;
+			}
+
+			rgb colour[4];
+			if (!depthOnly || shader) {
+				// The only divide, one per pixel, for perspective correction
+				f32x4 W = f32x4_div(f32x4_splat(1), Plane_EvalQuad(&t->invW, quadX, pixelY));
+				for (int a = 0; a < t->numVaryings; a++) {
+					f32x4_store(quad.varyings[a], f32x4_mul(Plane_EvalQuad(&t->varyings[a], quadX, pixelY), W));
+				}
+
+				quad.x = x;
+				quad.y = y;
+				quad.mask = mask;
+				mask &= shader(&quad, colour);
+			}
+
+			for (int q = 0; q < 4; q++) {
+				if (!(mask & (1 << q))) {
+					continue;
+				}
+
+				rgb* c = fb->colour[py[q] * fb->width + px[q]];
+				float* d = fb->depth[py[q] * fb->width + px[q]];
+
+				for (int i = 0; i < MSAA_SAMPLES; i++) {
+					if (coverage[q] & (1 << i)) {
+						if (!depthOnly) {
+							c[i] = colour[q];
+						}
+						// Already there after a depth pass
+						if (pass != PASS_SHADE_EQUAL) {
+							d[i] = quad.z[q];
+						}
+						if (pass == PASS_VISIBILITY) {
+							fb->visibility[py[q] * fb->width + px[q]][i] = r->id;
+						}
+					}
+				}
+			}
+		}
+
+		for (int k = 0; k < 3; k++) {
+			rowEdge[k] += t->edgeDy[k] * 2;
+		}
+		pixelY = f32x4_add(pixelY, f32x4_splat(2));
+	}
+}
+
+// Shading the visibility buffer, see gr_visibility.c. The screen is shaded a tile at a time,
+// with the planes of the triangles in the tile relative to its top left pixel.
+#define RESOLVE_TILE_SIZE 16 // Pixels, even so a tile is whole quads
+#define RESOLVE_NONE 0xffff
+
+// A triangle being shaded by the resolve
+typedef struct {
+	Plane z;
+	Plane invW;
+	Plane varyings[GR_MAX_VARYINGS];
+	int numVaryings;
+	const grPixelShader* shader; // NULL if it can't be shaded
+	const RasterState* raster; // Its instance's
+	int corners[3]; // Mesh indices of its vertices
+} ResolveTri;
+
+typedef struct {
+	grFramebuffer* fb;
+	int left; // Top left pixel
+	int top;
+	int width; // Less than RESOLVE_TILE_SIZE at the right and bottom of the screen
+	int height;
+	// Which of tris is at each sample, in rows of RESOLVE_TILE_SIZE pixels. RESOLVE_NONE
+	// for samples that weren't drawn by the frame being resolved.
+	uint16_t tri[RESOLVE_TILE_SIZE * RESOLVE_TILE_SIZE][MSAA_SAMPLES];
+	const ResolveTri* tris;
+} ResolveTile;
+
+// Whether b can be shaded in the same quad as a, with the pixels' derivatives taken across
+// both. Their attributes are continuous if they're in the same instance and share a vertex,
+// where uv seams split the vertices.
+static inline bool ResolveTri_Continuous(const ResolveTri* a, const ResolveTri* b) {
+	if (a->raster != b->raster) {
+		return false;
+	}
+	for (int i = 0; i < 3; i++) {
+		if (a->corners[i] == b->corners[0] || a->corners[i] == b->corners[1] || a->corners[i] == b->corners[2]) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Each pixel's own plane at its position in a quad
+static inline f32x4 Plane_EvalPixels(const Plane* p[4], f32x4 x, f32x4 y) {
+	f32x4 c = f32x4_load((const float[4]) { p[0]->c, p[1]->c, p[2]->c, p[3]->c });
+	f32x4 dx = f32x4_load((const float[4]) { p[0]->dx, p[1]->dx, p[2]->dx, p[3]->dx });
+	f32x4 dy = f32x4_load((const float[4]) { p[0]->dy, p[1]->dy, p[2]->dy, p[3]->dy });
+	return f32x4_add(c, f32x4_add(f32x4_mul(dx, x), f32x4_mul(dy, y)));
+}
+
+// Shade the pixels of a tile where there are triangles drawn with self, using shader, which
+// is inlined like in Raster_Tri. A pixel is shaded once for each triangle at its samples,
+// but unlike the forward rasteriser a quad isn't shaded once for every triangle in it: each
+// shader call takes a triangle for every pixel it can, as long as they're continuous with
+// each other (see ResolveTri_Continuous). So however small the triangles get, most quads
+// are shaded about as many times as the pixel with the most triangles has.
+static GR_FORCEINLINE void Raster_Resolve(const ResolveTile* tile, const grPixelShader* self, grPixelShaderFn shader) {
+	grFramebuffer* fb = tile->fb;
+	grQuad quad;
+
+	// Pixel positions relative to the tile for evaluating the attribute planes
+	f32x4 pixelY = f32x4_load(QUAD_Y);
+
+	for (int y = 0; y < tile->height; y += 2) {
+		f32x4 pixelX = f32x4_load(QUAD_X);
+
+		for (int x = 0; x < tile->width; x += 2) {
+			f32x4 quadX = pixelX;
+			pixelX = f32x4_add(pixelX, f32x4_splat(2));
+
+			// The triangles at each pixel with this shader that are still to be shaded
+			uint16_t ids[4][MSAA_SAMPLES];
+			int pixelTris[4][MSAA_SAMPLES];
+			int numPixelTris[4] = { 0 };
+			for (int q = 0; q < 4; q++) {
+				int tx = x + (q & 1);
+				int ty = y + (q >> 1);
+				for (int i = 0; i < MSAA_SAMPLES; i++) {
+					// Pixels off the edge of the screen still get varyings, but aren't drawn
+					ids[q][i] = tx < tile->width && ty < tile->height ? tile->tri[ty * RESOLVE_TILE_SIZE + tx][i] : RESOLVE_NONE;
+					if (ids[q][i] == RESOLVE_NONE || tile->tris[ids[q][i]].shader != self) {
+						continue;
+					}
+					int k = 0;
+					while (k < numPixelTris[q] && pixelTris[q][k] != ids[q][i]) {
+						k++;
+					}
+					if (k == numPixelTris[q]) {
+						pixelTris[q][numPixelTris[q]++] = ids[q][i];
+					}
+				}
+			}
+
+			for (;;) {
+				// The first triangle left decides which others can join it
+				int anchor = -1;
+				for (int q = 0; q < 4 && anchor < 0; q++) {
+					if (numPixelTris[q]) {
+						anchor = pixelTris[q][0];
+					}
+				}
+				if (anchor < 0) {
+					break;
+				}
+
+				// Pixels without a triangle this time get the anchor's varyings, for the derivatives
+				const ResolveTri* a = &tile->tris[anchor];
+				const ResolveTri* tris[4] = { a, a, a, a };
+				int coverage[4] = { 0 };
+				int mask = 0;
+				for (int q = 0; q < 4; q++) {
+					for (int k = 0; k < numPixelTris[q]; k++) {
+						int id = pixelTris[q][k];
+						if (id != anchor && !ResolveTri_Continuous(a, &tile->tris[id])) {
+							continue;
+						}
+						tris[q] = &tile->tris[id];
+						for (int i = 0; i < MSAA_SAMPLES; i++) {
+							if (ids[q][i] == id) {
+								coverage[q] |= 1 << i;
+							}
+						}
+						mask |= 1 << q;
+						pixelTris[q][k] = pixelTris[q][--numPixelTris[q]];
+						break;
+					}
+				}
+
+				quad.numVaryings = a->numVaryings;
+				quad.tex = a->raster->tex;
+				quad.sampler = &a->raster->sampler;
+				quad.uniforms = a->raster->uniforms;
+				for (int v = a->numVaryings; v < 2; v++) {
+					f32x4_store(quad.varyings[v], f32x4_splat(0));
+				}
+
+				const Plane* planes[4] = { &tris[0]->z, &tris[1]->z, &tris[2]->z, &tris[3]->z };
+				f32x4_store(quad.z, Plane_EvalPixels(planes, quadX, pixelY));
+				for (int q = 0; q < 4; q++) {
+					planes[q] = &tris[q]->invW;
+				}
+				f32x4 W = f32x4_div(f32x4_splat(1), Plane_EvalPixels(planes, quadX, pixelY));
+				for (int v = 0; v < a->numVaryings; v++) {
+					for (int q = 0; q < 4; q++) {
+						planes[q] = &tris[q]->varyings[v];
+					}
+					f32x4_store(quad.varyings[v], f32x4_mul(Plane_EvalPixels(planes, quadX, pixelY), W));
+				}
+
+				quad.x = tile->left + x;
+				quad.y = tile->top + y;
+				quad.mask = mask;
+				rgb colour[4];
+				// A shader that discards was already run by the visibility pass, so it
+				// shouldn't drop anything here. If it does the samples keep their colour.
+				mask &= shader(&quad, colour);
+
+				for (int q = 0; q < 4; q++) {
+					if (!(mask & (1 << q))) {
+						continue;
+					}
+					rgb* c = fb->colour[(quad.y + (q >> 1)) * fb->width + quad.x + (q & 1)];
+					for (int i = 0; i < MSAA_SAMPLES; i++) {
+						if (coverage[q] & (1 << i)) {
+							c[i] = colour[q];
+						}
+					}
+				}
+			}
+		}
+
+		pixelY = f32x4_add(pixelY, f32x4_splat(2));
+	}
+}
+
+typedef void (*RasteriseFn)(const RasterState* r, const TriSetup* t);
+typedef void (*ResolveFn)(const ResolveTile* tile, const grPixelShader* self);
+
+struct grPixelShader {
+	RasteriseFn rasterise[DRAW_PASSES];
+	ResolveFn resolve;
+	bool discards; // The depth and visibility passes have to run it, so they need the varyings
+};
+
+// The depth and visibility passes of shaders that don't discard, which only need positions
+void Raster_Depth(const RasterState* r, const TriSetup* t);
+void Raster_Visibility(const RasterState* r, const TriSetup* t);
+
+// Define the grPixelShader name, drawing with fn, a grPixelShaderFn that should be visible
+// here (ideally static) so it can be inlined
+#define GR_DEFINE_PIXEL_SHADER(name, fn) \
+	static void name##_Shade(const RasterState* r, const TriSetup* t) { \
+		Raster_Tri(r, t, fn, PASS_SHADE); \
+	} \
+	static void name##_ShadeEqual(const RasterState* r, const TriSetup* t) { \
+		Raster_Tri(r, t, fn, PASS_SHADE_EQUAL); \
+	} \
+	static void name##_Resolve(const ResolveTile* tile, const grPixelShader* self) { \
+		Raster_Resolve(tile, self, fn); \
+	} \
+	const grPixelShader name = { { name##_Shade, name##_ShadeEqual, Raster_Depth, Raster_Visibility }, name##_Resolve, false };
+
+// The same for a shader that discards pixels, which has to be run by the depth and
+// visibility passes too
+#define GR_DEFINE_DISCARDING_PIXEL_SHADER(name, fn) \
+	static void name##_Shade(const RasterState* r, const TriSetup* t) { \
+		Raster_Tri(r, t, fn, PASS_SHADE); \
+	} \
+	static void name##_ShadeEqual(const RasterState* r, const TriSetup* t) { \
+		Raster_Tri(r, t, fn, PASS_SHADE_EQUAL); \
+	} \
+	static void name##_Depth(const RasterState* r, const TriSetup* t) { \
+		Raster_Tri(r, t, fn, PASS_DEPTH); \
+	} \
+	static void name##_Visibility(const RasterState* r, const TriSetup* t) { \
+		Raster_Tri(r, t, fn, PASS_VISIBILITY); \
+	} \
+	static void name##_Resolve(const ResolveTile* tile, const grPixelShader* self) { \
+		Raster_Resolve(tile, self, fn); \
+	} \
+	const grPixelShader name = { { name##_Shade, name##_ShadeEqual, name##_Depth, name##_Visibility }, name##_Resolve, true };
+
+// A sub mesh drawn into the visibility buffer, with everything the resolve needs to shade it
+typedef struct {
+	const grMesh* mesh;
+	VertexInput input;
+	mat4 mvp;
+	mat4 model;
+	const void* vertexUniforms;
+	const grPixelShader* shader;
+	RasterState raster;
+} VisibilityInstance;
+
+struct VisibilityFrame {
+	VisibilityInstance* instances;
+	int numInstances;
+	int instancesCap;
+	unsigned int base; // Instance number of instances[0]
+	// Bounding box of the pixels drawn, empty if left > right
+	int left;
+	int top;
+	int right;
+	int bottom;
+};
+
+// Add an instance to the frame and return its number
+unsigned int Visibility_AddInstance(VisibilityFrame* frame, const VisibilityInstance* instance);
+
+#endif
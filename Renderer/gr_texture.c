@@ -0,0 +1,1013 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <math.h>
+
+#include "util.h"
+
+#include "gr.h"
+#include "gr_internal.h"
+#include "gr_bc.h"
+
+grTexture* grTexture_Create(int width, int height) {
+	grTexture* tex = xmalloc(sizeof(grTexture));
+	tex->width = width;
+	tex->height = height;
+	tex->filter = GR_LINEAR_MIPMAP_LINEAR;
+	tex->wrapU = GR_CLAMP;
+	tex->wrapV = GR_CLAMP;
+	tex->maxAnisotropy = 1;
+	tex->mipmaps = NULL;
+	tex->mipmapData = NULL;
+	tex->dataSize = 0;
+	tex->id = 0;
+	tex->numMipmaps = 0;
+	tex->layers = 1;
+	tex->layout = GR_LAYOUT_LINEAR;
+	tex->format = GR_RGB8;
+	tex->mipGenTime = 0;
+	tex->residentLevel = 0;
+	tex->sampledLevel = 0;
+	return tex;
+}
+
+void grTexture_Destroy(grTexture* tex) {
+	free(tex->mipmaps);
+	free(tex->mipmapData);
+	free(tex);
+}
+
+int int_log2(int x) {
+	int l = 0;
+	while (x >>= 1) ++l;
+	return l;
+}
+
+static inline int texelIndex(const grMipmapLevel* mip, int x, int y, const grTextureLayout layout) {
+	if (layout == GR_LAYOUT_TILED) {
+		// GR_TILE_SIZE is 4
+		return (((y >> 2) * mip->tilesX + (x >> 2)) << 4) + ((y & 3) << 2) + (x & 3);
+	}
+	return y * mip->width + x;
+}
+
+static double now(void) {
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Add adjacent texels of a row of vertical sums and divide by 4.
+// Always inlined with a constant bpp so the inner loop unrolls.
+static inline void sumPairs(const uint16_t* sums, uint8_t* out, int outWidth, const int bpp) {
+	for (int j = 0; j < outWidth; j++) {
+		for (int c = 0; c < bpp; c++) {
+			out[j * bpp + c] = (sums[j * 2 * bpp + c] + sums[j * 2 * bpp + bpp + c]) >> 2;
+		}
+	}
+}
+
+// 2x2 box filter one output row from two input rows.
+// bpp is the number of bytes per texel; the filter works on each byte independently.
+// The vertical sums are done 16 bytes at a time with SSE2 into a 16 bit row buffer,
+// then adjacent texels are added horizontally.
+static void downsampleRow(const uint8_t* row0, const uint8_t* row1, uint8_t* out, int outWidth, int bpp, uint16_t* sums) {
+	int n = outWidth * 2 * bpp;
+	int k = 0;
+
+#ifdef GR_SSE2
+	__m128i zero = _mm_setzero_si128();
+	for (; k + 16 <= n; k += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(row0 + k));
+		__m128i b = _mm_loadu_si128((const __m128i*)(row1 + k));
+		__m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+		__m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+		_mm_storeu_si128((__m128i*)(sums + k), lo);
+		_mm_storeu_si128((__m128i*)(sums + k + 8), hi);
+	}
+#endif
+	for (; k < n; k++) {
+		sums[k] = row0[k] + row1[k];
+	}
+
+	switch (bpp) {
+	case 1: sumPairs(sums, out, outWidth, 1); break;
+	case 2: sumPairs(sums, out, outWidth, 2); break;
+	case 3: sumPairs(sums, out, outWidth, 3); break;
+	case 4: sumPairs(sums, out, outWidth, 4); break;
+	default: sumPairs(sums, out, outWidth, bpp); break;
+	}
+}
+
+// Don't bother starting threads for small levels
+#define MIP_PARALLEL_MIN_TEXELS (128 * 128)
+
+// Fixed point filter taps along one axis for output texel j, when a level of size texels is
+// halved (rounding down, to no less than 1). There are always 3, the ones that aren't needed
+// have no weight and repeat a texel that's there.
+typedef struct {
+	int taps[3];
+	uint32_t weights[3]; // Adding up to 1 << bits
+} ReduceTaps;
+
+// Columns are weighted in 8 bits so the sums of bytes fit 16 bit lanes, rows in 16 bits
+// so the final sums of those still fit in 32
+#define REDUCE_Y_BITS 8
+#define REDUCE_X_BITS 16
+
+static ReduceTaps reduceTaps(int j, int size, int bits) {
+	uint32_t one = 1u << bits;
+	if (size == 1) {
+		return (ReduceTaps) { { 0, 0, 0 }, { one, 0, 0 } };
+	}
+	if ((size & 1) == 0) {
+		return (ReduceTaps) { { j * 2, j * 2 + 1, j * 2 + 1 }, { one / 2, one / 2, 0 } };
+	}
+
+	// An odd size 2n + 1 goes down to n, so each output texel covers 2 + 1/n input
+	// texels. Its 3 taps are weighted by how much of each it covers. The middle one takes
+	// the rounding so they still add up to exactly one.
+	uint32_t n = size / 2;
+	uint32_t w0 = (uint32_t)(((uint64_t)(n - j) * one + size / 2) / size);
+	uint32_t w2 = (uint32_t)(((uint64_t)(j + 1) * one + size / 2) / size);
+	return (ReduceTaps) { { j * 2, j * 2 + 1, j * 2 + 2 }, { w0, one - w0 - w2, w2 } };
+}
+
+// Weight three input rows into a row of 16 bit sums, 16 bytes at a time with SSE2
+static void reduceColumns(const uint8_t* row0, const uint8_t* row1, const uint8_t* row2, const uint32_t* w, uint16_t* sums, int n) {
+	int k = 0;
+
+#ifdef GR_SSE2
+	__m128i zero = _mm_setzero_si128();
+	__m128i w0 = _mm_set1_epi16((short)w[0]);
+	__m128i w1 = _mm_set1_epi16((short)w[1]);
+	__m128i w2 = _mm_set1_epi16((short)w[2]);
+	for (; k + 16 <= n; k += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(row0 + k));
+		__m128i b = _mm_loadu_si128((const __m128i*)(row1 + k));
+		__m128i c = _mm_loadu_si128((const __m128i*)(row2 + k));
+		__m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), w0),
+			_mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), w1)), _mm_mullo_epi16(_mm_unpacklo_epi8(c, zero), w2));
+		__m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), w0),
+			_mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), w1)), _mm_mullo_epi16(_mm_unpackhi_epi8(c, zero), w2));
+		_mm_storeu_si128((__m128i*)(sums + k), lo);
+		_mm_storeu_si128((__m128i*)(sums + k + 8), hi);
+	}
+#endif
+	for (; k < n; k++) {
+		sums[k] = (uint16_t)(row0[k] * w[0] + row1[k] * w[1] + row2[k] * w[2]);
+	}
+}
+
+// Weight the column sums into output texels, with the taps already in bytes.
+// Always inlined with a constant bpp like sumPairs.
+static inline void reduceRow(const uint16_t* sums, const ReduceTaps* tx, uint8_t* out, int outWidth, const int bpp) {
+	const uint32_t round = 1u << (REDUCE_X_BITS + REDUCE_Y_BITS - 1);
+	for (int j = 0; j < outWidth; j++) {
+		const ReduceTaps* t = &tx[j];
+		for (int c = 0; c < bpp; c++) {
+			uint32_t sum = sums[t->taps[0] + c] * t->weights[0] + sums[t->taps[1] + c] * t->weights[1] + sums[t->taps[2] + c] * t->weights[2];
+			out[j * bpp + c] = (uint8_t)((sum + round) >> (REDUCE_X_BITS + REDUCE_Y_BITS));
+		}
+	}
+}
+
+// Any level with an odd size (including 1) is reduced with 3 tap polyphase filters,
+// so the odd texel out isn't just dropped and the image doesn't shift. Same as
+// downsample, the columns are summed first and then the rows.
+static void downsampleOdd(const grMipmapLevel* prev, grMipmapLevel* mip, int bpp) {
+	const uint8_t* src = (const uint8_t*)prev->data;
+	uint8_t* dst = (uint8_t*)mip->data;
+	int srcPitch = prev->width * bpp;
+	int dstPitch = mip->width * bpp;
+
+	// The horizontal taps are the same for every row
+	ReduceTaps* tx = xmalloc(mip->width * sizeof(ReduceTaps));
+	for (int j = 0; j < mip->width; j++) {
+		tx[j] = reduceTaps(j, prev->width, REDUCE_X_BITS);
+		for (int k = 0; k < 3; k++) {
+			tx[j].taps[k] *= bpp;
+		}
+	}
+
+	#pragma omp parallel if (mip->width * mip->height >= MIP_PARALLEL_MIN_TEXELS)
+	{
+		uint16_t* sums = xmalloc(srcPitch * sizeof(uint16_t));
+
+		#pragma omp for
+		for (int i = 0; i < mip->height; i++) {
+			ReduceTaps ty = reduceTaps(i, prev->height, REDUCE_Y_BITS);
+			reduceColumns(src + ty.taps[0] * srcPitch, src + ty.taps[1] * srcPitch, src + ty.taps[2] * srcPitch, ty.weights, sums, srcPitch);
+
+			uint8_t* out = dst + i * dstPitch;
+			switch (bpp) {
+			case 1: reduceRow(sums, tx, out, mip->width, 1); break;
+			case 2: reduceRow(sums, tx, out, mip->width, 2); break;
+			case 3: reduceRow(sums, tx, out, mip->width, 3); break;
+			case 4: reduceRow(sums, tx, out, mip->width, 4); break;
+			default: reduceRow(sums, tx, out, mip->width, bpp); break;
+			}
+		}
+
+		free(sums);
+	}
+
+	free(tx);
+}
+
+static void downsample(const grMipmapLevel* prev, grMipmapLevel* mip, int bpp) {
+	if ((prev->width & 1) || (prev->height & 1)) {
+		downsampleOdd(prev, mip, bpp);
+		return;
+	}
+
+	const uint8_t* src = (const uint8_t*)prev->data;
+	uint8_t* dst = (uint8_t*)mip->data;
+	int srcPitch = prev->width * bpp;
+	int dstPitch = mip->width * bpp;
+
+	#pragma omp parallel if (mip->width * mip->height >= MIP_PARALLEL_MIN_TEXELS)
+	{
+		uint16_t* sums = xmalloc(srcPitch * sizeof(uint16_t));
+
+		#pragma omp for
+		for (int i = 0; i < mip->height; i++) {
+			downsampleRow(src + i * 2 * srcPitch, src + (i * 2 + 1) * srcPitch, dst + i * dstPitch, mip->width, bpp, sums);
+		}
+
+		free(sums);
+	}
+}
+
+bool grTextureFormat_IsCompressed(grTextureFormat format) {
+	return format == GR_BC1 || format == GR_BC3;
+}
+
+int grTextureFormat_BytesPerTexel(grTextureFormat format) {
+	switch (format) {
+	case GR_RGB8: return 3;
+	case GR_RGBA8: return 4;
+	case GR_R8: return 1;
+	case GR_RG8: return 2;
+	case GR_RGB565: return 2;
+	case GR_BC1: return 0;
+	case GR_BC3: return 0;
+	}
+	return 0;
+}
+
+int grTextureFormat_BlockBytes(grTextureFormat format) {
+	switch (format) {
+	case GR_BC1: return BC1_BLOCK_BYTES;
+	case GR_BC3: return BC3_BLOCK_BYTES;
+	default: return 0;
+	}
+}
+
+int grTextureFormat_Components(grTextureFormat format) {
+	switch (format) {
+	case GR_RGB8: return 3;
+	case GR_RGBA8: return 4;
+	case GR_R8: return 1;
+	case GR_RG8: return 2;
+	case GR_RGB565: return 3;
+	case GR_BC1: return 3;
+	case GR_BC3: return 4;
+	}
+	return 0;
+}
+
+// Bytes of one level's data in the given format and layout
+static size_t levelBytes(const grMipmapLevel* mip, grTextureFormat format, grTextureLayout layout) {
+	int tilesY = (mip->height + GR_TILE_SIZE - 1) / GR_TILE_SIZE;
+	if (grTextureFormat_IsCompressed(format)) {
+		return (size_t)mip->tilesX * tilesY * grTextureFormat_BlockBytes(format);
+	}
+	if (layout == GR_LAYOUT_TILED) {
+		return (size_t)mip->tilesX * tilesY * GR_TILE_SIZE * GR_TILE_SIZE * grTextureFormat_BytesPerTexel(format);
+	}
+	return (size_t)mip->width * mip->height * grTextureFormat_BytesPerTexel(format);
+}
+
+// Allocate the levels down to 1x1 and fill in their sizes.
+// The format, layout and number of layers must already be set.
+static void initLevels(grTexture* tex, int width, int height) {
+	free(tex->mipmaps);
+	free(tex->mipmapData);
+	tex->mipmapData = NULL;
+
+	tex->width = width;
+	tex->height = height;
+	tex->numMipmaps = int_log2(max(width, height)) + 1;
+	tex->mipmaps = xmalloc(tex->numMipmaps * sizeof(grMipmapLevel));
+	tex->residentLevel = 0;
+	tex->sampledLevel = tex->numMipmaps;
+
+	for (int i = 0; i < tex->numMipmaps; i++) {
+		grMipmapLevel* mip = &tex->mipmaps[i];
+		mip->width = max(width >> i, 1);
+		mip->height = max(height >> i, 1);
+		mip->tilesX = (mip->width + GR_TILE_SIZE - 1) / GR_TILE_SIZE;
+		mip->data = NULL;
+		mip->layerSize = levelBytes(mip, tex->format, tex->layout);
+	}
+}
+
+// Convert a texel of 8 bit components to the storage format
+static void encodeTexel(const uint8_t* src, uint8_t* dst, grTextureFormat format) {
+	if (format == GR_RGB565) {
+		uint16_t t = ((src[0] >> 3) << 11) | ((src[1] >> 2) << 5) | (src[2] >> 3);
+		memcpy(dst, &t, sizeof(t));
+	}
+	else {
+		memcpy(dst, src, grTextureFormat_BytesPerTexel(format));
+	}
+}
+
+// Compress a level that is still linear with srcBpp components per texel
+static void encodeBlocks(const uint8_t* src, int srcBpp, const grMipmapLevel* mip, uint8_t* dst, grTextureFormat format) {
+	int blockBytes = grTextureFormat_BlockBytes(format);
+	int blocksY = (mip->height + BC_BLOCK_SIZE - 1) / BC_BLOCK_SIZE;
+
+	#pragma omp parallel for if (mip->width * mip->height >= MIP_PARALLEL_MIN_TEXELS)
+	for (int by = 0; by < blocksY; by++) {
+		for (int bx = 0; bx < mip->tilesX; bx++) {
+			// Levels smaller than a block repeat their edge texels
+			uint8_t rgba[16 * 4];
+			for (int i = 0; i < 16; i++) {
+				int x = min(bx * BC_BLOCK_SIZE + (i & 3), mip->width - 1);
+				int y = min(by * BC_BLOCK_SIZE + (i >> 2), mip->height - 1);
+				const uint8_t* t = &src[(y * mip->width + x) * srcBpp];
+				rgba[i * 4 + 0] = t[0];
+				rgba[i * 4 + 1] = t[1];
+				rgba[i * 4 + 2] = t[2];
+				rgba[i * 4 + 3] = srcBpp == 4 ? t[3] : 255;
+			}
+
+			uint8_t* out = &dst[(by * mip->tilesX + bx) * blockBytes];
+			if (format == GR_BC1) {
+				BC1_EncodeBlock(rgba, out);
+			}
+			else {
+				BC3_EncodeBlock(rgba, out);
+			}
+		}
+	}
+}
+
+// Read one texel and expand it to rgb.
+// R8 is treated as luminance and RG8 has no blue, alpha is dropped.
+static inline rgb fetchTexel(const void* data, int index, const grTextureFormat format) {
+	const uint8_t* p = data;
+	switch (format) {
+	case GR_RGB8:
+		return ((const rgb*)p)[index];
+	case GR_RGBA8: {
+		uint32_t t = ((const uint32_t*)p)[index];
+		return (rgb) { t & 255, (t >> 8) & 255, (t >> 16) & 255 };
+	}
+	case GR_R8:
+		return (rgb) { p[index], p[index], p[index] };
+	case GR_RG8:
+		return (rgb) { p[index * 2], p[index * 2 + 1], 0 };
+	case GR_RGB565:
+		return BC_Expand565(((const uint16_t*)p)[index]);
+	default:
+		// Block compressed formats go through fetchBlockTexel
+		return (rgb) { 0, 0, 0 };
+	}
+}
+
+static inline rgb bilinear(rgb c00, rgb c10, rgb c01, rgb c11, float t1, float t2) {
+	rgb c = {
+		lerpf(lerpf(c00.r, c10.r, t1), lerpf(c01.r, c11.r, t1), t2),
+		lerpf(lerpf(c00.g, c10.g, t1), lerpf(c01.g, c11.g, t1), t2),
+		lerpf(lerpf(c00.b, c10.b, t1), lerpf(c01.b, c11.b, t1), t2),
+	};
+	return c;
+}
+
+// Decoded block cache.
+// Each thread has a small direct mapped cache of decoded blocks, tagged by texture id,
+// level and block index. Ids are never reused, so blocks of a destroyed or re-uploaded
+// texture can't be hit again and just get evicted.
+// The slot comes from the low bits of the block coordinates, so the cache covers a
+// 64x64 texel window, offset per level so the two levels of a trilinear lookup don't fight.
+#define BLOCK_CACHE_ENTRIES 256
+
+typedef struct {
+	unsigned int texId; // Texture ids start at 1, so an empty slot never matches
+	int level;
+	int block;
+	rgb texels[16];
+} CachedBlock;
+
+static GR_THREAD_LOCAL CachedBlock blockCache[BLOCK_CACHE_ENTRIES];
+static GR_THREAD_LOCAL grSamplerStats threadStats;
+
+static unsigned int lastTextureId = 0;
+
+void Sampler_FlushStats(grSamplerStats* stats) {
+	stats->samples += threadStats.samples;
+	stats->blockHits += threadStats.blockHits;
+	stats->blockMisses += threadStats.blockMisses;
+	stats->magnifiedQuads += threadStats.magnifiedQuads;
+	stats->singleLevelQuads += threadStats.singleLevelQuads;
+	stats->trilinearQuads += threadStats.trilinearQuads;
+	stats->anisotropicQuads += threadStats.anisotropicQuads;
+	stats->anisotropicProbes += threadStats.anisotropicProbes;
+	stats->nonResidentQuads += threadStats.nonResidentQuads;
+	memset(&threadStats, 0, sizeof(threadStats));
+}
+
+// Texel (x, y) of a block compressed level, through the block cache
+static inline rgb fetchBlockTexel(grTexture* tex, int level, int layer, int x, int y, const grTextureFormat format) {
+	const grMipmapLevel* mip = &tex->mipmaps[level];
+	int blockBytes = format == GR_BC1 ? BC1_BLOCK_BYTES : BC3_BLOCK_BYTES;
+	int bx = x >> 2;
+	int by = y >> 2;
+	// Counting the blocks of the layers before this one, so it's unique within the level
+	int block = layer * (int)(mip->layerSize / blockBytes) + by * mip->tilesX + bx;
+
+	int slot = (((bx + level * 5) & 15) | (((by + level * 3) & 15) << 4)) ^ (tex->id & (BLOCK_CACHE_ENTRIES - 1));
+	CachedBlock* entry = &blockCache[slot];
+
+	if (entry->texId == tex->id && entry->level == level && entry->block == block) {
+		threadStats.blockHits++;
+	}
+	else {
+		threadStats.blockMisses++;
+
+		const uint8_t* data = (const uint8_t*)mip->data + block * blockBytes;
+		if (format == GR_BC3) {
+			// Skip the alpha, it isn't sampled
+			data += 8;
+		}
+		BC_DecodeColourBlock(data, format == GR_BC1, entry->texels);
+		entry->texId = tex->id;
+		entry->level = level;
+		entry->block = block;
+	}
+
+	return entry->texels[(y & 3) * 4 + (x & 3)];
+}
+
+// Wrap a texel coordinate for GR_REPEAT. Sizes needn't be powers of 2.
+static inline int repeatCoord(int i, int size) {
+	i %= size;
+	return i < 0 ? i + size : i;
+}
+
+// Texel coordinates and weight of a bilinear footprint along one axis
+static inline void bilinearAxis(float u, int size, const grTextureWrapMode wrap, int* i0, int* i1, float* t) {
+	if (wrap == GR_REPEAT) {
+		float f = floorf(u - 0.5f);
+		*t = u - 0.5f - f;
+		*i0 = repeatCoord((int)f, size);
+		*i1 = *i0 + 1 == size ? 0 : *i0 + 1;
+		return;
+	}
+
+	if (u < 0.5f) *t = 0;
+	else if (u > size - 0.5f) *t = 1;
+	else *t = fractf(u - 0.5f);
+
+	*i0 = clampf((int)(u - 0.5f), 0, size - 1);
+	*i1 = clampf((int)(u + 0.5f), 0, size - 1);
+}
+
+// Texel coordinate of a nearest sample along one axis
+static inline int nearestAxis(float u, int size, const grTextureWrapMode wrap) {
+	int i = (int)floorf(u);
+	if (wrap == GR_REPEAT) {
+		return repeatCoord(i, size);
+	}
+	return clampf(i, 0, size - 1);
+}
+
+// Nearest or bilinear sample of one mip level.
+// Always inlined with constant format, layout, wrap modes and filter, so each combination
+// gets its own copy with the branches on them folded away.
+static inline rgb sampleLevel(grTexture* tex, float u, float v, int level, int layer, const grTextureFormat format, const grTextureLayout layout,
+	const grTextureWrapMode wrapU, const grTextureWrapMode wrapV, const bool nearest) {
+	grMipmapLevel* mip = &tex->mipmaps[level];
+	bool compressed = format == GR_BC1 || format == GR_BC3;
+	const uint8_t* data = (const uint8_t*)mip->data + layer * mip->layerSize;
+	threadStats.samples++;
+
+	u *= mip->width;
+	v *= mip->height;
+
+	if (nearest) {
+		int x = nearestAxis(u, mip->width, wrapU);
+		int y = nearestAxis(v, mip->height, wrapV);
+		if (compressed) {
+			return fetchBlockTexel(tex, level, layer, x, y, format);
+		}
+		return fetchTexel(data, texelIndex(mip, x, y, layout), format);
+	}
+
+	int x0, x1, y0, y1;
+	float t1, t2;
+	bilinearAxis(u, mip->width, wrapU, &x0, &x1, &t1);
+	bilinearAxis(v, mip->height, wrapV, &y0, &y1, &t2);
+
+	if (compressed) {
+		rgb c00 = fetchBlockTexel(tex, level, layer, x0, y0, format);
+		rgb c10 = fetchBlockTexel(tex, level, layer, x1, y0, format);
+		rgb c01 = fetchBlockTexel(tex, level, layer, x0, y1, format);
+		rgb c11 = fetchBlockTexel(tex, level, layer, x1, y1, format);
+		return bilinear(c00, c10, c01, c11, t1, t2);
+	}
+
+	int i00 = texelIndex(mip, x0, y0, layout);
+	int i10 = texelIndex(mip, x1, y0, layout);
+	int i01 = texelIndex(mip, x0, y1, layout);
+	int i11 = texelIndex(mip, x1, y1, layout);
+
+#ifdef GR_SSE2
+	if (format == GR_RGBA8) {
+		// Each texel is a single 32 bit load and all the channels are filtered at once
+		const uint32_t* d = (const uint32_t*)data;
+		__m128i zero = _mm_setzero_si128();
+		__m128i top = _mm_unpacklo_epi8(_mm_set_epi32(0, 0, d[i10], d[i00]), zero);
+		__m128i bottom = _mm_unpacklo_epi8(_mm_set_epi32(0, 0, d[i11], d[i01]), zero);
+		__m128 c00 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(top, zero));
+		__m128 c10 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(top, zero));
+		__m128 c01 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(bottom, zero));
+		__m128 c11 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(bottom, zero));
+
+		// Same weights as lerpf so the result matches the scalar path
+		__m128 w1 = _mm_set1_ps(t1);
+		__m128 w0 = _mm_set1_ps(1 - t1);
+		__m128 a = _mm_add_ps(_mm_mul_ps(c00, w0), _mm_mul_ps(c10, w1));
+		__m128 b = _mm_add_ps(_mm_mul_ps(c01, w0), _mm_mul_ps(c11, w1));
+		__m128 c = _mm_add_ps(_mm_mul_ps(a, _mm_set1_ps(1 - t2)), _mm_mul_ps(b, _mm_set1_ps(t2)));
+
+		__m128i ci = _mm_cvttps_epi32(c);
+		ci = _mm_packus_epi16(_mm_packs_epi32(ci, zero), zero);
+		uint32_t t = _mm_cvtsi128_si32(ci);
+		return (rgb) { t & 255, (t >> 8) & 255, (t >> 16) & 255 };
+	}
+#endif
+
+	rgb c00 = fetchTexel(data, i00, format);
+	rgb c10 = fetchTexel(data, i10, format);
+	rgb c01 = fetchTexel(data, i01, format);
+	rgb c11 = fetchTexel(data, i11, format);
+
+	return bilinear(c00, c10, c01, c11, t1, t2);
+}
+
+// One level sampler per format, layout, wrapU, wrapV and nearest/bilinear.
+// Block compressed formats ignore the layout so they only get the linear ones.
+#define LEVEL_SAMPLER(f, l, wu, wv, n) sample_##f##_##l##_##wu##_##wv##_##n
+
+#define DEFINE_LEVEL_SAMPLER(f, l, wu, wv, n) \
+	static rgb LEVEL_SAMPLER(f, l, wu, wv, n)(grTexture* tex, float u, float v, int level, int layer) { \
+		return sampleLevel(tex, u, v, level, layer, f, l, wu, wv, n); \
+	}
+#define DEFINE_FILTERS(f, l, wu, wv) DEFINE_LEVEL_SAMPLER(f, l, wu, wv, 0) DEFINE_LEVEL_SAMPLER(f, l, wu, wv, 1)
+#define DEFINE_WRAPS(f, l) \
+	DEFINE_FILTERS(f, l, GR_CLAMP, GR_CLAMP) DEFINE_FILTERS(f, l, GR_CLAMP, GR_REPEAT) \
+	DEFINE_FILTERS(f, l, GR_REPEAT, GR_CLAMP) DEFINE_FILTERS(f, l, GR_REPEAT, GR_REPEAT)
+#define DEFINE_SAMPLERS(f) DEFINE_WRAPS(f, GR_LAYOUT_LINEAR) DEFINE_WRAPS(f, GR_LAYOUT_TILED)
+#define DEFINE_BLOCK_SAMPLERS(f) DEFINE_WRAPS(f, GR_LAYOUT_LINEAR)
+
+DEFINE_SAMPLERS(GR_RGB8)
+DEFINE_SAMPLERS(GR_RGBA8)
+DEFINE_SAMPLERS(GR_R8)
+DEFINE_SAMPLERS(GR_RG8)
+DEFINE_SAMPLERS(GR_RGB565)
+DEFINE_BLOCK_SAMPLERS(GR_BC1)
+DEFINE_BLOCK_SAMPLERS(GR_BC3)
+
+#define FILTERS(f, l, wu, wv) { LEVEL_SAMPLER(f, l, wu, wv, 0), LEVEL_SAMPLER(f, l, wu, wv, 1) }
+#define WRAPS(f, l) { \
+		{ FILTERS(f, l, GR_CLAMP, GR_CLAMP), FILTERS(f, l, GR_CLAMP, GR_REPEAT) }, \
+		{ FILTERS(f, l, GR_REPEAT, GR_CLAMP), FILTERS(f, l, GR_REPEAT, GR_REPEAT) }, \
+	}
+#define SAMPLERS(f) [f] = { WRAPS(f, GR_LAYOUT_LINEAR), WRAPS(f, GR_LAYOUT_TILED) }
+#define BLOCK_SAMPLERS(f) [f] = { WRAPS(f, GR_LAYOUT_LINEAR) }
+
+// [format][layout][wrapU][wrapV][nearest]
+static const SampleLevelFn LEVEL_SAMPLERS[][2][2][2][2] = {
+	SAMPLERS(GR_RGB8),
+	SAMPLERS(GR_RGBA8),
+	SAMPLERS(GR_R8),
+	SAMPLERS(GR_RG8),
+	SAMPLERS(GR_RGB565),
+	BLOCK_SAMPLERS(GR_BC1),
+	BLOCK_SAMPLERS(GR_BC3),
+};
+
+// Sample the pixels in mask from one level
+static void sampleQuadLevel(const Sampler* s, grTexture* tex, const vec2 uv[4], int mask, int level, rgb out[4]) {
+	for (int q = 0; q < 4; q++) {
+		if (mask & (1 << q)) {
+			out[q] = s->sampleLevel(tex, uv[q].x, uv[q].y, level, s->layer);
+		}
+	}
+}
+
+// Note that a quad wanted level, and give it the nearest level that is actually resident.
+// Draws from several threads could race on sampledLevel, which would only lose a
+// request for a frame.
+static inline int requireLevel(grTexture* tex, int level) {
+	if (level < tex->sampledLevel) {
+		tex->sampledLevel = level;
+	}
+	if (level < tex->residentLevel) {
+		threadStats.nonResidentQuads++;
+		return tex->residentLevel;
+	}
+	return level;
+}
+
+// Level 0 only, for GR_NEAREST and GR_LINEAR
+static void sampleBase(const Sampler* s, grTexture* tex, const vec2 uv[4], int mask, vec2 dx, vec2 dy, rgb out[4]) {
+	sampleQuadLevel(s, tex, uv, mask, requireLevel(tex, 0), out);
+}
+
+float Sampler_Lod(vec2 dx, vec2 dy) {
+	float fx = squaref(dx.x) + squaref(dx.y);
+	float fy = squaref(dy.x) + squaref(dy.y);
+	float rho2 = fmaxf(fx, fy);
+	// A footprint under a texel is magnification and doesn't need the log
+	return rho2 <= 1 ? 0 : log2f(rho2) / 2.f;
+}
+
+static void sampleNearestMip(const Sampler* s, grTexture* tex, const vec2 uv[4], int mask, vec2 dx, vec2 dy, rgb out[4]) {
+	float lod = Sampler_Lod(dx, dy);
+	int level = min((int)(lod + 0.5f), tex->numMipmaps - 1);
+	sampleQuadLevel(s, tex, uv, mask, requireLevel(tex, level), out);
+}
+
+// Below this the finer level's weight can't change the result by a whole unit
+#define TRILINEAR_MIN_WEIGHT (1.f / 256)
+
+// The levels a quad's trilinear samples read, decided once per quad.
+// level1 is -1 when only level0 is needed.
+typedef struct {
+	int level0;
+	int level1;
+	float t;
+} MipBlend;
+
+static MipBlend chooseLevels(grTexture* tex, float lod) {
+	// A quad that wants a level that isn't resident gets the finest one that is
+	int wanted = lod <= 0 ? 0 : min((int)lod, tex->numMipmaps - 1);
+	lod = fmaxf(lod, (float)requireLevel(tex, wanted));
+
+	int level = (int)lod;
+	float t = lod - level;
+
+	// Magnified, or past the end of the chain, so both levels would be the same
+	if (lod <= 0) {
+		threadStats.magnifiedQuads++;
+		return (MipBlend) { 0, -1, 0 };
+	}
+	if (level >= tex->numMipmaps - 1) {
+		threadStats.singleLevelQuads++;
+		return (MipBlend) { tex->numMipmaps - 1, -1, 0 };
+	}
+
+	if (t < TRILINEAR_MIN_WEIGHT || t > 1 - TRILINEAR_MIN_WEIGHT) {
+		threadStats.singleLevelQuads++;
+		return (MipBlend) { t < 0.5f ? level : level + 1, -1, 0 };
+	}
+
+	threadStats.trilinearQuads++;
+	return (MipBlend) { level, level + 1, t };
+}
+
+static inline rgb sampleBlend(const Sampler* s, grTexture* tex, float u, float v, MipBlend b) {
+	rgb tc1 = s->sampleLevel(tex, u, v, b.level0, s->layer);
+	if (b.level1 < 0) {
+		return tc1;
+	}
+
+	rgb tc2 = s->sampleLevel(tex, u, v, b.level1, s->layer);
+	return (rgb) {
+		lerpf(tc1.r, tc2.r, b.t),
+		lerpf(tc1.g, tc2.g, b.t),
+		lerpf(tc1.b, tc2.b, b.t),
+	};
+}
+
+static void sampleTrilinear(const Sampler* s, grTexture* tex, const vec2 uv[4], int mask, vec2 dx, vec2 dy, rgb out[4]) {
+	MipBlend b = chooseLevels(tex, Sampler_Lod(dx, dy));
+	for (int q = 0; q < 4; q++) {
+		if (mask & (1 << q)) {
+			out[q] = sampleBlend(s, tex, uv[q].x, uv[q].y, b);
+		}
+	}
+}
+
+// The footprint of a pixel is roughly an ellipse with axes dx and dy. Rather than
+// blurring it down to a circle round the long axis, like isotropic trilinear does,
+// the LOD comes from the short axis and up to maxAnisotropy trilinear probes are
+// spread along the long one and averaged.
+static void sampleAnisotropic(const Sampler* s, grTexture* tex, const vec2 uv[4], int mask, vec2 dx, vec2 dy, rgb out[4]) {
+	float fx = squaref(dx.x) + squaref(dx.y);
+	float fy = squaref(dy.x) + squaref(dy.y);
+	float major2 = fmaxf(fx, fy);
+	float minor2 = fminf(fx, fy);
+
+	int probes = minor2 > 0 ? (int)ceilf(sqrtf(major2 / minor2)) : tex->maxAnisotropy;
+	probes = min(probes, tex->maxAnisotropy);
+	if (probes <= 1) {
+		sampleTrilinear(s, tex, uv, mask, dx, dy, out);
+		return;
+	}
+
+	// Each probe covers 1/probes of the long axis
+	float lod = fmaxf(log2f(major2) / 2.f - log2f((float)probes), 0);
+	MipBlend b = chooseLevels(tex, lod);
+
+	// Long axis in uv space, the derivatives are in level 0 texels
+	vec2 axis = fx >= fy ? dx : dy;
+	axis.x /= tex->width;
+	axis.y /= tex->height;
+
+	threadStats.anisotropicQuads++;
+	for (int q = 0; q < 4; q++) {
+		if (mask & (1 << q)) {
+			float r = 0;
+			float g = 0;
+			float bl = 0;
+			for (int i = 0; i < probes; i++) {
+				float o = (i + 0.5f) / probes - 0.5f;
+				rgb c = sampleBlend(s, tex, uv[q].x + axis.x * o, uv[q].y + axis.y * o, b);
+				r += c.r;
+				g += c.g;
+				bl += c.b;
+			}
+			out[q] = (rgb) { r / probes, g / probes, bl / probes };
+			threadStats.anisotropicProbes += probes;
+		}
+	}
+}
+
+Sampler Texture_GetSampler(const grTexture* tex) {
+	bool compressed = grTextureFormat_IsCompressed(tex->format);
+	int layout = compressed ? GR_LAYOUT_LINEAR : tex->layout;
+	bool nearest = tex->filter == GR_NEAREST || tex->filter == GR_NEAREST_MIPMAP_NEAREST;
+
+	Sampler s;
+	s.layer = 0;
+	s.sampleLevel = LEVEL_SAMPLERS[tex->format][layout][tex->wrapU][tex->wrapV][nearest];
+	switch (tex->filter) {
+	case GR_NEAREST:
+	case GR_LINEAR:
+		s.sampleQuad = sampleBase;
+		break;
+	case GR_NEAREST_MIPMAP_NEAREST:
+		s.sampleQuad = sampleNearestMip;
+		break;
+	default:
+		s.sampleQuad = tex->maxAnisotropy > 1 ? sampleAnisotropic : sampleTrilinear;
+		break;
+	}
+	return s;
+}
+
+// Point the levels from level on at consecutive parts of tex->mipmapData, and return
+// how many bytes they take up. Each level holds all of its layers.
+static size_t placeLevels(grTexture* tex, int level) {
+	uint8_t* p = tex->mipmapData;
+	size_t total = 0;
+	for (int i = level; i < tex->numMipmaps; i++) {
+		grMipmapLevel* mip = &tex->mipmaps[i];
+		mip->data = p + total;
+		total += mip->layerSize * tex->layers;
+	}
+	return total;
+}
+
+// Whether levels built from 8 bit components have to be converted to the texture's storage
+static bool needsEncoding(const grTexture* tex) {
+	return grTextureFormat_IsCompressed(tex->format) || tex->layout != GR_LAYOUT_LINEAR ||
+		grTextureFormat_Components(tex->format) != grTextureFormat_BytesPerTexel(tex->format);
+}
+
+// Convert, compress and/or swizzle a linear level of srcBpp components per texel into dst
+static void encodeLevel(const grTexture* tex, const grMipmapLevel* mip, int srcBpp, uint8_t* dst) {
+	const uint8_t* src = mip->data;
+	int dstBpp = grTextureFormat_BytesPerTexel(tex->format);
+
+	if (grTextureFormat_IsCompressed(tex->format)) {
+		encodeBlocks(src, srcBpp, mip, dst, tex->format);
+		return;
+	}
+
+	// With the tiled layout, texels in the padding of partial tiles are
+	// left uninitialised, the sampler never reads them
+	#pragma omp parallel for if (mip->width * mip->height >= MIP_PARALLEL_MIN_TEXELS)
+	for (int y = 0; y < mip->height; y++) {
+		for (int x = 0; x < mip->width; x++) {
+			int index = texelIndex(mip, x, y, tex->layout);
+			encodeTexel(&src[(y * mip->width + x) * srcBpp], &dst[index * dstBpp], tex->format);
+		}
+	}
+}
+
+void grTexture_SetData(grTexture* tex, const void* data, int width, int height) {
+	grTexture_SetArrayData(tex, data, width, height, 1);
+}
+
+void grTexture_SetArrayData(grTexture* tex, const void* data, int width, int height, int layers) {
+	double start = now();
+
+	tex->layers = layers;
+	initLevels(tex, width, height);
+	int numLevels = tex->numMipmaps;
+
+	// All the levels live in one allocation, one after the other
+	tex->dataSize = grTexture_TailBytes(tex, 0);
+	tex->mipmapData = xmalloc(tex->dataSize);
+	placeLevels(tex, 0);
+
+	// Each layer's chain is always built linearly from 8 bit components first. That's done
+	// in place if it's also the storage format, otherwise in a scratch buffer which is then
+	// converted, compressed and/or swizzled into the final storage.
+	int srcBpp = grTextureFormat_Components(tex->format);
+	bool convert = needsEncoding(tex);
+
+	size_t scratchSize = 0;
+	for (int i = 0; i < numLevels; i++) {
+		scratchSize += (size_t)tex->mipmaps[i].width * tex->mipmaps[i].height * srcBpp;
+	}
+	uint8_t* scratch = convert ? xmalloc(scratchSize) : NULL;
+	grMipmapLevel* chain = xmalloc(numLevels * sizeof(grMipmapLevel));
+	size_t layerTexels = (size_t)width * height;
+
+	for (int layer = 0; layer < layers; layer++) {
+		uint8_t* p = scratch;
+		for (int i = 0; i < numLevels; i++) {
+			chain[i] = tex->mipmaps[i];
+			if (convert) {
+				chain[i].data = p;
+				p += chain[i].width * chain[i].height * srcBpp;
+			}
+			else {
+				chain[i].data = (uint8_t*)chain[i].data + layer * chain[i].layerSize;
+			}
+		}
+
+		// First mipmap is just the original data
+		memcpy(chain[0].data, (const uint8_t*)data + layer * layerTexels * srcBpp, layerTexels * srcBpp);
+
+		// Generate mipmap chain
+		for (int i = 1; i < numLevels; i++) {
+			downsample(&chain[i - 1], &chain[i], srcBpp);
+		}
+
+		if (!convert) {
+			continue;
+		}
+
+		for (int i = 0; i < numLevels; i++) {
+			encodeLevel(tex, &chain[i], srcBpp, (uint8_t*)tex->mipmaps[i].data + layer * chain[i].layerSize);
+		}
+	}
+
+	free(chain);
+	free(scratch);
+
+	tex->id = GR_ATOMIC_INC(&lastTextureId);
+	tex->mipGenTime = (float)((now() - start) * 1000);
+}
+
+bool grTexture_BuildLevels(grTexture* tex, const void* data, int width, int height, int residentLevel, grTextureLevelFn fn, void* user) {
+	double start = now();
+
+	tex->layers = 1;
+	initLevels(tex, width, height);
+	int numLevels = tex->numMipmaps;
+	residentLevel = min(residentLevel, numLevels - 1);
+
+	tex->dataSize = grTexture_TailBytes(tex, residentLevel);
+	tex->mipmapData = xmalloc(tex->dataSize);
+	tex->residentLevel = residentLevel;
+	placeLevels(tex, residentLevel);
+
+	// Only the level being built and the one it's built from are kept as 8 bit components.
+	// Odd levels go in one buffer and even ones in the other, so the first is the biggest.
+	int srcBpp = grTextureFormat_Components(tex->format);
+	bool convert = needsEncoding(tex);
+	uint8_t* buffers[2] = { NULL, NULL };
+	for (int i = 1; i < min(numLevels, 3); i++) {
+		buffers[i & 1] = xmalloc((size_t)tex->mipmaps[i].width * tex->mipmaps[i].height * srcBpp);
+	}
+	// Non resident levels are encoded here before being handed over
+	uint8_t* encoded = convert && residentLevel > 0 ? xmalloc(tex->mipmaps[0].layerSize) : NULL;
+
+	bool ok = true;
+	grMipmapLevel prev;
+	for (int i = 0; i < numLevels && ok; i++) {
+		grMipmapLevel level = tex->mipmaps[i];
+		if (i == 0) {
+			level.data = (void*)data;
+		}
+		else {
+			level.data = buffers[i & 1];
+			downsample(&prev, &level, srcBpp);
+		}
+		prev = level;
+
+		grMipmapLevel* mip = &tex->mipmaps[i];
+		if (i >= residentLevel) {
+			if (convert) {
+				encodeLevel(tex, &level, srcBpp, mip->data);
+			}
+			else {
+				memcpy(mip->data, level.data, mip->layerSize);
+			}
+			ok = fn(user, tex, i);
+		}
+		else {
+			mip->data = convert ? encoded : level.data;
+			if (convert) {
+				encodeLevel(tex, &level, srcBpp, encoded);
+			}
+			ok = fn(user, tex, i);
+			mip->data = NULL;
+		}
+	}
+
+	free(encoded);
+	free(buffers[0]);
+	free(buffers[1]);
+
+	tex->id = GR_ATOMIC_INC(&lastTextureId);
+	tex->mipGenTime = (float)((now() - start) * 1000);
+	return ok;
+}
+
+void grTexture_SetCompressedData(grTexture* tex, const void* data, int width, int height) {
+	assert(grTextureFormat_IsCompressed(tex->format));
+
+	double start = now();
+
+	initLevels(tex, width, height);
+
+	tex->dataSize = grTexture_TailBytes(tex, 0);
+	tex->mipmapData = xmalloc(tex->dataSize);
+	tex->id = GR_ATOMIC_INC(&lastTextureId);
+	memcpy(tex->mipmapData, data, tex->dataSize);
+	placeLevels(tex, 0);
+
+	tex->mipGenTime = (float)((now() - start) * 1000);
+}
+
+size_t grTexture_TailBytes(const grTexture* tex, int level) {
+	size_t total = 0;
+	for (int i = level; i < tex->numMipmaps; i++) {
+		total += tex->mipmaps[i].layerSize * tex->layers;
+	}
+	return total;
+}
+
+void grTexture_SetResidentData(grTexture* tex, void* data, int level, int width, int height) {
+	initLevels(tex, width, height);
+	assert(level >= 0 && level < tex->numMipmaps);
+
+	tex->mipmapData = data;
+	tex->dataSize = placeLevels(tex, level);
+	tex->residentLevel = level;
+	// The blocks in the sampler's cache may be for levels that aren't resident any more
+	tex->id = GR_ATOMIC_INC(&lastTextureId);
+}
+
+void grTexture_Evict(grTexture* tex, int level) {
+	if (level <= tex->residentLevel) {
+		return;
+	}
+
+	size_t size = grTexture_TailBytes(tex, level);
+	void* data = xmalloc(size);
+	memcpy(data, tex->mipmaps[level].data, size);
+	grTexture_SetResidentData(tex, data, level, tex->width, tex->height);
+}
+
+rgb Texture_ReadTexel(const grTexture* tex, int level, int layer, int x, int y) {
+	const grMipmapLevel* mip = &tex->mipmaps[level];
+	const uint8_t* data = (const uint8_t*)mip->data + layer * mip->layerSize;
+
+	if (grTextureFormat_IsCompressed(tex->format)) {
+		int blockBytes = grTextureFormat_BlockBytes(tex->format);
+		const uint8_t* block = data + ((y >> 2) * mip->tilesX + (x >> 2)) * blockBytes;
+		rgb texels[16];
+		BC_DecodeColourBlock(tex->format == GR_BC3 ? block + 8 : block, tex->format == GR_BC1, texels);
+		return texels[(y & 3) * 4 + (x & 3)];
+	}
+	return fetchTexel(data, texelIndex(mip, x, y, tex->layout), tex->format);
+}
+
+int grTexture_TexelIndex(const grTexture* tex, int level, int x, int y) {
+	return texelIndex(&tex->mipmaps[level], x, y, tex->layout);
+}
@@ -0,0 +1,296 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+
+#include "util.h"
+
+#include "gr.h"
+#include "gr_internal.h"
+#include "gr_shader.h"
+
+// The visibility buffer resolve.
+// The visibility pass leaves an instance and triangle number at each sample. The resolve goes
+// over the pixels it drew to a tile at a time, finds the triangles in the tile, shades their
+// vertices again and works out their planes, then runs each shader's Raster_Resolve on the
+// tile. Tiles are independent, so they're shared out between threads.
+
+VisibilityFrame* Visibility_Begin(grDevice* dev) {
+	grFramebuffer* fb = dev->fb;
+	size_t size = fb->width * fb->height * sizeof(grVisibilitySample) * MSAA_SAMPLES;
+	if (fb->visibility == NULL) {
+		fb->visibility = xmalloc(size);
+		memset(fb->visibility, 0xff, size);
+		fb->visibilityInstances = 0;
+	}
+	// Without clears the instance numbers would eventually wrap around
+	else if (fb->visibilityInstances > UINT_MAX / 2) {
+		memset(fb->visibility, 0xff, size);
+		fb->visibilityInstances = 0;
+	}
+
+	VisibilityFrame* frame = xmalloc(sizeof(VisibilityFrame));
+	frame->instances = NULL;
+	frame->numInstances = 0;
+	frame->instancesCap = 0;
+	frame->base = fb->visibilityInstances;
+	frame->left = INT_MAX;
+	frame->top = INT_MAX;
+	frame->right = INT_MIN;
+	frame->bottom = INT_MIN;
+	return frame;
+}
+
+unsigned int Visibility_AddInstance(VisibilityFrame* frame, const VisibilityInstance* instance) {
+	if (frame->numInstances == frame->instancesCap) {
+		frame->instancesCap = frame->instancesCap ? frame->instancesCap * 2 : 16;
+		VisibilityInstance* instances = xmalloc(frame->instancesCap * sizeof(VisibilityInstance));
+		if (frame->numInstances) {
+			memcpy(instances, frame->instances, frame->numInstances * sizeof(VisibilityInstance));
+		}
+		free(frame->instances);
+		frame->instances = instances;
+	}
+	frame->instances[frame->numInstances] = *instance;
+	return frame->base + frame->numInstances++;
+}
+
+// Every sample of a tile could be a different triangle
+#define MAX_TILE_TRIS (RESOLVE_TILE_SIZE * RESOLVE_TILE_SIZE * MSAA_SAMPLES)
+// Open addressing from instance and triangle to a tile's triangle, at most half full
+#define TILE_HASH_SIZE (MAX_TILE_TRIS * 2)
+
+// Instance (relative to the frame) in the top 32 bits, triangle in the bottom
+typedef struct {
+	uint64_t key;
+	int tri;
+} TriKey;
+
+// Each thread's working memory
+typedef struct {
+	ResolveTile tile;
+	ResolveTri tris[MAX_TILE_TRIS];
+	TriKey keys[MAX_TILE_TRIS];
+	int numTris;
+
+	uint64_t hashKeys[TILE_HASH_SIZE];
+	uint16_t hashTris[TILE_HASH_SIZE];
+	int hashStamps[TILE_HASH_SIZE]; // Entries are empty unless they have the tile's stamp
+	int stamp;
+
+	int indices[GR_VERTEX_BATCH_SIZE];
+	grVertexBatch batch;
+} TileScratch;
+
+static int findTri(TileScratch* s, uint64_t key) {
+	unsigned int h = (unsigned int)((key * 0x9E3779B97F4A7C15ull) >> 40) & (TILE_HASH_SIZE - 1);
+	while (s->hashStamps[h] == s->stamp) {
+		if (s->hashKeys[h] == key) {
+			return s->hashTris[h];
+		}
+		h = (h + 1) & (TILE_HASH_SIZE - 1);
+	}
+
+	s->hashStamps[h] = s->stamp;
+	s->hashKeys[h] = key;
+	s->hashTris[h] = (uint16_t)s->numTris;
+	s->keys[s->numTris] = (TriKey) { key, s->numTris };
+	return s->numTris++;
+}
+
+static int compareKeys(const void* a, const void* b) {
+	uint64_t ka = ((const TriKey*)a)->key;
+	uint64_t kb = ((const TriKey*)b)->key;
+	return ka < kb ? -1 : ka > kb;
+}
+
+// The planes of a triangle relative to the tile's top left pixel, from its vertices first to
+// first + 2 of the batch. The vertices are in clip space and the triangle isn't clipped, so
+// it's interpolated in 2D homogeneous coordinates (Olano and Greer), which works even if some
+// of them are behind the camera. With rows (x, y, w) of the vertices in M, any attribute f
+// over w at NDC point p is p . M^-1 f.
+static void setupResolveTri(ResolveTri* t, const grVertexBatch* b, int first, const ResolveTile* tile) {
+	double r[3][3];
+	for (int k = 0; k < 3; k++) {
+		r[k][0] = b->pos[0][first + k];
+		r[k][1] = b->pos[1][first + k];
+		r[k][2] = b->pos[3][first + k];
+	}
+
+	// The columns of M^-1 are the cross products of the rows over the determinant
+	double c[3][3];
+	for (int k = 0; k < 3; k++) {
+		const double* u = r[(k + 1) % 3];
+		const double* v = r[(k + 2) % 3];
+		c[k][0] = u[1] * v[2] - u[2] * v[1];
+		c[k][1] = u[2] * v[0] - u[0] * v[2];
+		c[k][2] = u[0] * v[1] - u[1] * v[0];
+	}
+	double det = r[0][0] * c[0][0] + r[0][1] * c[0][1] + r[0][2] * c[0][2];
+	// Edge on and through the camera, it can't have covered anything anyway
+	if (det == 0) {
+		t->shader = NULL;
+		return;
+	}
+
+	// NDC of the tile's top left pixel centre, and per pixel
+	const grFramebuffer* fb = tile->fb;
+	double sx = 2.0 / fb->width;
+	double sy = -2.0 / fb->height;
+	double nx = (tile->left + 0.5) * sx - 1;
+	double ny = (tile->top + 0.5) * sy + 1;
+
+	// Weights of each vertex's value in each of the planes' terms
+	double e[3], edx[3], edy[3];
+	for (int k = 0; k < 3; k++) {
+		e[k] = (c[k][0] * nx + c[k][1] * ny + c[k][2]) / det;
+		edx[k] = c[k][0] * sx / det;
+		edy[k] = c[k][1] * sy / det;
+	}
+
+#define RESOLVE_PLANE(f0, f1, f2) (Plane) { \
+		(float)((f0) * e[0] + (f1) * e[1] + (f2) * e[2]), \
+		(float)((f0) * edx[0] + (f1) * edx[1] + (f2) * edx[2]), \
+		(float)((f0) * edy[0] + (f1) * edy[1] + (f2) * edy[2]), \
+	}
+	t->z = RESOLVE_PLANE(b->pos[2][first], b->pos[2][first + 1], b->pos[2][first + 2]);
+	t->invW = RESOLVE_PLANE(1.0, 1.0, 1.0);
+	for (int a = 0; a < b->numVaryings; a++) {
+		const float* v = &b->varyings[a][first];
+		t->varyings[a] = RESOLVE_PLANE(v[0], v[1], v[2]);
+	}
+#undef RESOLVE_PLANE
+	t->numVaryings = b->numVaryings;
+}
+
+// Shade the vertices of the tile's triangles, a batch at a time for each instance, and set
+// the triangles up
+static void setupTris(TileScratch* s, const VisibilityFrame* frame) {
+	// Sorting brings each instance's triangles together
+	if (s->numTris > 1) {
+		qsort(s->keys, s->numTris, sizeof(TriKey), compareKeys);
+	}
+
+	grVertexBatch* b = &s->batch;
+	int first = 0;
+	while (first < s->numTris) {
+		const VisibilityInstance* instance = &frame->instances[s->keys[first].key >> 32];
+		int count = 0;
+		while (first + count < s->numTris && count < GR_VERTEX_BATCH_SIZE / 3 && (s->keys[first + count].key >> 32) == (s->keys[first].key >> 32)) {
+			const int* corners = &instance->mesh->indices[(size_t)(uint32_t)s->keys[first + count].key * 3];
+			s->indices[count * 3] = corners[0];
+			s->indices[count * 3 + 1] = corners[1];
+			s->indices[count * 3 + 2] = corners[2];
+			count++;
+		}
+
+		b->count = count * 3;
+		b->indices = s->indices;
+		b->mvp = &instance->mvp;
+		b->model = &instance->model;
+		b->uniforms = instance->vertexUniforms;
+		VertexInput_Shade(&instance->input, b);
+
+		for (int i = 0; i < count; i++) {
+			ResolveTri* t = &s->tris[s->keys[first + i].tri];
+			t->shader = instance->shader;
+			t->raster = &instance->raster;
+			memcpy(t->corners, &s->indices[i * 3], sizeof(t->corners));
+			setupResolveTri(t, b, i * 3, &s->tile);
+		}
+		first += count;
+	}
+}
+
+static void resolveTile(grFramebuffer* fb, const VisibilityFrame* frame, TileScratch* s, int left, int top) {
+	ResolveTile* tile = &s->tile;
+	tile->fb = fb;
+	tile->left = left;
+	tile->top = top;
+	tile->width = min(RESOLVE_TILE_SIZE, fb->width - left);
+	tile->height = min(RESOLVE_TILE_SIZE, fb->height - top);
+	tile->tris = s->tris;
+
+	s->stamp++;
+	s->numTris = 0;
+	// Neighbouring samples are usually the same triangle
+	uint64_t lastKey = UINT64_MAX;
+	int lastTri = RESOLVE_NONE;
+	for (int y = 0; y < tile->height; y++) {
+		const grVisibilitySample (*row)[MSAA_SAMPLES] = &fb->visibility[(top + y) * fb->width + left];
+		for (int x = 0; x < tile->width; x++) {
+			for (int i = 0; i < MSAA_SAMPLES; i++) {
+				// Samples from before the frame are left alone, along with the ones never drawn
+				unsigned int instance = row[x][i].instance - frame->base;
+				if (row[x][i].instance == GR_NO_INSTANCE || instance >= (unsigned int)frame->numInstances) {
+					tile->tri[y * RESOLVE_TILE_SIZE + x][i] = RESOLVE_NONE;
+					continue;
+				}
+
+				uint64_t key = (uint64_t)instance << 32 | row[x][i].triangle;
+				if (key != lastKey) {
+					lastKey = key;
+					lastTri = findTri(s, key);
+				}
+				tile->tri[y * RESOLVE_TILE_SIZE + x][i] = (uint16_t)lastTri;
+			}
+		}
+	}
+	if (s->numTris == 0) {
+		return;
+	}
+
+	setupTris(s, frame);
+
+	// Each shader in the tile shades its own triangles, usually there's only one
+	const grPixelShader* shaders[MAX_TILE_TRIS];
+	int numShaders = 0;
+	for (int k = 0; k < s->numTris; k++) {
+		const grPixelShader* shader = s->tris[k].shader;
+		int j = 0;
+		while (j < numShaders && shaders[j] != shader) {
+			j++;
+		}
+		if (j == numShaders && shader) {
+			shaders[numShaders++] = shader;
+			shader->resolve(tile, shader);
+		}
+	}
+}
+
+void Visibility_Resolve(grDevice* dev, VisibilityFrame* frame) {
+	grFramebuffer* fb = dev->fb;
+
+	if (frame->left <= frame->right) {
+		// Tiles are aligned to the screen, and ordered row by row
+		int tileLeft = frame->left / RESOLVE_TILE_SIZE;
+		int tileTop = frame->top / RESOLVE_TILE_SIZE;
+		int tilesX = frame->right / RESOLVE_TILE_SIZE - tileLeft + 1;
+		int tilesY = frame->bottom / RESOLVE_TILE_SIZE - tileTop + 1;
+		int numTiles = tilesX * tilesY;
+
+		#pragma omp parallel
+		{
+			// Too big for the stack
+			TileScratch* s = xmalloc(sizeof(TileScratch));
+			memset(s->hashStamps, 0, sizeof(s->hashStamps));
+			s->stamp = 0;
+
+			// Tiles take very different times, so they're handed out a few at a time
+			#pragma omp for schedule(dynamic, 4)
+			for (int i = 0; i < numTiles; i++) {
+				int x = (tileLeft + i % tilesX) * RESOLVE_TILE_SIZE;
+				int y = (tileTop + i / tilesX) * RESOLVE_TILE_SIZE;
+				resolveTile(fb, frame, s, x, y);
+			}
+
+			free(s);
+			#pragma omp critical
+			Sampler_FlushStats(&dev->stats);
+		}
+	}
+
+	fb->visibilityInstances = frame->base + frame->numInstances;
+	free(frame->instances);
+	free(frame);
+}
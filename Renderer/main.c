@@ -6,17 +6,15 @@
 
 #include <SDL.h>
 
+#include "util.h"
+
 #include "stb_image.h"
 #include "gr.h"
-
-void* xmalloc(size_t size) {
-	void* p = malloc(size);
-	if (p == NULL) {
-		fprintf(stderr, "Error allocating %zu bytes\n", size);
-		exit(EXIT_FAILURE);
-	}
-	return p;
-}
+#include "gr_atlas.h"
+#include "gr_command.h"
+#include "obj.h"
+#include "assets.h"
+#include "bench.h"
 
 SDL_Window* window;
 SDL_Renderer* renderer;
@@ -29,95 +27,98 @@ rgb* pixels;
 int pitch;
 
 grDevice* device;
+grCommandBuffer* commands;
 
-grMesh mesh;
-
-char texName[1024] = { 0 };
-void loadMesh(const char* path) {
-	// This function has a terminal case of C Programmer's Disease
-	// http://catb.org/jargon/html/C/C-Programmers-Disease.html
+Asset* meshAsset;
+grMesh* mesh;
+grMesh placeholder;
 
-	FILE* f = fopen(path, "r");
-	if (!f) {
-		printf("Unable to open file %s\n", path);
-		exit(EXIT_FAILURE);
+grTexture* makeCheckerTexture(void) {
+	rgb data[8 * 8];
+	for (int i = 0; i < 8; i++) {
+		for (int j = 0; j < 8; j++) {
+			data[i * 8 + j] = ((i ^ j) & 1) ? (rgb) { 255, 0, 255 } : (rgb) { 40, 40, 40 };
+		}
 	}
 
-	char mtllib[1024] = { 0 };
-
-#define LINE_MAX 1024
-	char line[LINE_MAX];
-
-#define MAX_VERTS 2048
-	vec3* verts = malloc(MAX_VERTS * sizeof(vec3));
-	vec2* uvs = malloc(MAX_VERTS * sizeof(vec2));
-	int nverts = 0;
-	int nuvs = 0;
-
-	mesh.verts = malloc(MAX_VERTS * sizeof(grVertex));
-	mesh.indices = malloc(MAX_VERTS * 3 * sizeof(int));
-	mesh.count = 0;
-	int NNN = 0;
-
-	while (fgets(line, LINE_MAX, f)) {
-		vec3 v;
-		vec2 uv;
-
-		int v0, uv0, v1, uv1, v2, uv2;
-
-		// This code has a buffer overrun if the mtllib name is 1023 characters or longer
-		// But for this example it should be fine
-		// scanf sucks, libc sucks
-		if (sscanf(line, "mtllib %s", mtllib) == 1) {
-			FILE* mtlf = fopen(mtllib, "r");
+	grTexture* tex = grTexture_Create(8, 8);
+	grTexture_SetData(tex, data, 8, 8);
+	return tex;
+}
 
-			char line2[LINE_MAX];
-			while (fgets(line2, LINE_MAX, mtlf)) {
-				if (sscanf(line2, "map_Kd %s", texName) == 1) {
+// Point the sub meshes at whichever of their textures have finished loading.
+// The rest keep using the device (placeholder) texture.
+void bindMeshTextures(Asset* asset) {
+	grMesh* m = &asset->model.mesh;
+	for (int i = 0; i < m->numSubMeshes; i++) {
+		Asset* t = asset->textures[i];
+		m->subMeshes[i].tex = Asset_IsReady(t) ? t->tex : NULL;
+	}
+}
 
-				}
-			}
+// Textures no bigger than this are packed into the atlas with -atlas
+#define ATLAS_MAX_TEXTURE_SIZE 256
 
-			fclose(mtlf);
+// The atlas has to be able to hold every texture's components, so an R8 texture packed
+// first doesn't take the colour out of the others
+static grTextureFormat atlasFormat(grTexture* const* textures, int count) {
+	grTextureFormat format = textures[0]->format;
+	for (int i = 1; i < count; i++) {
+		if (grTextureFormat_Components(textures[i]->format) > grTextureFormat_Components(format)) {
+			format = textures[i]->format;
 		}
-		else if (sscanf(line, "v %f %f %f", &v.x, &v.y, &v.z)) {
-			if (nverts == MAX_VERTS) {
-				printf("Too many vertices\n");
-				exit(EXIT_FAILURE);
-			}
+	}
+	return format;
+}
 
-			verts[nverts++] = v;
+// Pack the mesh's small textures into one atlas, so the sub meshes using them are drawn
+// in fewer batches. Returns false if some of its textures are still loading.
+bool atlasMeshTextures(Asset* asset) {
+	grMesh* m = &asset->model.mesh;
+	grTexture** textures = xmalloc(max(m->numSubMeshes, 1) * sizeof(grTexture*));
+	int count = 0;
+
+	for (int i = 0; i < m->numSubMeshes; i++) {
+		if (asset->textures[i] && Asset_GetState(asset->textures[i]) == ASSET_LOADING) {
+			free(textures);
+			return false;
 		}
-		else if (sscanf(line, "vt %f %f", &uv.x, &uv.y)) {
-			if (nuvs == MAX_VERTS) {
-				printf("Too many vertices\n");
-				exit(EXIT_FAILURE);
-			}
 
-			uv.y = 1 - uv.y;
-			uvs[nuvs++] = uv;
+		// Streamed textures don't have their top level to pack
+		grTexture* tex = m->subMeshes[i].tex;
+		bool seen = false;
+		for (int j = 0; j < count; j++) {
+			seen = seen || textures[j] == tex;
 		}
-		else if (sscanf(line, "f %d/%d %d/%d %d/%d", &v0, &uv0, &v1, &uv1, &v2, &uv2)) {
-			mesh.verts[NNN] = (grVertex){ verts[v0 - 1], uvs[uv0 - 1] };
-			mesh.indices[NNN] = NNN++;
-
-			mesh.verts[NNN] = (grVertex){ verts[v2 - 1], uvs[uv2 - 1] };
-			mesh.indices[NNN] = NNN++;
-			
-			mesh.verts[NNN] = (grVertex){ verts[v1 - 1], uvs[uv1 - 1] };
-			mesh.indices[NNN] = NNN++;
+		if (tex && !seen && tex->residentLevel == 0 &&
+			tex->width <= ATLAS_MAX_TEXTURE_SIZE && tex->height <= ATLAS_MAX_TEXTURE_SIZE) {
+			textures[count++] = tex;
+		}
+	}
 
-			mesh.count++;
+	if (count >= 2) {
+		grAtlasRegion* regions = xmalloc(count * sizeof(grAtlasRegion));
+		grTexture* atlas = grAtlas_Build(textures, count, atlasFormat(textures, count), 8, 4096, regions);
+		if (atlas) {
+			int moved = grAtlas_RemapMesh(m, atlas, textures, regions, count);
+			printf("Packed %d textures into a %dx%d atlas, %d of %d sub meshes use it\n",
+				count, atlas->width, atlas->height, moved, m->numSubMeshes);
 		}
+		free(regions);
 	}
 
-	fclose(f);
+	free(textures);
+	return true;
 }
 
 void render() {
-	grClear(device, (rgb) { 255, 255, 255 });
-
-	grDraw(device, &mesh);
+	grCommandBuffer_Reset(commands);
+	grCommandBuffer_Clear(commands, (rgb) { 255, 255, 255 });
+	grCommandBuffer_SetCamera(commands, &device->proj, &device->view);
+	grCommandBuffer_SetTexture(commands, device->tex);
+	grCommandBuffer_SetShader(commands, device->shader, device->uniforms);
+	grCommandBuffer_Draw(commands, mesh, &mesh->modelMat);
+	grDevice_Execute(device, &commands, 1);
 
 	grFramebuffer* fb = device->fb;
 
@@ -143,10 +144,10 @@ void render() {
 }
 
 grVertex PLANE_VERTS[4] = {
-	{{-1, 0, -1}, {0, 1}},
-	{{1, 0, -1} , {1, 1}},
-	{{1, 0, 1}, {1, 0}},
-	{{-1, 0, 1}, {0, 0}}
+	{{-1, 0, -1}, {0, 1}, {0, 1, 0}},
+	{{1, 0, -1} , {1, 1}, {0, 1, 0}},
+	{{1, 0, 1}, {1, 0}, {0, 1, 0}},
+	{{-1, 0, 1}, {0, 0}, {0, 1, 0}}
 };
 
 int PLANE_INDICES[6] = {
@@ -157,6 +158,52 @@ int PLANE_INDICES[6] = {
 int frame = 0;
 
 int main(int argc, char** argv) {
+	// Renderer -convert in.obj out.grm [memory budget in MB]
+	// Converts huge OBJs to the binary format with bounded memory use
+	if (argc >= 4 && strcmp(argv[1], "-convert") == 0) {
+		size_t budget = argc >= 5 ? (size_t)atoi(argv[4]) << 20 : 64 << 20;
+		return objConvert(argv[2], argv[3], budget) ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	// Renderer -bench [name]
+	if (argc >= 2 && strcmp(argv[1], "-bench") == 0) {
+		return Bench_Run(argc - 2, argv + 2);
+	}
+
+	// Renderer [-bc] [-budget MB] [-atlas] [-lit] [-vis] [mesh.obj|mesh.grm]
+	// -bc block compresses the textures as they load
+	// -budget streams texture mip levels in and out to keep them under a memory budget
+	// -atlas packs the mesh's small textures into an atlas once they have loaded
+	// -lit lights the mesh with GR_SHADER_LIT
+	// -vis draws with a visibility buffer
+	bool compressTextures = false;
+	bool atlasTextures = false;
+	bool lit = false;
+	bool visibilityBuffer = false;
+	size_t textureBudget = 0;
+	while (argc >= 2 && argv[1][0] == '-') {
+		if (strcmp(argv[1], "-bc") == 0) {
+			compressTextures = true;
+		}
+		else if (strcmp(argv[1], "-atlas") == 0) {
+			atlasTextures = true;
+		}
+		else if (strcmp(argv[1], "-lit") == 0) {
+			lit = true;
+		}
+		else if (strcmp(argv[1], "-vis") == 0) {
+			visibilityBuffer = true;
+		}
+		else if (strcmp(argv[1], "-budget") == 0 && argc >= 3) {
+			textureBudget = (size_t)atoi(argv[2]) << 20;
+			argc--;
+			argv++;
+		}
+		argc--;
+		argv++;
+	}
+	const char* meshPath = argc >= 2 ? argv[1] : "cactus.obj";
+
 	SDL_Init(SDL_INIT_EVERYTHING);
 
 	window = SDL_CreateWindow("Window", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, screenWidth, screenHeight, 0);
@@ -166,23 +213,38 @@ int main(int argc, char** argv) {
 
 	device = grDevice_Create();
 	device->fb = grFramebuffer_Create(screenWidth, screenHeight);
+	device->visibilityBuffer = visibilityBuffer;
+	commands = grCommandBuffer_Create();
 
 	device->proj = mat4_perspective(deg2rad(90), (float)screenWidth / screenHeight, 0.1f, 100);
 	device->view = mat4_lookat((vec3) { 0, -3, 4 }, (vec3) { 0, 0, 0 }, (vec3) { 0, 1, 0 });
 
-	loadMesh("cactus.obj");
-	/*mesh.verts = PLANE_VERTS;
-	mesh.indices = PLANE_INDICES;
-	mesh.count = 2;*/
-	mesh.modelMat = mat4_identity();
-
-	int tw;
-	int th;
-	int comp;
-	rgb* texData = stbi_load(texName, &tw, &th, &comp, 3);
-	device->tex = grTexture_Create(tw, th);
-	grTexture_SetData(device->tex, texData, tw, th);
+	// Start loading straight away and draw a placeholder until everything is ready,
+	// so the first frame doesn't wait on disk IO, decoding or mip generation
+	Uint64 startTime = SDL_GetPerformanceCounter();
+	Assets_Init(0);
+	Assets_SetTextureCompression(compressTextures);
+	Assets_SetTextureBudget(textureBudget);
+	meshAsset = Assets_LoadMesh(meshPath);
+
+	placeholder.verts = PLANE_VERTS;
+	placeholder.numVerts = 4;
+	placeholder.indices = PLANE_INDICES;
+	placeholder.count = 2;
+	placeholder.modelMat = mat4_identity();
+	mesh = &placeholder;
+
+	// Materials without a texture (or whose texture is still loading) use the device texture
+	device->tex = makeCheckerTexture();
+
+	grLightUniforms light = { { 0, 0, 0 }, 0.25f };
+	if (lit) {
+		device->shader = &GR_SHADER_LIT;
+		device->uniforms = &light;
+		placeholder.format = &GR_VERTEX_FORMAT_LIT;
+	}
 
+	bool meshAtlased = false;
 	bool running = true;
 	while (running) {
 		SDL_Event e;
@@ -192,17 +254,34 @@ int main(int argc, char** argv) {
 			}
 		}
 
+		if (mesh == &placeholder && Asset_GetState(meshAsset) == ASSET_READY) {
+			mesh = &meshAsset->model.mesh;
+			mesh->format = placeholder.format;
+			printf("Mesh ready after %.1f ms\n", (SDL_GetPerformanceCounter() - startTime) * 1000.0 / SDL_GetPerformanceFrequency());
+		}
+		// Once the atlas has been built the sub meshes keep the textures they have
+		if (mesh != &placeholder && !meshAtlased) {
+			bindMeshTextures(meshAsset);
+			meshAtlased = atlasTextures && atlasMeshTextures(meshAsset);
+		}
+
 		SDL_LockTexture(texture, NULL, (void**)&pixels, &pitch);
 
 		float T = frame / 60.0f;
-		mesh.modelMat = mat4_rotate_zyx(0, T, 0);
+		mesh->modelMat = mat4_rotate_zyx(0, T, 0);
 		//mat4 tr = mat4_translate((vec3) { 0, -10, 5*(1-sinf(T))+1 });
 		mat4 tr = mat4_translate((vec3) { 0, -1, 0 });
 		mat4 scaleMat = mat4_scale((vec3) {10, 1, 10});
 		//tr = mat4_mul(&tr, &scaleMat);
-		mesh.modelMat = mat4_mul(&tr, &mesh.modelMat);
+		mesh->modelMat = mat4_mul(&tr, &mesh->modelMat);
+
+		// The light stays put while the mesh turns, so it turns the other way in model space
+		mat4 unrotate = mat4_rotate_zyx(0, -T, 0);
+		vec4 lightDir = mat4_mul_vec4(&unrotate, (vec4) { 0.5f, 1, 0.8f, 0 });
+		light.direction = vec3_normalize((vec3) { lightDir.x, lightDir.y, lightDir.z });
 
 		render();
+		Assets_UpdateTextures();
 
 		SDL_UnlockTexture(texture);
 
@@ -210,8 +289,14 @@ int main(int argc, char** argv) {
 		SDL_RenderCopy(renderer, texture, NULL, NULL);
 		SDL_RenderPresent(renderer);
 
+		if (frame == 0) {
+			printf("First frame after %.1f ms\n", (SDL_GetPerformanceCounter() - startTime) * 1000.0 / SDL_GetPerformanceFrequency());
+		}
+
 		frame++;
 	}
 
+	Assets_Shutdown();
+
 	return 0;
 }
@@ -0,0 +1,962 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "util.h"
+
+#include "obj.h"
+
+#define OBJ_LINE_MAX 4096
+
+typedef struct {
+	int v;
+	int vt;
+	int vn;
+} Corner;
+
+// Resolve rel relative to the directory containing base
+static void joinPath(char* out, size_t size, const char* base, const char* rel) {
+	const char* slash = strrchr(base, '/');
+	const char* backslash = strrchr(base, '\\');
+	if (backslash > slash) slash = backslash;
+
+	if (slash == NULL || rel[0] == '/' || rel[0] == '\\' || strchr(rel, ':')) {
+		snprintf(out, size, "%s", rel);
+	}
+	else {
+		snprintf(out, size, "%.*s%s", (int)(slash - base + 1), base, rel);
+	}
+}
+
+static void trimEnd(char* s) {
+	size_t n = strlen(s);
+	while (n > 0 && (s[n - 1] == '\n' || s[n - 1] == '\r' || s[n - 1] == ' ' || s[n - 1] == '\t')) {
+		s[--n] = 0;
+	}
+}
+
+// Split off the next whitespace separated token, or return NULL if there isn't one.
+// strtok isn't usable because meshes are loaded from several threads at once.
+static char* nextToken(char** s) {
+	char* p = *s;
+	while (*p == ' ' || *p == '\t') p++;
+	if (*p == 0) {
+		return NULL;
+	}
+
+	char* token = p;
+	while (*p && *p != ' ' && *p != '\t') p++;
+	if (*p) {
+		*p++ = 0;
+	}
+	*s = p;
+	return token;
+}
+
+static int findMaterial(objModel* model, const char* name) {
+	for (int i = 0; i < model->numMaterials; i++) {
+		if (strcmp(model->materials[i].name, name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int addMaterial(objModel* model, int* capacity, const char* name) {
+	model->materials = grow(model->materials, capacity, model->numMaterials, sizeof(objMaterial));
+	objMaterial* m = &model->materials[model->numMaterials];
+	memset(m, 0, sizeof(objMaterial));
+	snprintf(m->name, sizeof(m->name), "%s", name);
+	return model->numMaterials++;
+}
+
+static void loadMtl(objModel* model, int* capacity, const char* path) {
+	FILE* f = fopen(path, "r");
+	if (!f) {
+		printf("Unable to open material library %s\n", path);
+		return;
+	}
+
+	char line[OBJ_LINE_MAX];
+	objMaterial* current = NULL;
+
+	while (fgets(line, OBJ_LINE_MAX, f)) {
+		trimEnd(line);
+		char* p = line;
+		while (*p == ' ' || *p == '\t') p++;
+
+		if (strncmp(p, "newmtl ", 7) == 0) {
+			int i = findMaterial(model, p + 7);
+			if (i < 0) {
+				i = addMaterial(model, capacity, p + 7);
+			}
+			current = &model->materials[i];
+		}
+		else if (strncmp(p, "map_Kd ", 7) == 0 && current) {
+			// Options like -s or -bm come before the file name, so take the last token
+			char* name = strrchr(p, ' ');
+			char* tab = strrchr(p, '\t');
+			if (tab > name) name = tab;
+			joinPath(current->diffuseMap, sizeof(current->diffuseMap), path, name + 1);
+		}
+	}
+
+	fclose(f);
+}
+
+// Convert a 1 based (or negative, relative to the end) OBJ index to a 0 based one
+static int resolveIndex(int i, int count) {
+	if (i < 0) {
+		return count + i;
+	}
+	return i - 1;
+}
+
+// Parses "v", "v/vt", "v//vn" or "v/vt/vn". Missing parts are set to -1.
+static bool parseCorner(char** s, Corner* c, int nverts, int nuvs, int nnormals) {
+	char* p = *s;
+	char* end;
+
+	c->v = resolveIndex(strtol(p, &end, 10), nverts);
+	c->vt = -1;
+	c->vn = -1;
+	if (end == p || c->v < 0 || c->v >= nverts) {
+		return false;
+	}
+	p = end;
+
+	if (*p == '/') {
+		p++;
+		if (*p != '/') {
+			c->vt = resolveIndex(strtol(p, &end, 10), nuvs);
+			if (end == p || c->vt < 0 || c->vt >= nuvs) {
+				return false;
+			}
+			p = end;
+		}
+		if (*p == '/') {
+			p++;
+			c->vn = resolveIndex(strtol(p, &end, 10), nnormals);
+			if (end == p || c->vn < 0 || c->vn >= nnormals) {
+				return false;
+			}
+			p = end;
+		}
+	}
+
+	*s = p;
+	return true;
+}
+
+// Hash table mapping v/vt/vn triples to output vertices, so shared corners share vertices
+typedef struct {
+	Corner* keys;
+	int* values;
+	int size;
+	int count;
+} CornerMap;
+
+static uint32_t hashCorner(Corner c) {
+	uint32_t h = (uint32_t)c.v * 73856093u ^ (uint32_t)c.vt * 19349663u ^ (uint32_t)c.vn * 83492791u;
+	return h ^ (h >> 16);
+}
+
+static void cornerMap_Init(CornerMap* map, int size) {
+	map->size = size;
+	map->count = 0;
+	map->keys = xmalloc(size * sizeof(Corner));
+	map->values = xmalloc(size * sizeof(int));
+	for (int i = 0; i < size; i++) {
+		map->values[i] = -1;
+	}
+}
+
+static int* cornerMap_Find(CornerMap* map, Corner c) {
+	uint32_t slot = hashCorner(c) & (map->size - 1);
+	while (map->values[slot] != -1) {
+		Corner k = map->keys[slot];
+		if (k.v == c.v && k.vt == c.vt && k.vn == c.vn) {
+			break;
+		}
+		slot = (slot + 1) & (map->size - 1);
+	}
+	map->keys[slot] = c;
+	return &map->values[slot];
+}
+
+static void cornerMap_Grow(CornerMap* map) {
+	CornerMap bigger;
+	cornerMap_Init(&bigger, map->size * 2);
+	for (int i = 0; i < map->size; i++) {
+		if (map->values[i] != -1) {
+			*cornerMap_Find(&bigger, map->keys[i]) = map->values[i];
+		}
+	}
+	bigger.count = map->count;
+
+	free(map->keys);
+	free(map->values);
+	*map = bigger;
+}
+
+bool objLoad(objModel* model, const char* path) {
+	memset(model, 0, sizeof(objModel));
+
+	FILE* f = fopen(path, "r");
+	if (!f) {
+		printf("Unable to open file %s\n", path);
+		return false;
+	}
+
+	vec3* verts = NULL;
+	vec2* uvs = NULL;
+	vec3* normals = NULL;
+	int nverts = 0, nuvs = 0, nnormals = 0;
+	int vertsCap = 0, uvsCap = 0, normalsCap = 0;
+
+	grMesh* mesh = &model->mesh;
+	int outVertsCap = 0;
+	int indicesCap = 0;
+	int* triMaterials = NULL;
+	int triMaterialsCap = 0;
+	int materialsCap = 0;
+	int currentMaterial = -1;
+
+	CornerMap map;
+	cornerMap_Init(&map, 1024);
+
+	Corner* poly = NULL;
+	int polyCap = 0;
+
+	char line[OBJ_LINE_MAX];
+	int lineNumber = 0;
+	bool ok = true;
+
+	while (fgets(line, OBJ_LINE_MAX, f)) {
+		lineNumber++;
+		trimEnd(line);
+
+		char* p = line;
+		while (*p == ' ' || *p == '\t') p++;
+
+		if (strncmp(p, "v ", 2) == 0) {
+			verts = grow(verts, &vertsCap, nverts, sizeof(vec3));
+			vec3* v = &verts[nverts++];
+			*v = (vec3){ 0, 0, 0 };
+			sscanf(p + 2, "%f %f %f", &v->x, &v->y, &v->z);
+		}
+		else if (strncmp(p, "vt ", 3) == 0) {
+			uvs = grow(uvs, &uvsCap, nuvs, sizeof(vec2));
+			vec2* uv = &uvs[nuvs++];
+			*uv = (vec2){ 0, 0 };
+			sscanf(p + 3, "%f %f", &uv->x, &uv->y);
+			uv->y = 1 - uv->y;
+		}
+		else if (strncmp(p, "vn ", 3) == 0) {
+			normals = grow(normals, &normalsCap, nnormals, sizeof(vec3));
+			vec3* n = &normals[nnormals++];
+			*n = (vec3){ 0, 0, 0 };
+			sscanf(p + 3, "%f %f %f", &n->x, &n->y, &n->z);
+		}
+		else if (strncmp(p, "f ", 2) == 0) {
+			if (currentMaterial < 0) {
+				// Faces before any usemtl get a default material
+				currentMaterial = findMaterial(model, "");
+				if (currentMaterial < 0) {
+					currentMaterial = addMaterial(model, &materialsCap, "");
+				}
+			}
+
+			int n = 0;
+			p += 2;
+			while (true) {
+				while (*p == ' ' || *p == '\t') p++;
+				if (*p == 0) break;
+
+				poly = grow(poly, &polyCap, n, sizeof(Corner));
+				if (!parseCorner(&p, &poly[n++], nverts, nuvs, nnormals)) {
+					printf("%s:%d: Invalid face\n", path, lineNumber);
+					ok = false;
+					break;
+				}
+			}
+			if (!ok) break;
+			if (n < 3) continue;
+
+			// Map each corner to an output vertex
+			for (int i = 0; i < n; i++) {
+				if (map.count * 2 >= map.size) {
+					cornerMap_Grow(&map);
+				}
+
+				int* index = cornerMap_Find(&map, poly[i]);
+				if (*index == -1) {
+					*index = mesh->numVerts;
+					map.count++;
+
+					mesh->verts = grow(mesh->verts, &outVertsCap, mesh->numVerts, sizeof(grVertex));
+					grVertex* v = &mesh->verts[mesh->numVerts++];
+					v->pos = verts[poly[i].v];
+					v->uv = poly[i].vt >= 0 ? uvs[poly[i].vt] : (vec2) { 0, 0 };
+					v->normal = poly[i].vn >= 0 ? normals[poly[i].vn] : (vec3) { 0, 0, 0 };
+				}
+
+				// Reuse the corner array to hold output vertex indices
+				poly[i].v = *index;
+			}
+
+			// Fan triangulation. The winding is flipped because the y axis is flipped
+			// when converting to screen space.
+			for (int i = 1; i < n - 1; i++) {
+				mesh->indices = grow(mesh->indices, &indicesCap, mesh->count * 3 + 2, sizeof(int));
+				mesh->indices[mesh->count * 3 + 0] = poly[0].v;
+				mesh->indices[mesh->count * 3 + 1] = poly[i + 1].v;
+				mesh->indices[mesh->count * 3 + 2] = poly[i].v;
+
+				triMaterials = grow(triMaterials, &triMaterialsCap, mesh->count, sizeof(int));
+				triMaterials[mesh->count] = currentMaterial;
+				mesh->count++;
+			}
+		}
+		else if (strncmp(p, "usemtl ", 7) == 0) {
+			currentMaterial = findMaterial(model, p + 7);
+			if (currentMaterial < 0) {
+				currentMaterial = addMaterial(model, &materialsCap, p + 7);
+			}
+		}
+		else if (strncmp(p, "mtllib ", 7) == 0) {
+			// There can be more than one library on the line
+			char* rest = p + 7;
+			char* name;
+			while ((name = nextToken(&rest))) {
+				char mtlPath[1024];
+				joinPath(mtlPath, sizeof(mtlPath), path, name);
+				loadMtl(model, &materialsCap, mtlPath);
+			}
+		}
+	}
+
+	fclose(f);
+
+	if (ok) {
+		// Counting sort the triangles by material so each material is one contiguous batch
+		mesh->numSubMeshes = model->numMaterials;
+		mesh->subMeshes = xmalloc(max(model->numMaterials, 1) * sizeof(grSubMesh));
+		for (int i = 0; i < model->numMaterials; i++) {
+			mesh->subMeshes[i] = (grSubMesh){ 0, 0, NULL };
+		}
+		for (int i = 0; i < mesh->count; i++) {
+			mesh->subMeshes[triMaterials[i]].count++;
+		}
+		int first = 0;
+		for (int i = 0; i < model->numMaterials; i++) {
+			mesh->subMeshes[i].first = first;
+			first += mesh->subMeshes[i].count;
+		}
+
+		int* sorted = xmalloc(max(mesh->count, 1) * 3 * sizeof(int));
+		int* fill = xmalloc(max(model->numMaterials, 1) * sizeof(int));
+		for (int i = 0; i < model->numMaterials; i++) {
+			fill[i] = mesh->subMeshes[i].first;
+		}
+		for (int i = 0; i < mesh->count; i++) {
+			int t = fill[triMaterials[i]]++;
+			memcpy(&sorted[t * 3], &mesh->indices[i * 3], 3 * sizeof(int));
+		}
+		free(fill);
+		free(mesh->indices);
+		mesh->indices = sorted;
+	}
+
+	free(poly);
+	free(map.keys);
+	free(map.values);
+	free(triMaterials);
+	free(normals);
+	free(uvs);
+	free(verts);
+
+	if (!ok) {
+		objFree(model);
+		return false;
+	}
+
+	mesh->modelMat = mat4_identity();
+	return true;
+}
+
+void objFree(objModel* model) {
+	free(model->mesh.verts);
+	free(model->mesh.indices);
+	free(model->mesh.subMeshes);
+	free(model->materials);
+	memset(model, 0, sizeof(objModel));
+}
+
+// Streaming conversion to the binary mesh format
+//
+// The OBJ is read twice through a fixed size window. The first pass copies the
+// v/vt/vn records to temporary files and counts triangles per material, which fixes
+// where every sub mesh's indices go in the output. The second pass resolves face
+// corners through a small page cache over the temporary files and writes indices
+// straight to their final place in the output file. Vertices are deduplicated with a
+// bounded (lossy) cache rather than a full hash table, so some shared corners may be
+// duplicated, which is harmless.
+//
+// Binary layout:
+//   BinaryHeader
+//   objMaterial[numMaterials]
+//   int counts[numMaterials] (triangles per material, in order)
+//   int indices[numTris * 3]
+//   grVertex verts[numVerts]
+
+#define BINARY_MAGIC "GRMESH1"
+
+typedef struct {
+	char magic[8];
+	int numVerts;
+	int numTris;
+	int numMaterials;
+} BinaryHeader;
+
+typedef struct {
+	FILE* f;
+	char* buffer;
+	size_t size;
+	size_t start;
+	size_t end;
+	bool eof;
+	bool skip; // Discarding the rest of an overlong line
+} LineReader;
+
+static void lineReader_Init(LineReader* r, FILE* f, char* buffer, size_t size) {
+	r->f = f;
+	r->buffer = buffer;
+	r->size = size;
+	r->start = 0;
+	r->end = 0;
+	r->eof = false;
+	r->skip = false;
+}
+
+// Returns the next line (without the newline) or NULL at the end of the file.
+// Lines longer than the window are truncated.
+static char* lineReader_Next(LineReader* r) {
+	while (true) {
+		char* nl = memchr(r->buffer + r->start, '\n', r->end - r->start);
+		if (r->skip) {
+			if (nl) {
+				r->start = nl - r->buffer + 1;
+				r->skip = false;
+				continue;
+			}
+			r->start = r->end;
+		}
+		else if (nl) {
+			*nl = 0;
+			char* line = r->buffer + r->start;
+			r->start = nl - r->buffer + 1;
+			return line;
+		}
+
+		if (r->eof) {
+			if (r->start == r->end) {
+				return NULL;
+			}
+			// Last line without a newline
+			r->buffer[r->end] = 0;
+			char* line = r->buffer + r->start;
+			r->start = r->end;
+			return line;
+		}
+
+		// Move the partial line to the front and refill the window
+		size_t partial = r->end - r->start;
+		if (partial == r->size - 1) {
+			// The window is full without a newline
+			r->buffer[r->end] = 0;
+			r->start = r->end;
+			r->skip = true;
+			return r->buffer;
+		}
+		memmove(r->buffer, r->buffer + r->start, partial);
+		r->start = 0;
+		r->end = partial;
+
+		size_t n = fread(r->buffer + r->end, 1, r->size - 1 - r->end, r->f);
+		r->end += n;
+		if (n == 0) {
+			r->eof = true;
+		}
+	}
+}
+
+// Cache of fixed size pages from the temporary attribute files
+#define PAGE_RECORDS 4096
+
+typedef struct {
+	FILE* files[3];
+	int recordSize[3];
+	int numRecords[3];
+	int* tags; // file * 2^28 + page, or -1
+	char* data;
+	int numPages;
+	size_t pageSize;
+	long long hits;
+	long long misses;
+	bool failed; // A page couldn't be read, the data returned since then is garbage
+} PageCache;
+
+static const void* pageCache_Get(PageCache* c, int file, int index) {
+	int page = index / PAGE_RECORDS;
+	int tag = (file << 28) | page;
+	int slot = (int)(((uint32_t)tag * 2654435761u) % c->numPages);
+	char* data = c->data + slot * c->pageSize;
+
+	if (c->tags[slot] != tag) {
+		c->misses++;
+		// The last page of a file is usually only partly there
+		size_t records = (size_t)min(c->numRecords[file] - page * PAGE_RECORDS, PAGE_RECORDS);
+		FILE* f = c->files[file];
+		if (fseek64(f, (long long)page * PAGE_RECORDS * c->recordSize[file], SEEK_SET) != 0 ||
+			fread(data, c->recordSize[file], records, f) != records) {
+			c->failed = true;
+			c->tags[slot] = -1;
+			return data;
+		}
+		c->tags[slot] = tag;
+	}
+	else {
+		c->hits++;
+	}
+
+	return data + (index % PAGE_RECORDS) * c->recordSize[file];
+}
+
+// Buffered writer for one material's index range in the output file
+typedef struct {
+	long long offset; // Where the next flush goes
+	int* buffer;
+	int count;
+} IndexWriter;
+
+static bool indexWriter_Flush(IndexWriter* w, FILE* out) {
+	if (w->count == 0) {
+		return true;
+	}
+	bool ok = fseek64(out, w->offset, SEEK_SET) == 0 && fwrite(w->buffer, sizeof(int), w->count, out) == (size_t)w->count;
+	w->offset += w->count * sizeof(int);
+	w->count = 0;
+	return ok;
+}
+
+// Temporary files fill up the disk first when converting something big
+static bool checkTemp(FILE* f, const char* path) {
+	if (fflush(f) != 0 || ferror(f)) {
+		printf("Error writing temporary file %s\n", path);
+		return false;
+	}
+	return true;
+}
+
+static FILE* openTemp(char* path, size_t size, const char* outPath, const char* suffix) {
+	snprintf(path, size, "%s.%s.tmp", outPath, suffix);
+	FILE* f = fopen(path, "w+b");
+	if (!f) {
+		printf("Unable to create temporary file %s\n", path);
+	}
+	return f;
+}
+
+bool objConvert(const char* objPath, const char* outPath, size_t memoryBudget) {
+	if (memoryBudget < OBJ_MIN_MEMORY_BUDGET) {
+		memoryBudget = OBJ_MIN_MEMORY_BUDGET;
+	}
+
+	FILE* f = fopen(objPath, "rb");
+	if (!f) {
+		printf("Unable to open file %s\n", objPath);
+		return false;
+	}
+
+	// The budget is split between the read window, the attribute page cache,
+	// the vertex dedupe cache and the per material index buffers
+	size_t windowSize = memoryBudget / 8;
+	size_t cacheBytes = memoryBudget / 2;
+	size_t dedupeBytes = memoryBudget / 4;
+	size_t writerBytes = memoryBudget / 8;
+
+	char* window = xmalloc(windowSize);
+	LineReader reader;
+
+	char tempPaths[4][1100];
+	FILE* attribs[3] = {
+		openTemp(tempPaths[0], sizeof(tempPaths[0]), outPath, "v"),
+		openTemp(tempPaths[1], sizeof(tempPaths[1]), outPath, "vt"),
+		openTemp(tempPaths[2], sizeof(tempPaths[2]), outPath, "vn"),
+	};
+	FILE* vertsFile = openTemp(tempPaths[3], sizeof(tempPaths[3]), outPath, "verts");
+	FILE* out = fopen(outPath, "w+b");
+
+	objModel model;
+	memset(&model, 0, sizeof(model));
+	int materialsCap = 0;
+	int* counts = NULL;
+	int countsCap = 0;
+	bool ok = attribs[0] && attribs[1] && attribs[2] && vertsFile && out;
+
+	if (!out) {
+		printf("Unable to create %s\n", outPath);
+	}
+
+	// First pass: spill attributes to disk and count triangles per material
+	int nverts = 0, nuvs = 0, nnormals = 0;
+	int currentMaterial = -1;
+	long long numTris = 0;
+
+	lineReader_Init(&reader, f, window, windowSize);
+	char* line;
+	while (ok && (line = lineReader_Next(&reader))) {
+		trimEnd(line);
+		char* p = line;
+		while (*p == ' ' || *p == '\t') p++;
+
+		if (strncmp(p, "v ", 2) == 0) {
+			vec3 v = { 0, 0, 0 };
+			sscanf(p + 2, "%f %f %f", &v.x, &v.y, &v.z);
+			fwrite(&v, sizeof(v), 1, attribs[0]);
+			nverts++;
+		}
+		else if (strncmp(p, "vt ", 3) == 0) {
+			vec2 uv = { 0, 0 };
+			sscanf(p + 3, "%f %f", &uv.x, &uv.y);
+			uv.y = 1 - uv.y;
+			fwrite(&uv, sizeof(uv), 1, attribs[1]);
+			nuvs++;
+		}
+		else if (strncmp(p, "vn ", 3) == 0) {
+			vec3 n = { 0, 0, 0 };
+			sscanf(p + 3, "%f %f %f", &n.x, &n.y, &n.z);
+			fwrite(&n, sizeof(n), 1, attribs[2]);
+			nnormals++;
+		}
+		else if (strncmp(p, "f ", 2) == 0) {
+			if (currentMaterial < 0) {
+				currentMaterial = findMaterial(&model, "");
+				if (currentMaterial < 0) {
+					currentMaterial = addMaterial(&model, &materialsCap, "");
+				}
+			}
+
+			int n = 0;
+			p += 2;
+			while (true) {
+				while (*p == ' ' || *p == '\t') p++;
+				if (*p == 0) break;
+				while (*p && *p != ' ' && *p != '\t') p++;
+				n++;
+			}
+
+			if (n >= 3) {
+				while (countsCap <= currentMaterial) {
+					int old = countsCap;
+					counts = grow(counts, &countsCap, countsCap, sizeof(int));
+					memset(&counts[old], 0, (countsCap - old) * sizeof(int));
+				}
+				counts[currentMaterial] += n - 2;
+				numTris += n - 2;
+			}
+		}
+		else if (strncmp(p, "usemtl ", 7) == 0) {
+			currentMaterial = findMaterial(&model, p + 7);
+			if (currentMaterial < 0) {
+				currentMaterial = addMaterial(&model, &materialsCap, p + 7);
+			}
+		}
+		else if (strncmp(p, "mtllib ", 7) == 0) {
+			char* rest = p + 7;
+			char* name;
+			while ((name = nextToken(&rest))) {
+				char mtlPath[1024];
+				joinPath(mtlPath, sizeof(mtlPath), objPath, name);
+				loadMtl(&model, &materialsCap, mtlPath);
+			}
+		}
+	}
+
+	if (numTris * 3 > 0x7fffffff) {
+		printf("%s has too many triangles\n", objPath);
+		ok = false;
+	}
+
+	// Materials that were declared but never used still need a count
+	while (countsCap < model.numMaterials) {
+		int old = countsCap;
+		counts = grow(counts, &countsCap, countsCap, sizeof(int));
+		memset(&counts[old], 0, (countsCap - old) * sizeof(int));
+	}
+
+	long long indicesOffset = sizeof(BinaryHeader) + model.numMaterials * (sizeof(objMaterial) + sizeof(int));
+
+	// Second pass: resolve faces and write vertices and indices
+	PageCache cache = { { attribs[0], attribs[1], attribs[2] }, { sizeof(vec3), sizeof(vec2), sizeof(vec3) }, { nverts, nuvs, nnormals } };
+	cache.pageSize = PAGE_RECORDS * sizeof(vec3);
+	cache.numPages = max((int)(cacheBytes / (cache.pageSize + sizeof(int))), 1);
+	cache.data = xmalloc(cache.numPages * cache.pageSize);
+	cache.tags = xmalloc(cache.numPages * sizeof(int));
+	for (int i = 0; i < cache.numPages; i++) {
+		cache.tags[i] = -1;
+	}
+
+	int dedupeSize = max((int)(dedupeBytes / (sizeof(Corner) + sizeof(int))), 1);
+	Corner* dedupeKeys = xmalloc(dedupeSize * sizeof(Corner));
+	int* dedupeValues = xmalloc(dedupeSize * sizeof(int));
+	for (int i = 0; i < dedupeSize; i++) {
+		dedupeValues[i] = -1;
+	}
+
+	int numWriters = max(model.numMaterials, 1);
+	int writerCapacity = max((int)(writerBytes / numWriters / sizeof(int)) / 3 * 3, 48);
+	IndexWriter* writers = xmalloc(numWriters * sizeof(IndexWriter));
+	int* writerBuffers = xmalloc((size_t)numWriters * writerCapacity * sizeof(int));
+	long long offset = indicesOffset;
+	for (int i = 0; i < model.numMaterials; i++) {
+		writers[i] = (IndexWriter){ offset, &writerBuffers[(size_t)i * writerCapacity], 0 };
+		offset += (long long)counts[i] * 3 * sizeof(int);
+	}
+
+	for (int i = 0; i < 3 && ok; i++) {
+		ok = checkTemp(attribs[i], tempPaths[i]);
+	}
+
+	int numVerts = 0;
+	int seenVerts = 0, seenUvs = 0, seenNormals = 0;
+	int lineNumber = 0;
+	Corner* poly = NULL;
+	int polyCap = 0;
+	currentMaterial = -1;
+
+	if (ok) {
+		rewind(f);
+		lineReader_Init(&reader, f, window, windowSize);
+	}
+	while (ok && (line = lineReader_Next(&reader))) {
+		lineNumber++;
+		trimEnd(line);
+		char* p = line;
+		while (*p == ' ' || *p == '\t') p++;
+
+		// Relative indices refer to the attributes declared so far
+		if (strncmp(p, "v ", 2) == 0) {
+			seenVerts++;
+		}
+		else if (strncmp(p, "vt ", 3) == 0) {
+			seenUvs++;
+		}
+		else if (strncmp(p, "vn ", 3) == 0) {
+			seenNormals++;
+		}
+		else if (strncmp(p, "usemtl ", 7) == 0) {
+			currentMaterial = findMaterial(&model, p + 7);
+		}
+		else if (strncmp(p, "f ", 2) == 0) {
+			if (currentMaterial < 0) {
+				currentMaterial = findMaterial(&model, "");
+			}
+
+			int n = 0;
+			p += 2;
+			while (true) {
+				while (*p == ' ' || *p == '\t') p++;
+				if (*p == 0) break;
+
+				poly = grow(poly, &polyCap, n, sizeof(Corner));
+				if (!parseCorner(&p, &poly[n++], seenVerts, seenUvs, seenNormals)) {
+					printf("%s:%d: Invalid face\n", objPath, lineNumber);
+					ok = false;
+					break;
+				}
+			}
+			if (!ok || n < 3) continue;
+
+			for (int i = 0; i < n && ok; i++) {
+				Corner c = poly[i];
+				uint32_t slot = hashCorner(c) % dedupeSize;
+				Corner k = dedupeKeys[slot];
+
+				if (dedupeValues[slot] == -1 || k.v != c.v || k.vt != c.vt || k.vn != c.vn) {
+					grVertex v;
+					v.pos = *(const vec3*)pageCache_Get(&cache, 0, c.v);
+					v.uv = c.vt >= 0 ? *(const vec2*)pageCache_Get(&cache, 1, c.vt) : (vec2) { 0, 0 };
+					v.normal = c.vn >= 0 ? *(const vec3*)pageCache_Get(&cache, 2, c.vn) : (vec3) { 0, 0, 0 };
+					if (cache.failed) {
+						printf("Error reading temporary files for %s\n", objPath);
+						ok = false;
+						break;
+					}
+					fwrite(&v, sizeof(v), 1, vertsFile);
+
+					dedupeKeys[slot] = c;
+					dedupeValues[slot] = numVerts++;
+				}
+
+				poly[i].v = dedupeValues[slot];
+			}
+
+			IndexWriter* w = &writers[currentMaterial];
+			for (int i = 1; i < n - 1 && ok; i++) {
+				if (w->count + 3 > writerCapacity && !indexWriter_Flush(w, out)) {
+					printf("Error writing %s\n", outPath);
+					ok = false;
+					break;
+				}
+				w->buffer[w->count++] = poly[0].v;
+				w->buffer[w->count++] = poly[i + 1].v;
+				w->buffer[w->count++] = poly[i].v;
+			}
+		}
+	}
+
+	for (int i = 0; i < model.numMaterials && ok; i++) {
+		ok = indexWriter_Flush(&writers[i], out);
+		if (!ok) {
+			printf("Error writing %s\n", outPath);
+		}
+	}
+	ok = ok && checkTemp(vertsFile, tempPaths[3]);
+
+	if (ok) {
+
+		BinaryHeader header = { BINARY_MAGIC, numVerts, (int)numTris, model.numMaterials };
+		fseek(out, 0, SEEK_SET);
+		fwrite(&header, sizeof(header), 1, out);
+		fwrite(model.materials, sizeof(objMaterial), model.numMaterials, out);
+		fwrite(counts, sizeof(int), model.numMaterials, out);
+
+		// Append the vertices, reusing the read window as the copy buffer
+		fseek64(out, indicesOffset + numTris * 3 * sizeof(int), SEEK_SET);
+		rewind(vertsFile);
+		size_t n;
+		long long copied = 0;
+		while ((n = fread(window, 1, windowSize, vertsFile)) > 0) {
+			fwrite(window, 1, n, out);
+			copied += n;
+		}
+
+		if (ferror(vertsFile) || copied != numVerts * (long long)sizeof(grVertex)) {
+			printf("Error reading temporary file %s\n", tempPaths[3]);
+			ok = false;
+		}
+		else if (ferror(out)) {
+			printf("Error writing %s\n", outPath);
+			ok = false;
+		}
+	}
+
+	free(poly);
+	free(writerBuffers);
+	free(writers);
+	free(dedupeValues);
+	free(dedupeKeys);
+	free(cache.tags);
+	free(cache.data);
+	free(counts);
+	free(model.materials);
+	free(window);
+
+	fclose(f);
+	for (int i = 0; i < 4; i++) {
+		FILE* t = i < 3 ? attribs[i] : vertsFile;
+		if (t) {
+			fclose(t);
+			remove(tempPaths[i]);
+		}
+	}
+	if (out) {
+		if (fclose(out) != 0 && ok) {
+			printf("Error writing %s\n", outPath);
+			ok = false;
+		}
+		if (!ok) {
+			remove(outPath);
+		}
+	}
+
+	if (ok) {
+		printf("Converted %s: %d vertices, %lld triangles, %d materials, attribute cache hit rate %.1f%%\n",
+			objPath, numVerts, numTris, model.numMaterials,
+			100.0 * cache.hits / max(cache.hits + cache.misses, 1));
+	}
+	return ok;
+}
+
+bool objLoadBinary(objModel* model, const char* path) {
+	memset(model, 0, sizeof(objModel));
+
+	FILE* f = fopen(path, "rb");
+	if (!f) {
+		printf("Unable to open file %s\n", path);
+		return false;
+	}
+
+	BinaryHeader header;
+	if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, BINARY_MAGIC, sizeof(header.magic)) != 0) {
+		printf("%s is not a binary mesh\n", path);
+		fclose(f);
+		return false;
+	}
+
+	// Everything is allocated from the header, so it has to agree with the file's size
+	long long fileSize = fseek64(f, 0, SEEK_END) == 0 ? ftell64(f) : -1;
+	long long dataSize = (long long)sizeof(header) + header.numMaterials * (long long)(sizeof(objMaterial) + sizeof(int)) +
+		header.numTris * 3LL * (long long)sizeof(int) + header.numVerts * (long long)sizeof(grVertex);
+	if (header.numVerts < 0 || header.numTris < 0 || header.numMaterials < 0 || dataSize > fileSize ||
+		fseek64(f, sizeof(header), SEEK_SET) != 0) {
+		printf("%s is truncated or corrupt\n", path);
+		fclose(f);
+		return false;
+	}
+
+	grMesh* mesh = &model->mesh;
+	model->numMaterials = header.numMaterials;
+	model->materials = xmalloc(max(header.numMaterials, 1) * sizeof(objMaterial));
+	mesh->numSubMeshes = header.numMaterials;
+	mesh->subMeshes = xmalloc(max(header.numMaterials, 1) * sizeof(grSubMesh));
+	mesh->numVerts = header.numVerts;
+	mesh->verts = xmalloc(max(header.numVerts, 1) * sizeof(grVertex));
+	mesh->count = header.numTris;
+	mesh->indices = xmalloc((size_t)max(header.numTris, 1) * 3 * sizeof(int));
+	mesh->modelMat = mat4_identity();
+
+	bool ok = fread(model->materials, sizeof(objMaterial), header.numMaterials, f) == (size_t)header.numMaterials;
+	for (int i = 0; i < header.numMaterials && ok; i++) {
+		objMaterial* m = &model->materials[i];
+		m->name[sizeof(m->name) - 1] = '\0';
+		m->diffuseMap[sizeof(m->diffuseMap) - 1] = '\0';
+	}
+
+	// The sub meshes have to cover the triangles exactly
+	long long first = 0;
+	for (int i = 0; i < header.numMaterials && ok; i++) {
+		int count;
+		ok = fread(&count, sizeof(int), 1, f) == 1 && count >= 0 && first + count <= header.numTris;
+		mesh->subMeshes[i] = (grSubMesh){ (int)first, count, NULL };
+		first += count;
+	}
+	ok = ok && first == header.numTris;
+
+	ok = ok && fread(mesh->indices, sizeof(int) * 3, header.numTris, f) == (size_t)header.numTris;
+	for (size_t i = 0; i < (size_t)header.numTris * 3 && ok; i++) {
+		ok = mesh->indices[i] >= 0 && mesh->indices[i] < header.numVerts;
+	}
+
+	ok = ok && fread(mesh->verts, sizeof(grVertex), header.numVerts, f) == (size_t)header.numVerts;
+	fclose(f);
+
+	if (!ok) {
+		printf("%s is truncated or corrupt\n", path);
+		objFree(model);
+	}
+	return ok;
+}
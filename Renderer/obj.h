@@ -0,0 +1,39 @@
+#ifndef OBJ_H
+#define OBJ_H
+
+#include <stdbool.h>
+
+#include "gr.h"
+
+typedef struct {
+	char name[256];
+	char diffuseMap[1024]; // map_Kd, relative to the working directory. Empty if there isn't one.
+} objMaterial;
+
+// A Wavefront OBJ file loaded into a grMesh.
+// There is one sub mesh per material, in the same order as the materials array,
+// and the triangles are sorted by material so each one can be drawn as a single batch.
+// The sub mesh textures are left NULL for the caller to fill in.
+typedef struct {
+	grMesh mesh;
+	objMaterial* materials;
+	int numMaterials;
+} objModel;
+
+// Supports triangles, quads and n-gons (fan triangulated), the v, v/vt, v//vn and v/vt/vn
+// face forms, negative (relative) indices, and multiple materials from mtllib/usemtl.
+bool objLoad(objModel* model, const char* path);
+void objFree(objModel* model);
+
+#define OBJ_MIN_MEMORY_BUDGET (1 << 20)
+
+// Convert an OBJ to the binary mesh format without ever holding the text, the
+// attribute arrays or the output mesh in memory. Working memory stays within
+// memoryBudget bytes (at least OBJ_MIN_MEMORY_BUDGET) by spilling to temporary
+// files next to outPath, so files bigger than RAM can be converted.
+bool objConvert(const char* objPath, const char* outPath, size_t memoryBudget);
+
+// Load a file written by objConvert. This only needs memory for the final mesh.
+bool objLoadBinary(objModel* model, const char* path);
+
+#endif
@@ -0,0 +1,27 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "util.h"
+
+void* xmalloc(size_t size) {
+	void* p = malloc(size);
+	if (p == NULL) {
+		fprintf(stderr, "Error allocating %zu bytes\n", size);
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+void* grow(void* p, int* capacity, int count, size_t elemSize) {
+	if (count < *capacity) {
+		return p;
+	}
+
+	*capacity = *capacity ? *capacity * 2 : 64;
+	p = realloc(p, *capacity * elemSize);
+	if (p == NULL) {
+		fprintf(stderr, "Error allocating %zu bytes\n", *capacity * elemSize);
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
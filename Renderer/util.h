@@ -2,5 +2,17 @@
 #define UTIL_H
 
 void* xmalloc(size_t size);
+// Growable array helper. Makes room for element count, doubling the capacity
+// if needed, and returns the (possibly moved) array.
+void* grow(void* p, int* capacity, int count, size_t elemSize);
+
+// Files can be bigger than 2GB and long is 32 bits on Windows
+#ifdef _MSC_VER
+#define fseek64 _fseeki64
+#define ftell64 _ftelli64
+#else
+#define fseek64 fseeko
+#define ftell64 ftello
+#endif
 
 #endif